@@ -0,0 +1,26 @@
+#ifndef SUPERCAMERA_ALLOCATION_STATS_HPP
+#define SUPERCAMERA_ALLOCATION_STATS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace supercamera {
+
+// Heap allocations made through operator new. The counters come from
+// supercamera_allocation_stats.cpp, which replaces the global operator new
+// and delete with counting malloc/free wrappers; a program that calls these
+// functions links it in.
+struct AllocationCounters {
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+};
+
+// Every thread, since the program started.
+AllocationCounters process_allocations();
+
+// The calling thread only, so a test is not disturbed by other threads.
+AllocationCounters thread_allocations();
+
+} // namespace supercamera
+
+#endif
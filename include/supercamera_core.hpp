@@ -6,40 +6,122 @@
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
 
 namespace supercamera {
 
 using ByteVector = std::vector<uint8_t>;
 
+// Dual-lens endoscopes report which lens a frame comes from; single-lens
+// models always report lens 0.
+constexpr uint8_t MAX_LENSES = 2;
+
+// Raw accelerometer reading from the camera's G-sensor. Axes follow the image:
+// +x towards the right edge, +y towards the bottom edge.
+struct GSensorSample {
+    int16_t x = 0;
+    int16_t y = 0;
+};
+
 struct CapturedFrame {
     ByteVector jpeg;
     uint16_t source_id;
     uint32_t frame_id;
     uint64_t timestamp_us;
+    std::optional<GSensorSample> g_sensor = {};
+    // Lens the frame was captured with (the UPP cam_num).
+    uint8_t lens = 0;
+    // Focus score (JpegTranscoder::sharpness), when a consumer computed it.
+    std::optional<double> sharpness = {};
 };
 
 using FrameCallback = std::function<void(const CapturedFrame &)>;
 using ButtonCallback = std::function<void()>;
 
-class SupercameraCapture {
+// Button sink for SupercameraCapture::run_with() that does nothing.
+struct IgnoreButton {
+    void operator()() const {}
+};
+
+struct LensState;
+
+class FrameSource {
 public:
-    explicit SupercameraCapture(uint16_t source_id = 0, ButtonCallback button_callback = {});
-    ~SupercameraCapture();
+    virtual ~FrameSource() = default;
+
+    // Blocks, delivering frames to frame_callback until request_stop() is
+    // called from another thread or the source is exhausted.
+    virtual void run(const FrameCallback &frame_callback) = 0;
+    virtual void request_stop() = 0;
+};
+
+class SupercameraCapture : public FrameSource {
+public:
+    // With split_lenses, frames from lens n get source_id + n and their own
+    // frame_id sequence, so each lens is a separate logical source; the caller
+    // reserves MAX_LENSES consecutive source ids per device.
+    explicit SupercameraCapture(uint16_t source_id = 0, ButtonCallback button_callback = {},
+                                bool split_lenses = false);
+    ~SupercameraCapture() override;
 
     SupercameraCapture(const SupercameraCapture &) = delete;
     SupercameraCapture &operator=(const SupercameraCapture &) = delete;
 
-    void run(const FrameCallback &frame_callback);
-    void request_stop();
+    // Adapter over run_with() for std::function callbacks.
+    void run(const FrameCallback &frame_callback) override;
+    void request_stop() override;
     static size_t available_devices();
 
+    // Like run(), with the sinks as template parameters: packet parsing and
+    // the sinks (lambdas, or filter_sink()/fan_out() compositions) inline into
+    // one loop instead of calling through std::function. Defined in
+    // supercamera_upp_parser.hpp; the constructor's button callback is not
+    // used here.
+    template <typename FrameSink, typename ButtonSink = IgnoreButton>
+    void run_with(FrameSink &&frame_sink, ButtonSink &&button_sink = {});
+
+    // Preallocates the frame assembly buffers for JPEGs of up to `bytes` when
+    // run() or run_with() starts, so capture does not allocate while it
+    // warms up. Larger frames still grow them. Call before run().
+    void set_frame_budget(size_t bytes);
+
+    // Delivers frames whose packets carry the has_g flag, with the decoded
+    // G-sensor word in CapturedFrame::g_sensor. Off by default: the packet
+    // layout is inferred, so such frames are dropped as they always were
+    // unless a caller asks for orientation data. Call before run().
+    void set_accept_g_sensor(bool accept);
+
+    // Requests frames from one lens only, or from every lens with nullopt.
+    // Packets of other lenses are dropped as they arrive, before a frame is
+    // assembled. The firmware itself switches lenses on a long button press;
+    // no USB command for it is known, so until the user switches, a lens
+    // that is not streaming delivers nothing. Thread-safe.
+    void select_lens(std::optional<uint8_t> lens);
+    std::optional<uint8_t> selected_lens() const;
+
+    // Lens of the most recent frame the firmware sent, whether or not it was
+    // delivered; nullopt before the first frame. Thread-safe.
+    std::optional<uint8_t> active_lens() const;
+
 private:
+    enum class ReadResult {
+        Packet,
+        Retry,
+        Disconnected,
+    };
+
+    ReadResult read_packet(ByteVector &buf);
+    LensState &lens_state();
+
     struct Impl;
     std::unique_ptr<Impl> impl_;
     std::atomic_bool stop_requested_ = false;
     uint16_t source_id_ = 0;
     ButtonCallback button_callback_;
+    bool split_lenses_ = false;
+    size_t frame_budget_ = 0;
+    bool accept_g_sensor_ = false;
 };
 
 } // namespace supercamera
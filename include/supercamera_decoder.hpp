@@ -0,0 +1,97 @@
+#ifndef SUPERCAMERA_DECODER_HPP
+#define SUPERCAMERA_DECODER_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "supercamera_core.hpp"
+#include "supercamera_worker_pool.hpp"
+
+namespace supercamera {
+
+struct JpegInfo {
+    int width = 0;
+    int height = 0;
+    int subsampling = -1;
+    int colorspace = -1;
+};
+
+// Interleaved 8-bit BGR pixels. The buffer is reused across decodes and only
+// grows when a larger frame arrives.
+struct BgrImage {
+    ByteVector pixels;
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+};
+
+// Planar Y/Cb/Cr at the JPEG's native subsampling (no color conversion or
+// chroma upsampling). Grayscale JPEGs only fill plane 0.
+struct YuvImage {
+    std::array<ByteVector, 3> planes;
+    std::array<int, 3> widths = {};
+    std::array<int, 3> heights = {};
+    std::array<int, 3> strides = {};
+    int plane_count = 0;
+    int width = 0;
+    int height = 0;
+    int subsampling = -1;
+};
+
+// Owns one TurboJPEG decompressor handle. Handles are not thread-safe; use one
+// decoder per thread, e.g. through for_current_thread().
+class JpegDecoder {
+public:
+    JpegDecoder();
+    ~JpegDecoder();
+
+    JpegDecoder(const JpegDecoder &) = delete;
+    JpegDecoder &operator=(const JpegDecoder &) = delete;
+
+    bool read_info(std::span<const uint8_t> jpeg, JpegInfo *out);
+
+    // scale_denom selects a reduced-size IDCT (1, 2, 4 or 8). At 8 every block
+    // collapses to its DC term, so the entropy decoder skips storing AC
+    // coefficients and no IDCT arithmetic is done at all.
+    //
+    // With a pool, a JPEG whose restart intervals (DRI/RSTn) each span whole
+    // MCU rows is split at the restart markers into horizontal strips that
+    // are decoded in parallel, each straight into its rows of `out`. Other
+    // JPEGs, and any JPEG a strip fails on, are decoded serially. In 4:2:0
+    // images the chroma upsampling cannot look across a strip edge, so the
+    // rows next to it may differ slightly from a serial decode.
+    bool decode_bgr(std::span<const uint8_t> jpeg, BgrImage *out, int scale_denom = 1, WorkerPool *pool = nullptr);
+    bool decode_yuv(std::span<const uint8_t> jpeg, YuvImage *out, int scale_denom = 1);
+
+    // Largest reduction whose output still covers a dst_width x dst_height
+    // tile, so callers only pay for the pixels they show.
+    static int pick_scale_denom(int src_width, int src_height, int dst_width, int dst_height);
+    static int scaled_size(int size, int scale_denom);
+
+    // Why the last call failed, or the warning of a decode that succeeded
+    // despite damaged data.
+    const std::string &last_error() const {
+        return last_error_;
+    }
+
+    static JpegDecoder &for_current_thread();
+
+private:
+    bool fail();
+    // Success for 0 and for TurboJPEG warnings, whose message goes to
+    // last_error_; fail() otherwise.
+    bool check_decode(int result);
+    bool decode_bgr_strips(std::span<const uint8_t> jpeg, BgrImage *out, int scale_denom, WorkerPool &pool);
+
+    void *handle_ = nullptr;
+    std::string last_error_;
+    std::vector<ByteVector> strips_;
+};
+
+} // namespace supercamera
+
+#endif
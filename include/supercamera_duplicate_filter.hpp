@@ -0,0 +1,64 @@
+#ifndef SUPERCAMERA_DUPLICATE_FILTER_HPP
+#define SUPERCAMERA_DUPLICATE_FILTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "supercamera_core.hpp"
+#include "supercamera_decoder.hpp"
+
+namespace supercamera {
+
+// 64-bit non-cryptographic hash of a byte range, SSE2-vectorized where
+// available (the scalar path computes the same value).
+uint64_t hash_bytes(std::span<const uint8_t> data);
+
+// Mean absolute difference of two equally sized 8-bit images.
+double mean_abs_diff(std::span<const uint8_t> a, std::span<const uint8_t> b);
+
+struct DuplicateFilterOptions {
+    // Also treat frames whose luma DC thumbnails differ by at most this many
+    // levels on average as duplicates. 0 only suppresses bit-identical frames.
+    double dc_threshold = 0.0;
+    // Let a duplicate through anyway once this long has passed since the last
+    // accepted frame of the source, so receivers can tell the stream is alive.
+    uint32_t keepalive_ms = 1000;
+};
+
+// Decides per source whether a frame repeats the last frame that was let
+// through. Comparing against the last accepted frame rather than the previous
+// one keeps slow drift from being suppressed forever. Not thread-safe.
+class DuplicateFilter {
+public:
+    explicit DuplicateFilter(const DuplicateFilterOptions &options);
+
+    // True when the frame should be sent or recorded.
+    bool accept(const CapturedFrame &frame);
+
+    uint64_t suppressed_count() const {
+        return suppressed_;
+    }
+
+private:
+    struct SourceState {
+        bool seen = false;
+        uint64_t hash = 0;
+        uint64_t accepted_us = 0;
+        ByteVector dc;
+        int dc_width = 0;
+        int dc_height = 0;
+    };
+
+    bool dc_similar(const SourceState &state, const YuvImage &thumbnail) const;
+
+    DuplicateFilterOptions options_;
+    std::vector<SourceState> sources_;
+    YuvImage thumbnail_;
+    uint64_t suppressed_ = 0;
+};
+
+} // namespace supercamera
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SUPERCAMERA_H264_HPP
+#define SUPERCAMERA_H264_HPP
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+
+#include "supercamera_core.hpp"
+
+namespace supercamera {
+
+struct H264Options {
+    uint32_t bitrate_kbps = 1000;
+    // Nominal frame rate for rate control.
+    uint32_t fps = 30;
+    // Frames over which a column of intra macroblocks sweeps the picture once.
+    // Replaces periodic IDR frames, so there are no keyframe bitrate spikes.
+    uint32_t refresh_frames = 60;
+    // Encoder threads, 0 for one per CPU. Threads split each frame into
+    // slices and add no latency.
+    uint32_t threads = 0;
+};
+
+// Software H.264 encoder (x264) tuned for latency: no B-frames, no lookahead,
+// periodic intra refresh instead of keyframes, and a VBV buffer of two frames.
+// Input JPEGs are decoded to YUV and converted to 4:2:0. One instance per
+// stream; not thread-safe.
+class H264Encoder {
+public:
+    // Throws std::runtime_error when built without x264.
+    explicit H264Encoder(const H264Options &options);
+    ~H264Encoder();
+
+    H264Encoder(const H264Encoder &) = delete;
+    H264Encoder &operator=(const H264Encoder &) = delete;
+
+    // Encodes one frame as an Annex B access unit. The first frame, and the
+    // first after the frame size changes, is an IDR with SPS/PPS. Width and
+    // height must be even.
+    bool encode(std::span<const uint8_t> jpeg, ByteVector *out);
+
+    const std::string &last_error() const;
+
+    // Whether this build has H.264 support.
+    static bool available();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace supercamera
+
+#endif
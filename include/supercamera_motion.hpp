@@ -0,0 +1,94 @@
+#ifndef SUPERCAMERA_MOTION_HPP
+#define SUPERCAMERA_MOTION_HPP
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "supercamera_core.hpp"
+#include "supercamera_decoder.hpp"
+
+namespace supercamera {
+
+// Rectangle in full-resolution source pixels.
+struct MotionRegion {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+struct MotionOptions {
+    // Luma change, in levels, that marks an 8x8 block as changed.
+    int block_threshold = 12;
+    // Fraction of blocks that must change before a frame counts as motion;
+    // single noisy blocks are ignored.
+    double min_changed_fraction = 0.002;
+    // Motion ends once no frame has shown motion for this long.
+    uint32_t hold_ms = 2000;
+    // The background moves 1/2^learn_shift of the way to each new frame.
+    int learn_shift = 5;
+    // Frames used only to build the background before detection starts.
+    uint32_t warmup_frames = 10;
+};
+
+struct MotionEvent {
+    enum class Kind : uint8_t {
+        Started,
+        Ended,
+    };
+
+    Kind kind = Kind::Started;
+    uint16_t source_id = 0;
+    uint32_t frame_id = 0;
+    uint64_t timestamp_us = 0;
+    // Blocks that changed in the triggering frame (Started), or in the last
+    // frame that showed motion (Ended).
+    MotionRegion region;
+    double changed_fraction = 0.0;
+};
+
+// Compressed-domain motion detector for one source. Each frame is reduced to
+// its luma DC coefficients with a 1/8-scale decode (one value per 8x8 block,
+// no IDCT) and compared with a running-average background. Costs about one
+// entropy decode per frame. Not thread-safe.
+class MotionDetector {
+public:
+    explicit MotionDetector(const MotionOptions &options = {});
+
+    // Returns an event when motion starts or ends. Frames that fail to decode
+    // are ignored.
+    std::optional<MotionEvent> update(const CapturedFrame &frame);
+
+    // Same as update() for an already extracted DC image (one luma value per
+    // 8x8 block).
+    std::optional<MotionEvent> update_dc(std::span<const uint8_t> dc, int width, int height, int stride,
+                                         uint16_t source_id, uint32_t frame_id, uint64_t timestamp_us);
+
+    bool in_motion() const {
+        return active_;
+    }
+
+    // Changed blocks of the most recent frame, empty when it showed no motion.
+    const MotionRegion &last_region() const {
+        return last_region_;
+    }
+
+private:
+    MotionOptions options_;
+    YuvImage thumbnail_;
+    std::vector<int32_t> background_; // 8.8 fixed point
+    int width_ = 0;
+    int height_ = 0;
+    uint32_t frames_seen_ = 0;
+    bool active_ = false;
+    uint64_t last_motion_us_ = 0;
+    MotionRegion last_region_;
+    MotionRegion active_region_;
+    double active_fraction_ = 0.0;
+};
+
+} // namespace supercamera
+
+#endif
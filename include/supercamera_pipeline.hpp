@@ -0,0 +1,348 @@
+#ifndef SUPERCAMERA_PIPELINE_HPP
+#define SUPERCAMERA_PIPELINE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "supercamera_bounded_queue.hpp"
+#include "supercamera_worker_pool.hpp"
+
+namespace supercamera {
+
+struct StageOptions {
+    // Input queue slots, rounded up to a power of two. An item pushed while
+    // the queue is full is dropped, like the latest-frame buffers drop stale
+    // frames: a live stream would rather skip a frame than fall behind.
+    size_t queue_capacity = 8;
+    // Pool tasks that may run the stage at once. Above 1 the stage function
+    // must be stateless (or synchronize itself); its outputs are put back in
+    // push order per source before they reach the next stage.
+    size_t concurrency = 1;
+};
+
+struct StageMetrics {
+    std::string name;
+    // Items the stage function ran on, and how many of those it filtered out.
+    uint64_t processed = 0;
+    uint64_t filtered = 0;
+    // Items rejected by a full input queue (or pushed after stop()).
+    uint64_t dropped = 0;
+    // From the push into this stage until its function returned, so queueing
+    // time is included.
+    uint64_t latency_mean_us = 0;
+    uint64_t latency_max_us = 0;
+    size_t queue_depth = 0;
+    size_t queue_depth_max = 0;
+    size_t queue_capacity = 0;
+};
+
+// One line, e.g. for a stats log: "name: done=.. filtered=.. dropped=..
+// latency=mean/maxus queue=depth/max/capacity".
+std::string format_stage_metrics(const StageMetrics &metrics);
+
+// Where a stage sends its output. Items travel with the id of the source they
+// came from; sources are numbered 0 .. source_count - 1 of the pipeline.
+template <typename T>
+class StageInput {
+public:
+    virtual ~StageInput() = default;
+
+    // False when the item was dropped.
+    virtual bool push(uint16_t source, T value) = 0;
+};
+
+class StageBase {
+public:
+    virtual ~StageBase() = default;
+
+    virtual StageMetrics metrics() const = 0;
+    // Rejects further pushes and waits until the stage's running tasks have
+    // drained its queue.
+    virtual void stop() = 0;
+    virtual bool idle() const = 0;
+};
+
+// A typed processing step. The function gets each input item and returns the
+// output for the next stage, or nullopt to filter the item out. Out = void
+// makes a sink. Stages run on the pipeline's WorkerPool: a pool task is only
+// scheduled while the stage has queued input, so idle stages cost nothing.
+template <typename In, typename Out>
+class Stage final : public StageInput<In>, public StageBase {
+public:
+    static constexpr bool IS_SINK = std::is_void_v<Out>;
+    using Output = std::conditional_t<IS_SINK, std::monostate, Out>;
+    using Function = std::function<std::conditional_t<IS_SINK, void, std::optional<Output>>(In &&)>;
+
+    Stage(std::string name, Function fn, const StageOptions &options, WorkerPool &pool, uint16_t source_count)
+        : name_(std::move(name)),
+          fn_(std::move(fn)),
+          concurrency_(std::max<size_t>(options.concurrency, 1)),
+          pool_(pool),
+          queue_(options.queue_capacity),
+          next_sequence_(source_count),
+          resequencers_(source_count) {}
+
+    // Connects the output to `next` and returns it, so chains read
+    // left to right: a.then(b).then(c).
+    template <typename Next>
+        requires(!IS_SINK)
+    Next &then(Next &next) {
+        next_ = &next;
+        return next;
+    }
+
+    bool push(uint16_t source, In value) override {
+        // Counted as running, so stop() cannot return while this push can
+        // still schedule a task.
+        ++running_;
+        const bool accepted = !stopped_.load() && source < next_sequence_.size() && enqueue(source, value);
+        if (!accepted) {
+            ++dropped_;
+        }
+        --running_;
+        return accepted;
+    }
+
+
+    StageMetrics metrics() const override {
+        const uint64_t processed = processed_.load();
+        return {
+            .name = name_,
+            .processed = processed,
+            .filtered = filtered_.load(),
+            .dropped = dropped_.load(),
+            .latency_mean_us = processed > 0 ? latency_total_ns_.load() / processed / 1000 : 0,
+            .latency_max_us = latency_max_ns_.load() / 1000,
+            .queue_depth = queue_.size_approx(),
+            .queue_depth_max = queue_depth_max_.load(),
+            .queue_capacity = queue_.capacity(),
+        };
+    }
+
+    void stop() override {
+        stopped_.store(true);
+        // Only at shutdown, so polling is fine. A running task's last access
+        // to the stage is its decrement of running_.
+        while (running_.load() != 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    bool idle() const override {
+        return running_.load() == 0 && queue_.size_approx() == 0;
+    }
+
+private:
+    struct Envelope {
+        In value{};
+        uint64_t enqueued_ns = 0;
+        uint64_t sequence = 0;
+        uint16_t source = 0;
+    };
+
+    static constexpr uint64_t DRAIN_SLICE_NS = 1'000'000;
+
+    struct Resequencer {
+        uint64_t next = 0;
+        std::map<uint64_t, std::optional<Output>> done;
+    };
+
+    static uint64_t now_ns() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now().time_since_epoch())
+                                         .count());
+    }
+
+    template <typename T>
+    static void update_max(std::atomic<T> &max, T value) {
+        T current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    bool enqueue(uint16_t source, In &value) {
+        // Ordered stages number their input per source. A dropped item still
+        // consumed its number, so it is released as a gap.
+        const uint64_t sequence = reorders() ? next_sequence_[source].fetch_add(1) : 0;
+        Envelope envelope = {
+            .value = std::move(value),
+            .enqueued_ns = now_ns(),
+            .sequence = sequence,
+            .source = source,
+        };
+        if (!queue_.try_push(std::move(envelope))) {
+            if (reorders()) {
+                release(source, sequence, std::nullopt);
+            }
+            return false;
+        }
+        update_max(queue_depth_max_, queue_.size_approx());
+        schedule();
+        return true;
+    }
+
+    bool reorders() const {
+        return !IS_SINK && concurrency_ > 1;
+    }
+
+    void schedule() {
+        size_t active = active_.load();
+        while (active < concurrency_) {
+            if (active_.compare_exchange_weak(active, active + 1)) {
+                ++running_;
+                pool_.submit([this] { drain(); });
+                return;
+            }
+        }
+    }
+
+    void drain() {
+        const uint64_t slice_end_ns = now_ns() + DRAIN_SLICE_NS;
+        Envelope envelope;
+        while (queue_.try_pop(&envelope)) {
+            process(std::move(envelope));
+            if (now_ns() >= slice_end_ns) {
+                break;
+            }
+        }
+        // With more input waiting after a time slice, go back to the end of
+        // the pool's queue rather than keep the worker: stages sharing a pool
+        // take turns.
+        if (queue_.size_approx() > 0) {
+            pool_.submit([this] { drain(); });
+            return;
+        }
+        // Give the slot back, then look again: a push that found every slot
+        // taken relies on a running task to pick its item up.
+        size_t active = active_.fetch_sub(1) - 1;
+        if (queue_.size_approx() > 0 && active < concurrency_ && active_.compare_exchange_strong(active, active + 1)) {
+            pool_.submit([this] { drain(); });
+            return;
+        }
+        --running_;
+    }
+
+    void process(Envelope &&envelope) {
+        if constexpr (IS_SINK) {
+            fn_(std::move(envelope.value));
+            record(envelope);
+        } else {
+            std::optional<Output> out = fn_(std::move(envelope.value));
+            record(envelope);
+            if (!out) {
+                ++filtered_;
+            }
+            if (reorders()) {
+                release(envelope.source, envelope.sequence, std::move(out));
+            } else {
+                forward(envelope.source, std::move(out));
+            }
+        }
+    }
+
+    void record(const Envelope &envelope) {
+        const uint64_t latency_ns = now_ns() - envelope.enqueued_ns;
+        latency_total_ns_ += latency_ns;
+        update_max(latency_max_ns_, latency_ns);
+        ++processed_;
+    }
+
+    // Forwards outputs of one source in sequence order; a nullopt fills the
+    // gap of a filtered or dropped item.
+    void release(uint16_t source, uint64_t sequence, std::optional<Output> out) {
+        std::lock_guard lock(resequence_mtx_);
+        Resequencer &resequencer = resequencers_[source];
+        if (sequence != resequencer.next) {
+            resequencer.done.emplace(sequence, std::move(out));
+            return;
+        }
+        forward(source, std::move(out));
+        ++resequencer.next;
+        for (auto it = resequencer.done.begin();
+             it != resequencer.done.end() && it->first == resequencer.next; it = resequencer.done.erase(it)) {
+            forward(source, std::move(it->second));
+            ++resequencer.next;
+        }
+    }
+
+    void forward(uint16_t source, std::optional<Output> out) {
+        if (out && next_ != nullptr) {
+            next_->push(source, std::move(*out));
+        }
+    }
+
+    std::string name_;
+    Function fn_;
+    size_t concurrency_;
+    WorkerPool &pool_;
+    StageInput<Output> *next_ = nullptr;
+    BoundedQueue<Envelope> queue_;
+    std::vector<std::atomic_uint64_t> next_sequence_;
+    std::mutex resequence_mtx_;
+    std::vector<Resequencer> resequencers_;
+
+    // active_ counts the pool tasks holding one of the concurrency slots;
+    // running_ counts pushes in progress and scheduled tasks, including a task
+    // between giving its slot back and returning.
+    std::atomic_size_t active_ = 0;
+    std::atomic_size_t running_ = 0;
+    std::atomic_bool stopped_ = false;
+
+    std::atomic_uint64_t processed_ = 0;
+    std::atomic_uint64_t filtered_ = 0;
+    std::atomic_uint64_t dropped_ = 0;
+    std::atomic_uint64_t latency_total_ns_ = 0;
+    std::atomic_uint64_t latency_max_ns_ = 0;
+    std::atomic_size_t queue_depth_max_ = 0;
+};
+
+// Owns a set of stages sharing one WorkerPool, which must outlive it. Add
+// stages upstream first: stop() and the destructor stop them in that order,
+// so every stage drains into a downstream stage that still accepts input.
+class Pipeline {
+public:
+    Pipeline(WorkerPool &pool, uint16_t source_count);
+    ~Pipeline();
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+
+    template <typename In, typename Out = In>
+    Stage<In, Out> &add_stage(std::string name, typename Stage<In, Out>::Function fn,
+                              const StageOptions &options = {}) {
+        auto stage = std::make_unique<Stage<In, Out>>(std::move(name), std::move(fn), options, pool_, source_count_);
+        Stage<In, Out> &ref = *stage;
+        stages_.push_back(std::move(stage));
+        return ref;
+    }
+
+    void stop();
+
+    // Blocks until every stage is idle, e.g. after the last push of a batch.
+    void wait_idle() const;
+
+    std::vector<StageMetrics> metrics() const;
+
+private:
+    WorkerPool &pool_;
+    uint16_t source_count_;
+    std::vector<std::unique_ptr<StageBase>> stages_;
+};
+
+} // namespace supercamera
+
+#endif
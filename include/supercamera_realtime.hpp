@@ -0,0 +1,91 @@
+#ifndef SUPERCAMERA_REALTIME_HPP
+#define SUPERCAMERA_REALTIME_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace supercamera {
+
+// Where and how a latency-sensitive thread runs. The defaults leave the
+// thread as it was created.
+struct ThreadOptions {
+    std::optional<int> cpu;
+    // SCHED_FIFO priority, 1 (lowest) to 99; 0 keeps the normal policy.
+    int fifo_priority = 0;
+};
+
+// Applies `options` to the calling thread. Throws std::runtime_error with the
+// kernel's reason, e.g. when SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit.
+void apply_thread_options(const ThreadOptions &options);
+
+// What a failed lock_process_memory() needs, and what a thread or buffer that
+// cannot be created after it succeeded most likely needs too.
+inline constexpr const char *MEMLOCK_HINT = "needs CAP_IPC_LOCK or an unlimited memlock limit";
+
+// Locks every current and future page of the process in RAM, so frame pools
+// never page-fault. Throws std::runtime_error if not permitted. Without
+// CAP_IPC_LOCK a finite memlock limit is refused up front: mlockall() would
+// succeed while the process is small, and every later thread stack or heap
+// mapping past the limit would then fail.
+void lock_process_memory();
+
+struct LatencySummary {
+    uint64_t samples = 0;
+    uint64_t mean_us = 0;
+    uint64_t p99_us = 0;
+    uint64_t max_us = 0;
+};
+
+// "mean/p99/maxus".
+std::string format_latency_summary(const LatencySummary &summary);
+
+// Latency histogram with 1 us buckets up to MAX_BUCKET_US; larger samples
+// share the last bucket but still count towards the exact max. One thread
+// records, any thread may read.
+class LatencyHistogram {
+public:
+    static constexpr size_t MAX_BUCKET_US = 1023;
+
+    void record(uint64_t ns);
+    LatencySummary summary() const;
+
+private:
+    std::array<std::atomic_uint64_t, MAX_BUCKET_US + 1> buckets_{};
+    std::atomic_uint64_t samples_ = 0;
+    std::atomic_uint64_t total_ns_ = 0;
+    std::atomic_uint64_t max_ns_ = 0;
+};
+
+// Measures the scheduling latency a thread with `options` sees, like
+// cyclictest: a thread set up the same way sleeps until an absolute deadline
+// every `interval` and records how late it woke. Runs until destroyed.
+class SchedulingLatencyProbe {
+public:
+    explicit SchedulingLatencyProbe(const ThreadOptions &options,
+                                    std::chrono::microseconds interval = std::chrono::milliseconds(1));
+    ~SchedulingLatencyProbe();
+
+    SchedulingLatencyProbe(const SchedulingLatencyProbe &) = delete;
+    SchedulingLatencyProbe &operator=(const SchedulingLatencyProbe &) = delete;
+
+    LatencySummary summary() const {
+        return histogram_.summary();
+    }
+
+private:
+    void run(ThreadOptions options, std::chrono::microseconds interval);
+
+    LatencyHistogram histogram_;
+    std::atomic_bool stop_requested_ = false;
+    std::thread thread_;
+};
+
+} // namespace supercamera
+
+#endif
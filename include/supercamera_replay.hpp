@@ -0,0 +1,38 @@
+#ifndef SUPERCAMERA_REPLAY_HPP
+#define SUPERCAMERA_REPLAY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "supercamera_core.hpp"
+
+namespace supercamera {
+
+// Replays recorded JPEG frames (e.g. the viewer's pics/ folder) as if they
+// came from a camera, looping until stopped. fps = 0 replays unpaced.
+class ReplayCapture : public FrameSource {
+public:
+    ReplayCapture(uint16_t source_id, std::vector<ByteVector> frames, uint32_t fps = 30);
+
+    ReplayCapture(const ReplayCapture &) = delete;
+    ReplayCapture &operator=(const ReplayCapture &) = delete;
+
+    void run(const FrameCallback &frame_callback) override;
+    void request_stop() override;
+
+    // Loads a single .jpg file, or every .jpg/.jpeg file of a directory in
+    // name order. Throws if nothing usable is found.
+    static std::vector<ByteVector> load_jpegs(const std::string &path);
+
+private:
+    std::vector<ByteVector> frames_;
+    std::atomic_bool stop_requested_ = false;
+    uint16_t source_id_ = 0;
+    uint32_t fps_ = 30;
+};
+
+} // namespace supercamera
+
+#endif
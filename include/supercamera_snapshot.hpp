@@ -0,0 +1,57 @@
+#ifndef SUPERCAMERA_SNAPSHOT_HPP
+#define SUPERCAMERA_SNAPSHOT_HPP
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+
+#include "supercamera_core.hpp"
+
+namespace supercamera {
+
+struct SnapshotOptions {
+    // Candidates are the frames captured at most this long before or after
+    // the trigger.
+    uint32_t window_ms = 250;
+};
+
+// Picks the sharpest frame around a snapshot trigger, so a button press that
+// shakes the scope does not save a motion-blurred frame. Recent frames are
+// only buffered until a trigger. While one is pending, each push scores (one
+// entropy decode) the pushed frame and at most one buffered earlier
+// candidate, so the caller's thread never stalls on the whole window at once.
+// Not thread-safe.
+class SnapshotSelector {
+public:
+    explicit SnapshotSelector(const SnapshotOptions &options);
+
+    // Timestamps use the same clock as CapturedFrame::timestamp_us. A trigger
+    // while one is pending is ignored.
+    void trigger(uint64_t timestamp_us);
+
+    bool pending() const {
+        return trigger_us_.has_value();
+    }
+
+    // Returns the chosen frame, with its sharpness set, from the first frame
+    // captured after the window closes. Candidates that fail to decode are
+    // skipped.
+    std::optional<CapturedFrame> push(const CapturedFrame &frame);
+
+private:
+    uint64_t window_us_;
+    struct Candidate {
+        CapturedFrame frame;
+        std::optional<double> sharpness;
+        bool scored = false;
+    };
+
+    void score(Candidate &candidate);
+
+    std::optional<uint64_t> trigger_us_;
+    std::deque<Candidate> recent_;
+};
+
+} // namespace supercamera
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SUPERCAMERA_STREAM_INTEGRITY_HPP
+#define SUPERCAMERA_STREAM_INTEGRITY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace supercamera {
+
+// CRC-32C (Castagnoli), as used by iSCSI and ext4. Pass a previous result as
+// `crc` to continue it over more data: crc32c(b, crc32c(a)) == crc32c(a + b).
+// Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them; the table
+// fallback computes the same value.
+uint32_t crc32c(std::span<const uint8_t> data, uint32_t crc = 0);
+
+// True when crc32c() runs on CRC instructions rather than the table.
+bool crc32c_hardware_accelerated();
+
+// Offset of the first occurrence of `magic`, in big-endian byte order, in
+// `data`, or data.size() when there is none. SSE2/NEON-vectorized: each step
+// tests 16 positions for the first two magic bytes at once. A receiver that
+// lost sync calls this on its buffered bytes and keeps the last three when
+// nothing is found, since a magic may straddle the next read.
+size_t find_magic(std::span<const uint8_t> data, uint32_t magic);
+
+} // namespace supercamera
+
+#endif
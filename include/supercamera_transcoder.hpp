@@ -0,0 +1,131 @@
+#ifndef SUPERCAMERA_TRANSCODER_HPP
+#define SUPERCAMERA_TRANSCODER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+
+#include "supercamera_core.hpp"
+
+namespace supercamera {
+
+// Lossless rearrangements of the 8x8 coefficient blocks, named like
+// jpegtran's -flip/-rotate/-transpose/-transverse.
+enum class JpegTransform : uint8_t {
+    None,
+    FlipHorizontal,
+    FlipVertical,
+    Rotate90,
+    Rotate180,
+    Rotate270,
+    Transpose,
+    Transverse,
+};
+
+const char *to_string(JpegTransform transform);
+bool parse_jpeg_transform(const std::string &text, JpegTransform *out);
+
+// Region of interest in source pixels. Cropping happens on whole MCUs, so the
+// region is widened outwards to the nearest MCU boundaries (16 pixels for the
+// supported cameras) and clipped to the frame.
+struct CropRegion {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    bool centered = false;
+
+    // Parses jpegtran's "WxH+X+Y", or "WxH" for a region centered in the frame.
+    static bool parse(const std::string &text, CropRegion *out);
+};
+
+// Operations applied in a single entropy decode/encode pass. The crop is
+// taken in source coordinates, before the transform.
+struct TranscodeOptions {
+    std::optional<CropRegion> crop = std::nullopt;
+    JpegTransform transform = JpegTransform::None;
+    // Multiplies every quantization step by this percentage (100 keeps the
+    // original tables). Coarser steps zero out more high-frequency
+    // coefficients and shrink the entropy-coded data.
+    int quant_scale_percent = 100;
+    // Replaces the (usually Annex K default) Huffman tables with ones built
+    // from this frame's own symbol statistics. Lossless.
+    bool optimize_huffman = false;
+    // Inserts a restart marker every this many MCU rows (0 for none), so
+    // decoders can split the frame into strips (JpegDecoder::decode_bgr with a
+    // pool). Lossless; each marker costs a few bytes.
+    int restart_rows = 0;
+
+    bool is_identity() const {
+        return !crop.has_value() && transform == JpegTransform::None && quant_scale_percent == 100
+            && !optimize_huffman && restart_rows == 0;
+    }
+};
+
+inline constexpr int MIN_QUANT_SCALE_PERCENT = 100;
+inline constexpr int MAX_QUANT_SCALE_PERCENT = 1000;
+inline constexpr int MAX_RESTART_ROWS = 255;
+
+// Coefficient-domain JPEG operations: the scan is entropy-decoded into DCT
+// blocks, rearranged or rewritten, and entropy-encoded again. No IDCT or
+// color conversion happens, so output is lossless unless quant_scale_percent
+// is not 100, which requantizes the coefficients. One instance per thread;
+// buffers and libjpeg state are reused.
+class JpegTranscoder {
+public:
+    JpegTranscoder();
+    ~JpegTranscoder();
+
+    JpegTranscoder(const JpegTranscoder &) = delete;
+    JpegTranscoder &operator=(const JpegTranscoder &) = delete;
+
+    // Block-moving transforms require the image size to be a multiple of the
+    // MCU size (16x8 or 16x16 for the supported cameras' 640x480 output).
+    bool transform(std::span<const uint8_t> jpeg, JpegTransform transform, ByteVector *out);
+    bool crop(std::span<const uint8_t> jpeg, const CropRegion &region, ByteVector *out);
+    bool transcode(std::span<const uint8_t> jpeg, const TranscodeOptions &options, ByteVector *out);
+
+    // Joins two frames side by side into one JPEG by concatenating their block
+    // rows; options then apply to the combined image. The frames must have the
+    // same height, sampling and quantization tables (true for identical
+    // cameras), and the left width must be a multiple of the MCU width.
+    bool stitch(std::span<const uint8_t> left, std::span<const uint8_t> right, const TranscodeOptions &options,
+                ByteVector *out);
+
+    // Focus measure computed from the entropy-decoded coefficients, without an
+    // IDCT: the RMS of the dequantized luma AC coefficients over all blocks.
+    // Motion blur and defocus remove high-frequency detail, so among frames of
+    // the same scene the sharpest scores highest. Scores are not comparable
+    // across very different scenes.
+    bool sharpness(std::span<const uint8_t> jpeg, double *score);
+
+    const std::string &last_error() const;
+
+    static JpegTranscoder &for_current_thread();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Turns accelerometer samples into the quarter-turn that brings gravity to
+// the bottom of the image. The orientation only changes once the roll angle
+// is clearly past the 45 degree boundary, so holding the scope near a
+// diagonal does not make the picture flap.
+class OrientationTracker {
+public:
+    JpegTransform update(const GSensorSample &sample);
+
+    JpegTransform current() const {
+        return current_;
+    }
+
+private:
+    JpegTransform current_ = JpegTransform::None;
+};
+
+} // namespace supercamera
+
+#endif
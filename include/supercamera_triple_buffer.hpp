@@ -0,0 +1,87 @@
+#ifndef SUPERCAMERA_TRIPLE_BUFFER_HPP
+#define SUPERCAMERA_TRIPLE_BUFFER_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace supercamera {
+
+// Lock-free single-producer/single-consumer triple buffer. The producer always
+// has a private slot to fill, the consumer always has a private slot to read,
+// and the third slot holds the newest published value. Neither side ever waits
+// on the other; unread values are overwritten and counted as dropped.
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer() = default;
+
+    TripleBuffer(const TripleBuffer &) = delete;
+    TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+    // Producer side.
+    T &write_slot() {
+        return slots_[write_index_];
+    }
+
+    void publish() {
+        const uint8_t previous = middle_.exchange(
+            static_cast<uint8_t>(write_index_ | FRESH_BIT), std::memory_order_acq_rel);
+        write_index_ = previous & INDEX_MASK;
+        if ((previous & FRESH_BIT) != 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        sequence_.fetch_add(1, std::memory_order_release);
+        sequence_.notify_one();
+    }
+
+    // Consumer side. Returns true when a newer value than the one currently in
+    // read_slot() was swapped in.
+    bool acquire() {
+        if ((middle_.load(std::memory_order_relaxed) & FRESH_BIT) == 0) {
+            return false;
+        }
+        const uint8_t previous = middle_.exchange(read_index_, std::memory_order_acq_rel);
+        read_index_ = previous & INDEX_MASK;
+        return true;
+    }
+
+    T &read_slot() {
+        return slots_[read_index_];
+    }
+
+    // Blocks the consumer until something is published after `seen`, or until
+    // wake() is called. Returns the current publish sequence.
+    uint64_t wait(uint64_t seen) const {
+        sequence_.wait(seen, std::memory_order_acquire);
+        return sequence_.load(std::memory_order_acquire);
+    }
+
+    uint64_t sequence() const {
+        return sequence_.load(std::memory_order_acquire);
+    }
+
+    void wake() {
+        sequence_.fetch_add(1, std::memory_order_release);
+        sequence_.notify_all();
+    }
+
+    uint64_t dropped_count() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr uint8_t INDEX_MASK = 0x03;
+    static constexpr uint8_t FRESH_BIT = 0x04;
+
+    std::array<T, 3> slots_{};
+    uint8_t write_index_ = 0;
+    uint8_t read_index_ = 1;
+    std::atomic_uint8_t middle_ = 2;
+    std::atomic_uint64_t sequence_ = 0;
+    std::atomic_uint64_t dropped_ = 0;
+};
+
+} // namespace supercamera
+
+#endif
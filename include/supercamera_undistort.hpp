@@ -0,0 +1,75 @@
+#ifndef SUPERCAMERA_UNDISTORT_HPP
+#define SUPERCAMERA_UNDISTORT_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "supercamera_decoder.hpp"
+#include "supercamera_worker_pool.hpp"
+
+namespace supercamera {
+
+// Pinhole camera matrix and Brown-Conrady distortion coefficients, in the
+// same convention as OpenCV's calibrateCamera(), measured at width x height.
+struct LensCalibration {
+    double fx = 0.0;
+    double fy = 0.0;
+    double cx = 0.0;
+    double cy = 0.0;
+    double k1 = 0.0;
+    double k2 = 0.0;
+    double p1 = 0.0;
+    double p2 = 0.0;
+    double k3 = 0.0;
+    int width = 640;
+    int height = 480;
+
+    // Parses "fx,fy,cx,cy,k1,k2[,p1,p2[,k3]]".
+    static bool parse(const std::string &text, LensCalibration *out);
+};
+
+// Remaps BGR frames through a lookup table built once from the calibration.
+// Each output pixel stores the byte offset of its top-left source neighbour
+// and the four fixed-point bilinear weights; apply() walks the output in tiles
+// so the source rows touched by a tile stay in cache, and spreads tiles over
+// the pool.
+class LensUndistorter {
+public:
+    LensUndistorter(const LensCalibration &calibration, int width, int height, WorkerPool *pool = nullptr);
+
+    int width() const {
+        return width_;
+    }
+
+    int height() const {
+        return height_;
+    }
+
+    // src must be width() x height(); returns false otherwise.
+    bool apply(const BgrImage &src, BgrImage *dst) const;
+
+private:
+    void apply_tile(const BgrImage &src, BgrImage *dst, size_t tile) const;
+
+    static constexpr uint32_t OUTSIDE = 0xFFFFFFFF;
+    static constexpr int TILE_WIDTH = 64;
+    static constexpr int TILE_HEIGHT = 32;
+
+    struct LutEntry {
+        uint32_t offset;
+        uint32_t top_weights;
+        uint32_t bottom_weights;
+    };
+
+    std::vector<LutEntry> lut_;
+    int width_ = 0;
+    int height_ = 0;
+    int tiles_x_ = 0;
+    int tiles_y_ = 0;
+    WorkerPool *pool_ = nullptr;
+};
+
+} // namespace supercamera
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef SUPERCAMERA_UPP_PARSER_HPP
+#define SUPERCAMERA_UPP_PARSER_HPP
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "supercamera_core.hpp"
+
+namespace supercamera {
+
+// Lens selection shared between a capture's parser and its controllers. -1
+// means none.
+struct LensState {
+    std::atomic_int selected = -1;
+    std::atomic_int active = -1;
+};
+
+// Frame sink that passes frames matching `predicate` on to `next`.
+template <typename Predicate, typename Next>
+struct FilterSink {
+    Predicate predicate;
+    Next next;
+
+    void operator()(const CapturedFrame &frame) {
+        if (predicate(frame)) {
+            next(frame);
+        }
+    }
+};
+
+// Frame sink that hands every frame to each of `sinks`, in order.
+template <typename... Sinks>
+struct FanOutSink {
+    std::tuple<Sinks...> sinks;
+
+    void operator()(const CapturedFrame &frame) {
+        std::apply([&](auto &...sink) { (sink(frame), ...); }, sinks);
+    }
+};
+
+template <typename Predicate, typename Next>
+FilterSink<std::decay_t<Predicate>, std::decay_t<Next>> filter_sink(Predicate &&predicate, Next &&next) {
+    return {std::forward<Predicate>(predicate), std::forward<Next>(next)};
+}
+
+template <typename... Sinks>
+FanOutSink<std::decay_t<Sinks>...> fan_out(Sinks &&...sinks) {
+    return {{std::forward<Sinks>(sinks)...}};
+}
+
+// Reassembles JPEG frames from the camera's UPP bulk packets. The sinks are
+// template parameters, so a parser built with lambdas or the sink combinators
+// above compiles into one loop with no indirect call per packet or frame;
+// SupercameraCapture::run() wraps its std::function callbacks in one.
+template <typename FrameSink, typename ButtonSink = IgnoreButton>
+class UppParser {
+public:
+    UppParser(FrameSink frame_sink, ButtonSink button_sink, uint16_t source_id, bool split_lenses,
+              bool accept_g_sensor, LensState &lens_state)
+        : source_id_(source_id),
+          split_lenses_(split_lenses),
+          accept_g_sensor_(accept_g_sensor),
+          lens_state_(lens_state),
+          frame_sink_(std::move(frame_sink)),
+          button_sink_(std::move(button_sink)) {}
+
+    void flush_pending() {
+        emit_frame();
+    }
+
+    // Sizes both frame buffers for frames of up to `bytes`. They are swapped,
+    // never freed, so once a frame of the largest size has passed the parser
+    // stops allocating either way.
+    void reserve(size_t bytes) {
+        camera_buffer_.reserve(bytes);
+        frame_.jpeg.reserve(bytes);
+    }
+
+    void handle_upp_frame(std::span<const uint8_t> data) {
+        const size_t usb_header_len = sizeof(upp_usb_frame_t);
+        if (data.size() < usb_header_len) {
+            return;
+        }
+
+        upp_usb_frame_t frame = {};
+        std::memcpy(&frame, data.data(), usb_header_len);
+
+        if (frame.magic != UPP_USB_MAGIC) {
+            return;
+        }
+        if ((frame.cid != UPP_CAMID_7) && (frame.cid != UPP_CAMID_11)) {
+            return;
+        }
+        if (usb_header_len + frame.length > data.size()) {
+            return;
+        }
+
+        const size_t cam_header_len = sizeof(upp_cam_frame_t);
+        if (data.size() - usb_header_len < cam_header_len) {
+            return;
+        }
+        if (frame.length < cam_header_len) {
+            return;
+        }
+
+        upp_cam_frame_t cam_part = {};
+        std::memcpy(&cam_part, data.data() + usb_header_len, cam_header_len);
+
+        if (!camera_buffer_.empty() && cam_header_.fid != cam_part.fid) {
+            emit_frame();
+        }
+
+        bool skip = false;
+        if (camera_buffer_.empty()) {
+            cam_header_ = cam_part;
+            if (!((cam_header_.cam_num < MAX_LENSES) && (accept_g_sensor_ || cam_header_.has_g == 0)
+                  && (cam_header_.other == 0))) {
+                return;
+            }
+            // Every packet of an unselected lens's frame lands here, since
+            // nothing of that frame gets buffered.
+            lens_state_.active.store(cam_header_.cam_num, std::memory_order_relaxed);
+            const int selected = lens_state_.selected.load(std::memory_order_relaxed);
+            skip = selected >= 0 && selected != cam_header_.cam_num;
+        } else {
+            if (!((cam_header_.fid == cam_part.fid)
+                  && (cam_header_.cam_num == cam_part.cam_num)
+                  && (accept_g_sensor_ || cam_header_.has_g == cam_part.has_g)
+                  && (cam_header_.other == cam_part.other))) {
+                return;
+            }
+        }
+
+        if (cam_part.button_press) {
+            button_sink_();
+        }
+        if (skip) {
+            return;
+        }
+
+        if (cam_part.has_g) {
+            g_sensor_ = decode_g_sensor(cam_part.g_sensor);
+        }
+
+        const auto cam_data = data.subspan(usb_header_len + cam_header_len, frame.length - cam_header_len);
+        camera_buffer_.insert(camera_buffer_.end(), cam_data.begin(), cam_data.end());
+    }
+
+private:
+    static_assert(std::endian::native == std::endian::little);
+
+    struct [[gnu::packed]] upp_usb_frame_t {
+        uint16_t magic;
+        uint8_t cid;
+        uint16_t length;
+    };
+
+    struct [[gnu::packed]] upp_cam_frame_t {
+        uint8_t fid;
+        uint8_t cam_num;
+        unsigned char has_g:1;
+        unsigned char button_press:1;
+        unsigned char other:6;
+        uint32_t g_sensor;
+    };
+
+    static constexpr uint16_t UPP_USB_MAGIC = 0xBBAA;
+    static constexpr uint8_t UPP_CAMID_7 = 7;
+    static constexpr uint8_t UPP_CAMID_11 = 11;
+
+    // Assumed layout, not confirmed against the firmware or a capture: two
+    // little-endian int16 axes, x in the low half and y in the high half.
+    static GSensorSample decode_g_sensor(uint32_t word) {
+        return {
+            .x = static_cast<int16_t>(word & 0xFFFF),
+            .y = static_cast<int16_t>(word >> 16),
+        };
+    }
+
+    static uint64_t now_us() {
+        const auto now = std::chrono::system_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    }
+
+    void emit_frame() {
+        if (camera_buffer_.empty()) {
+            return;
+        }
+
+        // cam_num was validated when the frame's first packet arrived.
+        const uint8_t lens = cam_header_.cam_num;
+        const uint8_t counter = split_lenses_ ? lens : 0;
+        // The assembled JPEG trades places with the previous frame's buffer,
+        // which then collects the next frame.
+        frame_.jpeg.swap(camera_buffer_);
+        frame_.source_id = static_cast<uint16_t>(source_id_ + counter);
+        frame_.frame_id = frame_ids_[counter]++;
+        frame_.timestamp_us = now_us();
+        frame_.g_sensor = g_sensor_;
+        frame_.lens = lens;
+        frame_sink_(frame_);
+        camera_buffer_.clear();
+        g_sensor_.reset();
+    }
+
+    ByteVector camera_buffer_;
+    uint16_t source_id_ = 0;
+    bool split_lenses_ = false;
+    bool accept_g_sensor_ = false;
+    LensState &lens_state_;
+    upp_cam_frame_t cam_header_ = {};
+    std::array<uint32_t, MAX_LENSES> frame_ids_ = {};
+    std::optional<GSensorSample> g_sensor_;
+    CapturedFrame frame_ = {};
+
+    FrameSink frame_sink_;
+    ButtonSink button_sink_;
+};
+
+template <typename FrameSink, typename ButtonSink>
+void SupercameraCapture::run_with(FrameSink &&frame_sink, ButtonSink &&button_sink) {
+    stop_requested_ = false;
+    UppParser<std::decay_t<FrameSink>, std::decay_t<ButtonSink>> parser(
+        std::forward<FrameSink>(frame_sink), std::forward<ButtonSink>(button_sink), source_id_, split_lenses_,
+        accept_g_sensor_, lens_state());
+    parser.reserve(frame_budget_);
+    ByteVector read_buf;
+
+    while (!stop_requested_) {
+        const ReadResult result = read_packet(read_buf);
+        if (result == ReadResult::Packet) {
+            parser.handle_upp_frame(read_buf);
+            continue;
+        }
+        if (result == ReadResult::Disconnected) {
+            break;
+        }
+    }
+
+    parser.flush_pending();
+}
+
+} // namespace supercamera
+
+#endif
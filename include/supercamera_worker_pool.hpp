@@ -0,0 +1,70 @@
+#ifndef SUPERCAMERA_WORKER_POOL_HPP
+#define SUPERCAMERA_WORKER_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace supercamera {
+
+// Fixed set of worker threads shared by the CPU-heavy frame stages. Each
+// worker has its own task queue: tasks submitted from a worker go to that
+// worker's queue, others are spread round-robin, and a worker whose queue is
+// empty steals from the others before it sleeps. Busy workers therefore do
+// not contend on one queue lock.
+class WorkerPool {
+public:
+    // thread_count = 0 uses one worker per hardware thread.
+    explicit WorkerPool(size_t thread_count = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    size_t thread_count() const {
+        return threads_.size();
+    }
+
+    void submit(std::function<void()> task);
+
+    // Runs fn(0) .. fn(count - 1) on the workers and the calling thread and
+    // returns once every index has completed.
+    void parallel_for(size_t count, const std::function<void(size_t)> &fn);
+
+    // Tasks a worker took from another worker's queue.
+    uint64_t steal_count() const {
+        return steals_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct TaskQueue {
+        std::mutex mtx;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void worker_loop(size_t index);
+    void stop();
+    bool take_task(size_t index, std::function<void()> *task);
+
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::atomic_size_t next_queue_ = 0;
+    // Queued, not yet taken tasks; raised under sleep_mtx_ so a worker cannot
+    // miss the wakeup.
+    std::atomic_size_t pending_ = 0;
+    std::atomic_uint64_t steals_ = 0;
+    std::mutex sleep_mtx_;
+    std::condition_variable cv_;
+    std::vector<std::thread> threads_;
+    bool stopped_ = false;
+};
+
+} // namespace supercamera
+
+#endif
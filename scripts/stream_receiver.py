@@ -11,58 +11,252 @@ import numpy as np
 
 STREAM_MAGIC = 0x47535643  # GSVC
 STREAM_VERSION = 1
+STREAM_VERSION_CRC = 2
+STREAM_MAGIC_BYTES = struct.pack("!I", STREAM_MAGIC)
 STREAM_CODEC_JPEG = 1
+STREAM_CODEC_H264 = 2
 HEADER_FORMAT = "!IBBHHHIQI"
 HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+CRC_SIZE = 4
 MAX_PAYLOAD_SIZE = 1024 * 1024
+FLAG_HEADER_TEMPLATE = 0x0001
+FLAG_SCAN_ONLY = 0x0002
+FLAG_METADATA = 0x0004
+FLAG_BUNDLE = 0x0008
+KNOWN_FLAGS = FLAG_HEADER_TEMPLATE | FLAG_SCAN_ONLY | FLAG_METADATA | FLAG_BUNDLE
+BUNDLE_PART_FORMAT = "!HHIQI"
+BUNDLE_PART_SIZE = struct.calcsize(BUNDLE_PART_FORMAT)
 
+try:
+    # pip install crc32c: uses the CPU's CRC instructions.
+    from crc32c import crc32c as _crc32c_native
+except ImportError:
+    _crc32c_native = None
 
-def recv_exact(sock: socket.socket, size: int) -> bytes:
-    chunks = []
-    remaining = size
-    while remaining > 0:
-        data = sock.recv(remaining)
-        if not data:
-            raise ConnectionError("peer closed the connection")
-        chunks.append(data)
-        remaining -= len(data)
-    return b"".join(chunks)
 
+def _make_crc32c_table() -> list[int]:
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82F63B78 if crc & 1 else 0)
+        table.append(crc)
+    return table
 
-def parse_header(raw_header: bytes) -> tuple[int, int, int, int]:
-    magic, version, codec, _flags, source_id, _reserved, frame_id, timestamp_us, payload_size = struct.unpack(
+
+_CRC32C_TABLE = _make_crc32c_table()
+
+
+def crc32c(data: bytes, crc: int = 0) -> int:
+    """CRC-32C of data, continuing a previous result like the sender's supercamera::crc32c()."""
+    if _crc32c_native is not None:
+        return _crc32c_native(data, crc)
+    crc ^= 0xFFFFFFFF
+    for byte in data:
+        crc = _CRC32C_TABLE[(crc ^ byte) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+
+class MessageReader:
+    """Reads messages from the socket.
+
+    On a protocol v2 connection a message with a bad header or CRC is dropped
+    and reading resumes at the next magic (see STREAM_PROTOCOL.md), so
+    corruption costs a frame instead of the connection. v1 errors still raise.
+    """
+
+    def __init__(self, sock: socket.socket) -> None:
+        self.sock = sock
+        self.buffer = bytearray()
+        self.version: int | None = None
+        self.synced = True
+        self.dropped_messages = 0
+        self.skipped_bytes = 0
+
+    def _fill(self, size: int) -> None:
+        while len(self.buffer) < size:
+            data = self.sock.recv(max(size - len(self.buffer), 65536))
+            if not data:
+                raise ConnectionError("peer closed the connection")
+            self.buffer += data
+
+    def _resync(self) -> None:
+        # bytearray.find is a C-level (memchr-based) search.
+        at = self.buffer.find(STREAM_MAGIC_BYTES, 1)
+        skip = at if at >= 0 else max(len(self.buffer) - (len(STREAM_MAGIC_BYTES) - 1), 1)
+        del self.buffer[:skip]
+        self.skipped_bytes += skip
+
+    def read(self) -> tuple[tuple[int, int, int, int, int, int, int], bytes]:
+        while True:
+            self._fill(HEADER_SIZE)
+            try:
+                fields = parse_header(bytes(self.buffer[:HEADER_SIZE]))
+                version = self.buffer[4]
+                if self.version is not None and version != self.version:
+                    raise ValueError(f"version changed from {self.version} to {version}")
+                header_size = HEADER_SIZE + (CRC_SIZE if version == STREAM_VERSION_CRC else 0)
+                payload_size = fields[-1]
+                self._fill(header_size + payload_size)
+                payload = bytes(self.buffer[header_size : header_size + payload_size])
+                if version == STREAM_VERSION_CRC:
+                    (expected,) = struct.unpack_from("!I", self.buffer, HEADER_SIZE)
+                    if crc32c(payload, crc32c(bytes(self.buffer[:HEADER_SIZE]))) != expected:
+                        raise ValueError("CRC mismatch")
+            except ValueError:
+                if self.version != STREAM_VERSION_CRC:
+                    raise
+                # Count the bad message, not the false matches while resyncing.
+                if self.synced:
+                    self.dropped_messages += 1
+                    self.synced = False
+                self._resync()
+                continue
+
+            self.version = version
+            self.synced = True
+            del self.buffer[: header_size + payload_size]
+            return fields, payload
+
+
+def parse_header(raw_header: bytes) -> tuple[int, int, int, int, int, int, int]:
+    magic, version, codec, flags, source_id, template_id, frame_id, timestamp_us, payload_size = struct.unpack(
         HEADER_FORMAT, raw_header
     )
 
     if magic != STREAM_MAGIC:
         raise ValueError(f"bad magic: 0x{magic:08x}")
-    if version != STREAM_VERSION:
+    if version not in (STREAM_VERSION, STREAM_VERSION_CRC):
         raise ValueError(f"unsupported version: {version}")
-    if codec != STREAM_CODEC_JPEG:
+    if codec not in (STREAM_CODEC_JPEG, STREAM_CODEC_H264):
         raise ValueError(f"unsupported codec: {codec}")
     if payload_size > MAX_PAYLOAD_SIZE:
         raise ValueError(f"payload too large: {payload_size}")
+    if flags & ~KNOWN_FLAGS or flags & (flags - 1):
+        raise ValueError(f"unsupported flags: 0x{flags:04x}")
+
+    return codec, flags, source_id, template_id, frame_id, timestamp_us, payload_size
 
-    return source_id, frame_id, timestamp_us, payload_size
+
+def parse_metadata(payload: bytes) -> dict[str, str]:
+    """Parses the `key=value` lines of a metadata message (--sharpness)."""
+    metadata = {}
+    for line in payload.decode("utf-8", errors="replace").splitlines():
+        key, separator, value = line.partition("=")
+        if separator:
+            metadata[key] = value
+    return metadata
+
+
+def parse_bundle(payload: bytes) -> list[tuple[int, int, int, bytes]]:
+    """Splits a stereo bundle (--stereo) into (source_id, frame_id, timestamp_us, jpeg) parts."""
+    parts = []
+    offset = 0
+    while offset < len(payload):
+        if offset + BUNDLE_PART_SIZE > len(payload):
+            raise ValueError("truncated bundle part header")
+        source_id, _, frame_id, timestamp_us, size = struct.unpack_from(BUNDLE_PART_FORMAT, payload, offset)
+        offset += BUNDLE_PART_SIZE
+        if offset + size > len(payload):
+            raise ValueError("truncated bundle part")
+        parts.append((source_id, frame_id, timestamp_us, payload[offset : offset + size]))
+        offset += size
+    return parts
+
+
+class H264Decoder:
+    """Decodes one source's H.264 access units (--codec h264) with PyAV."""
+
+    def __init__(self) -> None:
+        try:
+            import av
+        except ImportError as exc:
+            raise ValueError("H.264 streams need PyAV: pip install av") from exc
+        self.context = av.CodecContext.create("h264", "r")
+        self.packet_type = av.Packet
+
+    def decode(self, payload: bytes) -> np.ndarray | None:
+        image = None
+        for frame in self.context.decode(self.packet_type(payload)):
+            image = frame.to_ndarray(format="bgr24")
+        return image
+
+
+class JpegAssembler:
+    """Rebuilds full JPEGs from header-deduplicated messages (--dedup-headers)."""
+
+    def __init__(self) -> None:
+        self.templates: dict[int, bytes] = {}
+        # Scans whose template announcement never arrived, e.g. because it was
+        # dropped for a bad CRC. They are skipped until it is announced again.
+        self.orphan_scans = 0
+        self._warned_templates: set[int] = set()
+
+    def feed(self, flags: int, template_id: int, payload: bytes) -> bytes | None:
+        """Returns a complete JPEG, or None for template announcements and orphan scans."""
+        if flags & FLAG_HEADER_TEMPLATE:
+            self.templates[template_id] = payload
+            self._warned_templates.discard(template_id)
+            return None
+        if flags & FLAG_SCAN_ONLY:
+            header = self.templates.get(template_id)
+            if header is None:
+                self.orphan_scans += 1
+                if template_id not in self._warned_templates:
+                    self._warned_templates.add(template_id)
+                    print(f"Warning: skipping scans for unknown header template {template_id} until it is announced")
+                return None
+            return header + payload
+        return payload
 
 
 def run_receiver(host: str, port: int, timeout: float, log_every: int, window_name: str) -> int:
     frame_count = 0
     start = time.time()
 
+    assembler = JpegAssembler()
+    h264_decoders: dict[int, H264Decoder] = {}
+    metadata: dict[str, str] = {}
+
     with socket.create_connection((host, port), timeout=timeout) as sock:
         sock.settimeout(None)
         print(f"Connected to {host}:{port}")
+        reader = MessageReader(sock)
+        if _crc32c_native is None:
+            print("Note: protocol v2 CRC checks are slow without the crc32c module (pip install crc32c)")
 
         while True:
-            raw_header = recv_exact(sock, HEADER_SIZE)
-            source_id, frame_id, timestamp_us, payload_size = parse_header(raw_header)
-            payload = recv_exact(sock, payload_size)
-
-            jpeg = np.frombuffer(payload, dtype=np.uint8)
-            image = cv2.imdecode(jpeg, cv2.IMREAD_COLOR)
+            (codec, flags, source_id, template_id, frame_id, timestamp_us, _), payload = reader.read()
+            if flags & FLAG_METADATA:
+                metadata = parse_metadata(payload)
+                continue
+            if flags & FLAG_BUNDLE:
+                parts = parse_bundle(payload)
+                for part_source_id, _, _, jpeg in parts:
+                    image = cv2.imdecode(np.frombuffer(jpeg, dtype=np.uint8), cv2.IMREAD_COLOR)
+                    if image is not None:
+                        cv2.imshow(f"{window_name} [source {part_source_id}]", image)
+                if len(parts) == 2 and frame_id % max(log_every, 1) == 0:
+                    print(f"pair frame_id={frame_id} skew_us={abs(parts[0][2] - parts[1][2])}")
+                key = cv2.waitKey(1) & 0xFF
+                if key in (ord("q"), 27):
+                    break
+                metadata = {}
+                continue
+            if codec == STREAM_CODEC_H264:
+                if source_id not in h264_decoders:
+                    h264_decoders[source_id] = H264Decoder()
+                # Metadata describes the frame that follows it.
+                frame_metadata, metadata = metadata, {}
+                image = h264_decoders[source_id].decode(payload)
+            else:
+                full_jpeg = assembler.feed(flags, template_id, payload)
+                if full_jpeg is None:
+                    continue
+                frame_metadata, metadata = metadata, {}
+                image = cv2.imdecode(np.frombuffer(full_jpeg, dtype=np.uint8), cv2.IMREAD_COLOR)
             if image is None:
-                print(f"Warning: failed to decode JPEG source_id={source_id} frame_id={frame_id}")
+                print(f"Warning: failed to decode frame source_id={source_id} frame_id={frame_id}")
                 continue
 
             current_window = f"{window_name} [source {source_id}]"
@@ -75,9 +269,16 @@ def run_receiver(host: str, port: int, timeout: float, log_every: int, window_na
             if log_every > 0 and frame_count % log_every == 0:
                 elapsed = max(time.time() - start, 1e-6)
                 fps = frame_count / elapsed
+                sharpness = f" sharpness={frame_metadata['sharpness']}" if "sharpness" in frame_metadata else ""
+                corrupt = (
+                    f" corrupt_dropped={reader.dropped_messages} resync_skipped={reader.skipped_bytes}B"
+                    f" orphan_scans={assembler.orphan_scans}"
+                    if reader.dropped_messages
+                    else ""
+                )
                 print(
                     f"frames={frame_count} fps={fps:.2f} "
-                    f"last_source={source_id} last_frame_id={frame_id} timestamp_us={timestamp_us}"
+                    f"last_source={source_id} last_frame_id={frame_id} timestamp_us={timestamp_us}{sharpness}{corrupt}"
                 )
 
     cv2.destroyAllWindows()
@@ -0,0 +1,154 @@
+#include "supercamera_allocation_stats.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace supercamera {
+namespace {
+
+std::atomic_uint64_t g_allocations = 0;
+std::atomic_uint64_t g_bytes = 0;
+// Plain integers: constant-initialized, so they are safe to touch from
+// operator new at any point of a thread's life.
+thread_local uint64_t t_allocations = 0;
+thread_local uint64_t t_bytes = 0;
+
+void count_allocation(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_bytes.fetch_add(size, std::memory_order_relaxed);
+    ++t_allocations;
+    t_bytes += size;
+}
+
+// operator new's contract: retry through the new-handler, throw when there
+// is none.
+template <typename Alloc>
+void *allocate_or_throw(Alloc &&alloc) {
+    while (true) {
+        if (void *ptr = alloc()) {
+            return ptr;
+        }
+        const std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+} // namespace
+
+AllocationCounters process_allocations() {
+    return {
+        .allocations = g_allocations.load(std::memory_order_relaxed),
+        .bytes = g_bytes.load(std::memory_order_relaxed),
+    };
+}
+
+AllocationCounters thread_allocations() {
+    return {
+        .allocations = t_allocations,
+        .bytes = t_bytes,
+    };
+}
+
+} // namespace supercamera
+
+// Every form is replaced, not just the single-object ones the others
+// default to: a sanitizer runtime may supply its own defaults, which would
+// not pair with the free() below.
+void *operator new(std::size_t size) {
+    supercamera::count_allocation(size);
+    return supercamera::allocate_or_throw([size] { return std::malloc(size != 0 ? size : 1); });
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    supercamera::count_allocation(size);
+    // aligned_alloc wants a size that is a multiple of the alignment.
+    const auto align = static_cast<std::size_t>(alignment);
+    const std::size_t rounded = size != 0 ? (size + align - 1) & ~(align - 1) : align;
+    return supercamera::allocate_or_throw([align, rounded] { return std::aligned_alloc(align, rounded); });
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return operator new(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    try {
+        return operator new(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+    return operator new(size, tag);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &tag) noexcept {
+    return operator new(size, alignment, tag);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(ptr);
+}
@@ -1,11 +1,10 @@
 #include "supercamera_core.hpp"
+#include "supercamera_upp_parser.hpp"
 
-#include <bit>
-#include <chrono>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
-#include <cstring>
-#include <iostream>
+#include <optional>
 #include <sstream>
 #include <span>
 #include <stdexcept>
@@ -222,138 +221,19 @@ public:
     }
 };
 
-class UPPCameraParser {
-    static_assert(std::endian::native == std::endian::little);
-
-    struct [[gnu::packed]] upp_usb_frame_t {
-        uint16_t magic;
-        uint8_t cid;
-        uint16_t length;
-    };
-
-    struct [[gnu::packed]] upp_cam_frame_t {
-        uint8_t fid;
-        uint8_t cam_num;
-        unsigned char has_g:1;
-        unsigned char button_press:1;
-        unsigned char other:6;
-        uint32_t g_sensor;
-    };
-
-    static constexpr uint16_t UPP_USB_MAGIC = 0xBBAA;
-    static constexpr uint8_t UPP_CAMID_7 = 7;
-    static constexpr uint8_t UPP_CAMID_11 = 11;
-
-    ByteVector camera_buffer_;
-    uint16_t source_id_ = 0;
-    upp_cam_frame_t cam_header_ = {};
-    uint32_t frame_id_ = 0;
-
-    FrameCallback frame_callback_;
-    ButtonCallback button_callback_;
-
-    static uint64_t now_us() {
-        const auto now = std::chrono::system_clock::now().time_since_epoch();
-        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
-    }
-
-    void emit_frame() {
-        if (camera_buffer_.empty()) {
-            return;
-        }
-
-        CapturedFrame frame = {
-            .jpeg = camera_buffer_,
-            .source_id = source_id_,
-            .frame_id = frame_id_++,
-            .timestamp_us = now_us(),
-        };
-        frame_callback_(frame);
-        camera_buffer_.clear();
-    }
-
-public:
-    UPPCameraParser(FrameCallback frame_callback, ButtonCallback button_callback, uint16_t source_id)
-        : source_id_(source_id),
-          frame_callback_(std::move(frame_callback)),
-          button_callback_(std::move(button_callback)) {}
-
-    void flush_pending() {
-        emit_frame();
-    }
-
-    void handle_upp_frame(const ByteVector &data) {
-        const size_t usb_header_len = sizeof(upp_usb_frame_t);
-        if (data.size() < usb_header_len) {
-            return;
-        }
-
-        upp_usb_frame_t frame = {};
-        std::memcpy(&frame, data.data(), usb_header_len);
-
-        if (frame.magic != UPP_USB_MAGIC) {
-            return;
-        }
-        if ((frame.cid != UPP_CAMID_7) && (frame.cid != UPP_CAMID_11)) {
-            return;
-        }
-        if (usb_header_len + frame.length > data.size()) {
-            return;
-        }
-
-        const size_t cam_header_len = sizeof(upp_cam_frame_t);
-        if (data.size() - usb_header_len < cam_header_len) {
-            return;
-        }
-        if (frame.length < cam_header_len) {
-            return;
-        }
-
-        upp_cam_frame_t cam_part = {};
-        std::memcpy(&cam_part, data.data() + usb_header_len, cam_header_len);
-
-        if (!camera_buffer_.empty() && cam_header_.fid != cam_part.fid) {
-            emit_frame();
-        }
-
-        if (camera_buffer_.empty()) {
-            cam_header_ = cam_part;
-            if (!((cam_header_.cam_num < 2) && (cam_header_.has_g == 0) && (cam_header_.other == 0))) {
-                return;
-            }
-        } else {
-            if (!((cam_header_.fid == cam_part.fid)
-                  && (cam_header_.cam_num == cam_part.cam_num)
-                  && (cam_header_.has_g == cam_part.has_g)
-                  && (cam_header_.other == cam_part.other))) {
-                return;
-            }
-        }
-
-        if (cam_part.button_press && button_callback_) {
-            button_callback_();
-        }
-
-        const auto cam_data_start = data.begin() + static_cast<std::ptrdiff_t>(usb_header_len + cam_header_len);
-        const auto cam_data_end = data.begin() + static_cast<std::ptrdiff_t>(usb_header_len + frame.length);
-        if (cam_data_start > cam_data_end) {
-            return;
-        }
-        camera_buffer_.insert(camera_buffer_.end(), cam_data_start, cam_data_end);
-    }
-};
-
 } // namespace
 
 struct SupercameraCapture::Impl {
     UsbSupercamera usb;
+    LensState lens;
     explicit Impl(uint16_t source_id) : usb(source_id) {}
 };
 
-SupercameraCapture::SupercameraCapture(uint16_t source_id, ButtonCallback button_callback)
+SupercameraCapture::SupercameraCapture(uint16_t source_id, ButtonCallback button_callback, bool split_lenses)
     : impl_(std::make_unique<Impl>(source_id)),
       source_id_(source_id),
-      button_callback_(std::move(button_callback)) {}
+      button_callback_(std::move(button_callback)),
+      split_lenses_(split_lenses) {}
 
 SupercameraCapture::~SupercameraCapture() = default;
 
@@ -366,22 +246,49 @@ void SupercameraCapture::run(const FrameCallback &frame_callback) {
         throw std::invalid_argument("frame callback is required");
     }
 
-    stop_requested_ = false;
-    UPPCameraParser parser(frame_callback, button_callback_, source_id_);
-    ByteVector read_buf;
+    run_with([&frame_callback](const CapturedFrame &frame) { frame_callback(frame); },
+             [this] {
+                 if (button_callback_) {
+                     button_callback_();
+                 }
+             });
+}
+
+SupercameraCapture::ReadResult SupercameraCapture::read_packet(ByteVector &buf) {
+    const int ret = impl_->usb.read_frame(buf);
+    if (ret == 0) {
+        return ReadResult::Packet;
+    }
+    return ret == LIBUSB_ERROR_NO_DEVICE ? ReadResult::Disconnected : ReadResult::Retry;
+}
+
+LensState &SupercameraCapture::lens_state() {
+    return impl_->lens;
+}
 
-    while (!stop_requested_) {
-        const int ret = impl_->usb.read_frame(read_buf);
-        if (ret == 0) {
-            parser.handle_upp_frame(read_buf);
-            continue;
-        }
-        if (ret == LIBUSB_ERROR_NO_DEVICE) {
-            break;
-        }
+void SupercameraCapture::set_frame_budget(size_t bytes) {
+    frame_budget_ = bytes;
+}
+
+void SupercameraCapture::set_accept_g_sensor(bool accept) {
+    accept_g_sensor_ = accept;
+}
+
+void SupercameraCapture::select_lens(std::optional<uint8_t> lens) {
+    if (lens.has_value() && *lens >= MAX_LENSES) {
+        throw std::invalid_argument("lens out of range");
     }
+    impl_->lens.selected.store(lens.has_value() ? *lens : -1);
+}
+
+std::optional<uint8_t> SupercameraCapture::selected_lens() const {
+    const int lens = impl_->lens.selected.load();
+    return lens >= 0 ? std::optional<uint8_t>(static_cast<uint8_t>(lens)) : std::nullopt;
+}
 
-    parser.flush_pending();
+std::optional<uint8_t> SupercameraCapture::active_lens() const {
+    const int lens = impl_->lens.active.load(std::memory_order_relaxed);
+    return lens >= 0 ? std::optional<uint8_t>(static_cast<uint8_t>(lens)) : std::nullopt;
 }
 
 size_t SupercameraCapture::available_devices() {
@@ -0,0 +1,339 @@
+#include "supercamera_decoder.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <turbojpeg.h>
+
+namespace supercamera {
+namespace {
+
+bool valid_scale_denom(int scale_denom) {
+    return scale_denom == 1 || scale_denom == 2 || scale_denom == 4 || scale_denom == 8;
+}
+
+// Where a sequential JPEG's restart intervals are, when each of them covers
+// a whole number of MCU rows.
+struct RestartLayout {
+    size_t header_size = 0;   // SOI through the SOS segment
+    size_t height_offset = 0; // big-endian frame height in the SOF segment
+    int height = 0;
+    int mcu_height = 8;
+    int rows_per_interval = 0; // MCU rows
+    std::vector<size_t> starts; // entropy-coded data of each interval
+    std::vector<size_t> ends;
+};
+
+uint16_t read_be16(std::span<const uint8_t> data, size_t pos) {
+    return static_cast<uint16_t>((data[pos] << 8) | data[pos + 1]);
+}
+
+bool find_restart_layout(std::span<const uint8_t> jpeg, RestartLayout *out) {
+    if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        return false;
+    }
+
+    int width = 0;
+    int component_count = 0;
+    int max_h = 1;
+    int max_v = 1;
+    unsigned int restart_interval = 0;
+    size_t pos = 2;
+    while (out->header_size == 0) {
+        if (pos + 4 > jpeg.size() || jpeg[pos] != 0xFF) {
+            return false;
+        }
+        const uint8_t marker = jpeg[pos + 1];
+        if (marker == 0xFF) {
+            ++pos; // fill byte
+            continue;
+        }
+        const size_t length = read_be16(jpeg, pos + 2);
+        if (length < 2 || pos + 2 + length > jpeg.size()) {
+            return false;
+        }
+
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (length < 8) {
+                return false;
+            }
+            out->height_offset = pos + 5;
+            out->height = read_be16(jpeg, pos + 5);
+            width = read_be16(jpeg, pos + 7);
+            component_count = jpeg[pos + 9];
+            if (length < 8 + 3 * static_cast<size_t>(component_count)) {
+                return false;
+            }
+            for (int i = 0; i < component_count; ++i) {
+                const uint8_t sampling = jpeg[pos + 11 + 3 * static_cast<size_t>(i)];
+                max_h = std::max(max_h, sampling >> 4);
+                max_v = std::max(max_v, sampling & 0x0F);
+            }
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            return false; // progressive, lossless or arithmetic coding
+        } else if (marker == 0xDD) {
+            restart_interval = read_be16(jpeg, pos + 4);
+        } else if (marker == 0xDA) {
+            // Only a single scan holding every component has one restart
+            // sequence for the whole image.
+            if (component_count == 0 || jpeg[pos + 4] != component_count) {
+                return false;
+            }
+            out->header_size = pos + 2 + length;
+        }
+        pos += 2 + length;
+    }
+
+    if (restart_interval == 0 || width == 0 || out->height == 0) {
+        return false;
+    }
+    // A single-component scan is not interleaved; its MCU is one block.
+    const int mcu_width = component_count == 1 ? 8 : 8 * max_h;
+    out->mcu_height = component_count == 1 ? 8 : 8 * max_v;
+    const unsigned int mcus_per_row = static_cast<unsigned int>((width + mcu_width - 1) / mcu_width);
+    if (restart_interval % mcus_per_row != 0) {
+        return false;
+    }
+    out->rows_per_interval = static_cast<int>(restart_interval / mcus_per_row);
+    const int mcu_rows = (out->height + out->mcu_height - 1) / out->mcu_height;
+    const size_t interval_count = static_cast<size_t>((mcu_rows + out->rows_per_interval - 1) / out->rows_per_interval);
+
+    // Walk the entropy-coded data for RSTn markers. 0xFF bytes in the data
+    // are followed by a stuffed 0x00.
+    size_t start = out->header_size;
+    pos = start;
+    while (true) {
+        const void *found = std::memchr(jpeg.data() + pos, 0xFF, jpeg.size() - pos);
+        if (found == nullptr) {
+            return false;
+        }
+        pos = static_cast<size_t>(static_cast<const uint8_t *>(found) - jpeg.data());
+        if (pos + 1 >= jpeg.size()) {
+            return false;
+        }
+        const uint8_t next = jpeg[pos + 1];
+        if (next == 0x00) {
+            pos += 2;
+        } else if (next == 0xFF) {
+            ++pos;
+        } else if (next >= 0xD0 && next <= 0xD7) {
+            out->starts.push_back(start);
+            out->ends.push_back(pos);
+            start = pos + 2;
+            pos = start;
+        } else if (next == 0xD9) {
+            out->starts.push_back(start);
+            out->ends.push_back(pos);
+            break;
+        } else {
+            return false;
+        }
+    }
+    return out->starts.size() == interval_count;
+}
+
+int decode_flags(int scale_denom) {
+    // Chroma detail is invisible once the image is reduced, so skip fancy
+    // upsampling there as well.
+    return scale_denom > 1 ? TJFLAG_FASTUPSAMPLE : 0;
+}
+
+} // namespace
+
+JpegDecoder::JpegDecoder()
+    : handle_(tjInitDecompress()) {
+    if (handle_ == nullptr) {
+        throw std::runtime_error("fatal: tjInitDecompress failed");
+    }
+}
+
+JpegDecoder::~JpegDecoder() {
+    if (handle_ != nullptr) {
+        tjDestroy(handle_);
+        handle_ = nullptr;
+    }
+}
+
+JpegDecoder &JpegDecoder::for_current_thread() {
+    thread_local JpegDecoder decoder;
+    return decoder;
+}
+
+int JpegDecoder::scaled_size(int size, int scale_denom) {
+    return (size + scale_denom - 1) / scale_denom;
+}
+
+int JpegDecoder::pick_scale_denom(int src_width, int src_height, int dst_width, int dst_height) {
+    int scale_denom = 1;
+    for (const int candidate : {2, 4, 8}) {
+        if (scaled_size(src_width, candidate) < dst_width || scaled_size(src_height, candidate) < dst_height) {
+            break;
+        }
+        scale_denom = candidate;
+    }
+    return scale_denom;
+}
+
+bool JpegDecoder::fail() {
+    last_error_ = tjGetErrorStr2(handle_);
+    return false;
+}
+
+bool JpegDecoder::check_decode(int result) {
+    if (result == 0) {
+        return true;
+    }
+    // TurboJPEG also returns -1 for warnings, such as a scan cut short or
+    // with corrupt data, after which the image is still decoded.
+    if (tjGetErrorCode(handle_) == TJERR_WARNING) {
+        last_error_ = tjGetErrorStr2(handle_);
+        return true;
+    }
+    return fail();
+}
+
+bool JpegDecoder::read_info(std::span<const uint8_t> jpeg, JpegInfo *out) {
+    JpegInfo info;
+    if (tjDecompressHeader3(
+            handle_, jpeg.data(), static_cast<unsigned long>(jpeg.size()), &info.width, &info.height,
+            &info.subsampling, &info.colorspace)
+        != 0) {
+        return fail();
+    }
+    *out = info;
+    return true;
+}
+
+bool JpegDecoder::decode_bgr_strips(
+    std::span<const uint8_t> jpeg, BgrImage *out, int scale_denom, WorkerPool &pool) {
+    RestartLayout layout;
+    if (!find_restart_layout(jpeg, &layout) || layout.starts.size() < 2) {
+        return false;
+    }
+
+    // One strip per thread, each a standalone JPEG: the original header with
+    // the strip's height, then its intervals with the RSTn markers between
+    // them renumbered from RST0.
+    const size_t intervals = layout.starts.size();
+    const size_t per_strip = (intervals + pool.thread_count()) / (pool.thread_count() + 1);
+    const size_t strip_count = (intervals + per_strip - 1) / per_strip;
+    const int strip_rows = static_cast<int>(per_strip) * layout.rows_per_interval * layout.mcu_height;
+    strips_.resize(strip_count);
+    for (size_t strip = 0; strip < strip_count; ++strip) {
+        const size_t first = strip * per_strip;
+        const size_t last = std::min(first + per_strip, intervals);
+        const int height = std::min(strip_rows, layout.height - static_cast<int>(strip) * strip_rows);
+
+        ByteVector &data = strips_[strip];
+        data.assign(jpeg.begin(), jpeg.begin() + static_cast<std::ptrdiff_t>(layout.header_size));
+        data[layout.height_offset] = static_cast<uint8_t>(height >> 8);
+        data[layout.height_offset + 1] = static_cast<uint8_t>(height);
+        for (size_t i = first; i < last; ++i) {
+            if (i > first) {
+                data.push_back(0xFF);
+                data.push_back(static_cast<uint8_t>(0xD0 + ((i - first - 1) & 7)));
+            }
+            data.insert(data.end(), jpeg.begin() + static_cast<std::ptrdiff_t>(layout.starts[i]),
+                        jpeg.begin() + static_cast<std::ptrdiff_t>(layout.ends[i]));
+        }
+        data.push_back(0xFF);
+        data.push_back(0xD9);
+    }
+
+    // Strip heights are multiples of the MCU height, which every scale
+    // divides, so the scaled strips tile the output exactly.
+    std::atomic_bool failed = false;
+    pool.parallel_for(strip_count, [&](size_t strip) {
+        const int y = static_cast<int>(strip) * strip_rows / scale_denom;
+        const int height = scaled_size(std::min(strip_rows, layout.height - static_cast<int>(strip) * strip_rows),
+                                       scale_denom);
+        const ByteVector &data = strips_[strip];
+        JpegDecoder &decoder = for_current_thread();
+        if (!decoder.check_decode(tjDecompress2(
+                decoder.handle_, data.data(), static_cast<unsigned long>(data.size()),
+                out->pixels.data() + static_cast<size_t>(y) * static_cast<size_t>(out->stride), out->width,
+                out->stride, height, TJPF_BGR, decode_flags(scale_denom)))) {
+            failed = true;
+        }
+    });
+    return !failed;
+}
+
+bool JpegDecoder::decode_bgr(std::span<const uint8_t> jpeg, BgrImage *out, int scale_denom, WorkerPool *pool) {
+    if (!valid_scale_denom(scale_denom)) {
+        last_error_ = "unsupported scale";
+        return false;
+    }
+
+    JpegInfo info;
+    if (!read_info(jpeg, &info)) {
+        return false;
+    }
+
+    const int width = scaled_size(info.width, scale_denom);
+    const int height = scaled_size(info.height, scale_denom);
+    const int stride = width * 3;
+    const size_t size = static_cast<size_t>(stride) * static_cast<size_t>(height);
+    if (out->pixels.size() < size) {
+        out->pixels.resize(size);
+    }
+    out->width = width;
+    out->height = height;
+    out->stride = stride;
+
+    if (pool != nullptr && pool->thread_count() > 0 && decode_bgr_strips(jpeg, out, scale_denom, *pool)) {
+        return true;
+    }
+
+    return check_decode(tjDecompress2(
+        handle_, jpeg.data(), static_cast<unsigned long>(jpeg.size()), out->pixels.data(), width, stride, height,
+        TJPF_BGR, decode_flags(scale_denom)));
+}
+
+bool JpegDecoder::decode_yuv(std::span<const uint8_t> jpeg, YuvImage *out, int scale_denom) {
+    if (!valid_scale_denom(scale_denom)) {
+        last_error_ = "unsupported scale";
+        return false;
+    }
+
+    JpegInfo info;
+    if (!read_info(jpeg, &info)) {
+        return false;
+    }
+    info.width = scaled_size(info.width, scale_denom);
+    info.height = scaled_size(info.height, scale_denom);
+
+    const int plane_count = (info.subsampling == TJSAMP_GRAY) ? 1 : 3;
+    std::array<unsigned char *, 3> planes = {};
+    for (int i = 0; i < plane_count; ++i) {
+        const auto plane = static_cast<size_t>(i);
+        out->widths[plane] = tjPlaneWidth(i, info.width, info.subsampling);
+        out->heights[plane] = tjPlaneHeight(i, info.height, info.subsampling);
+        out->strides[plane] = out->widths[plane];
+        const size_t size = static_cast<size_t>(out->strides[plane]) * static_cast<size_t>(out->heights[plane]);
+        if (out->planes[plane].size() < size) {
+            out->planes[plane].resize(size);
+        }
+        planes[plane] = out->planes[plane].data();
+    }
+
+    if (!check_decode(tjDecompressToYUVPlanes(
+            handle_, jpeg.data(), static_cast<unsigned long>(jpeg.size()), planes.data(), info.width,
+            out->strides.data(), info.height, decode_flags(scale_denom)))) {
+        return false;
+    }
+
+    out->plane_count = plane_count;
+    out->width = info.width;
+    out->height = info.height;
+    out->subsampling = info.subsampling;
+    return true;
+}
+
+} // namespace supercamera
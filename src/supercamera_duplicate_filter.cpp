@@ -0,0 +1,174 @@
+#include "supercamera_duplicate_filter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace supercamera {
+namespace {
+
+constexpr size_t STRIPE_BYTES = 64;
+constexpr size_t STRIPE_WORDS = STRIPE_BYTES / sizeof(uint64_t);
+
+constexpr std::array<uint64_t, STRIPE_WORDS> KEYS = {
+    0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL,
+    0x27D4EB2F165667C5ULL, 0xFF51AFD7ED558CCDULL, 0xC4CEB9FE1A85EC53ULL, 0x94D049BB133111EBULL,
+};
+
+uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t load_u64(const uint8_t *p) {
+    uint64_t value = 0;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// acc[lane] += lo32(k) * hi32(k) + word[lane ^ 1], with k = word ^ key: the
+// product mixes the bits, and the plain add of the neighbouring word keeps
+// inputs that happen to multiply to zero from vanishing. Eight independent
+// lanes keep the multipliers busy. Both versions compute the same value.
+#if defined(__SSE2__)
+void accumulate(std::array<uint64_t, STRIPE_WORDS> &acc, const uint8_t *data, size_t stripes) {
+    __m128i lanes[4];
+    __m128i keys[4];
+    for (size_t j = 0; j < 4; ++j) {
+        lanes[j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc.data() + 2 * j));
+        keys[j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(KEYS.data() + 2 * j));
+    }
+    for (size_t s = 0; s < stripes; ++s) {
+        const uint8_t *stripe = data + s * STRIPE_BYTES;
+        for (size_t j = 0; j < 4; ++j) {
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(stripe + 16 * j));
+            const __m128i k = _mm_xor_si128(d, keys[j]);
+            const __m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+            const __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[j] = _mm_add_epi64(lanes[j], _mm_add_epi64(product, swapped));
+        }
+    }
+    for (size_t j = 0; j < 4; ++j) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(acc.data() + 2 * j), lanes[j]);
+    }
+}
+#else
+void accumulate(std::array<uint64_t, STRIPE_WORDS> &acc, const uint8_t *data, size_t stripes) {
+    for (size_t s = 0; s < stripes; ++s) {
+        const uint8_t *stripe = data + s * STRIPE_BYTES;
+        for (size_t lane = 0; lane < STRIPE_WORDS; ++lane) {
+            const uint64_t k = load_u64(stripe + lane * 8) ^ KEYS[lane];
+            acc[lane] += (k & 0xFFFFFFFFULL) * (k >> 32) + load_u64(stripe + (lane ^ 1) * 8);
+        }
+    }
+}
+#endif
+
+} // namespace
+
+uint64_t hash_bytes(std::span<const uint8_t> data) {
+    std::array<uint64_t, STRIPE_WORDS> acc = KEYS;
+    const size_t stripes = data.size() / STRIPE_BYTES;
+    accumulate(acc, data.data(), stripes);
+
+    uint64_t h = static_cast<uint64_t>(data.size()) * KEYS[0];
+    for (const uint64_t lane : acc) {
+        h = avalanche(h ^ lane);
+    }
+
+    size_t pos = stripes * STRIPE_BYTES;
+    for (; pos + 8 <= data.size(); pos += 8) {
+        h = avalanche(h ^ load_u64(data.data() + pos));
+    }
+    if (pos < data.size()) {
+        uint64_t tail = 0;
+        std::memcpy(&tail, data.data() + pos, data.size() - pos);
+        h = avalanche(h ^ tail ^ KEYS[1]);
+    }
+    return h;
+}
+
+double mean_abs_diff(std::span<const uint8_t> a, std::span<const uint8_t> b) {
+    const size_t size = std::min(a.size(), b.size());
+    if (size == 0) {
+        return 0.0;
+    }
+
+    uint64_t total = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i sums = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a.data() + i));
+        const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b.data() + i));
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(x, y));
+    }
+    std::array<uint64_t, 2> halves = {};
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(halves.data()), sums);
+    total = halves[0] + halves[1];
+#endif
+    for (; i < size; ++i) {
+        total += static_cast<uint64_t>(std::abs(static_cast<int>(a[i]) - static_cast<int>(b[i])));
+    }
+    return static_cast<double>(total) / static_cast<double>(size);
+}
+
+DuplicateFilter::DuplicateFilter(const DuplicateFilterOptions &options)
+    : options_(options) {}
+
+bool DuplicateFilter::dc_similar(const SourceState &state, const YuvImage &thumbnail) const {
+    if (state.dc_width != thumbnail.widths[0] || state.dc_height != thumbnail.heights[0]) {
+        return false;
+    }
+    const size_t size = static_cast<size_t>(thumbnail.strides[0]) * static_cast<size_t>(thumbnail.heights[0]);
+    return mean_abs_diff(state.dc, std::span(thumbnail.planes[0]).first(size)) <= options_.dc_threshold;
+}
+
+bool DuplicateFilter::accept(const CapturedFrame &frame) {
+    if (frame.source_id >= sources_.size()) {
+        sources_.resize(static_cast<size_t>(frame.source_id) + 1);
+    }
+    SourceState &state = sources_[frame.source_id];
+
+    const uint64_t hash = hash_bytes(frame.jpeg);
+    const bool use_dc = options_.dc_threshold > 0.0;
+    // A 1/8-scale decode is the image of DC coefficients; AC data is skipped
+    // by the entropy decoder and no IDCT runs.
+    const bool have_dc = use_dc && JpegDecoder::for_current_thread().decode_yuv(frame.jpeg, &thumbnail_, 8);
+
+    const bool keepalive_due =
+        frame.timestamp_us >= state.accepted_us + static_cast<uint64_t>(options_.keepalive_ms) * 1000;
+    const bool duplicate = state.seen && (hash == state.hash || (have_dc && dc_similar(state, thumbnail_)));
+    if (duplicate && !keepalive_due) {
+        ++suppressed_;
+        return false;
+    }
+
+    state.seen = true;
+    state.hash = hash;
+    state.accepted_us = frame.timestamp_us;
+    if (have_dc) {
+        const size_t size = static_cast<size_t>(thumbnail_.strides[0]) * static_cast<size_t>(thumbnail_.heights[0]);
+        state.dc.assign(thumbnail_.planes[0].begin(), thumbnail_.planes[0].begin() + static_cast<std::ptrdiff_t>(size));
+        state.dc_width = thumbnail_.widths[0];
+        state.dc_height = thumbnail_.heights[0];
+    } else {
+        state.dc_width = 0;
+        state.dc_height = 0;
+    }
+    return true;
+}
+
+} // namespace supercamera
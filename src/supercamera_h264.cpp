@@ -0,0 +1,232 @@
+#include "supercamera_h264.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#include "supercamera_decoder.hpp"
+
+#if defined(SUPERCAMERA_HAVE_X264)
+extern "C" {
+#include <x264.h>
+}
+#endif
+
+namespace supercamera {
+
+#if defined(SUPERCAMERA_HAVE_X264)
+
+namespace {
+
+// Box-filters a chroma plane down by fx horizontally and fy vertically (1 or 2
+// each) into one 4:2:0 plane.
+void downsample_plane(const uint8_t *src, int src_stride, int fx, int fy, uint8_t *dst, int dst_stride, int width,
+                      int height) {
+    const int count = fx * fy;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *row = src + static_cast<size_t>(y * fy) * static_cast<size_t>(src_stride);
+        uint8_t *out = dst + static_cast<size_t>(y) * static_cast<size_t>(dst_stride);
+        for (int x = 0; x < width; ++x) {
+            int sum = 0;
+            for (int dy = 0; dy < fy; ++dy) {
+                for (int dx = 0; dx < fx; ++dx) {
+                    sum += row[static_cast<size_t>(dy * src_stride + x * fx + dx)];
+                }
+            }
+            out[x] = static_cast<uint8_t>((sum + count / 2) / count);
+        }
+    }
+}
+
+} // namespace
+
+struct H264Encoder::Impl {
+    H264Options options;
+    x264_t *encoder = nullptr;
+    x264_picture_t picture = {};
+    bool picture_allocated = false;
+    int width = 0;
+    int height = 0;
+    int64_t pts = 0;
+    YuvImage yuv;
+    std::string last_error;
+
+    ~Impl() {
+        close();
+    }
+
+    void close() {
+        if (encoder != nullptr) {
+            x264_encoder_close(encoder);
+            encoder = nullptr;
+        }
+        if (picture_allocated) {
+            x264_picture_clean(&picture);
+            picture_allocated = false;
+        }
+    }
+
+    bool open(int new_width, int new_height) {
+        close();
+        x264_param_t param;
+        if (x264_param_default_preset(&param, "veryfast", "zerolatency") < 0) {
+            last_error = "x264 preset not available";
+            return false;
+        }
+        param.i_log_level = X264_LOG_ERROR;
+        param.i_csp = X264_CSP_I420;
+        param.i_width = new_width;
+        param.i_height = new_height;
+        param.i_threads = static_cast<int>(options.threads);
+        param.b_sliced_threads = 1;
+        param.i_fps_num = options.fps;
+        param.i_fps_den = 1;
+        param.i_bframe = 0;
+        param.i_keyint_max = static_cast<int>(options.refresh_frames);
+        param.b_intra_refresh = 1;
+        param.b_repeat_headers = 1;
+        param.b_annexb = 1;
+        param.rc.i_rc_method = X264_RC_ABR;
+        param.rc.i_bitrate = static_cast<int>(options.bitrate_kbps);
+        param.rc.i_vbv_max_bitrate = static_cast<int>(options.bitrate_kbps);
+        param.rc.i_vbv_buffer_size = static_cast<int>(options.bitrate_kbps * 2 / options.fps);
+        if (x264_param_apply_profile(&param, "baseline") < 0) {
+            last_error = "x264 baseline profile not available";
+            return false;
+        }
+
+        encoder = x264_encoder_open(&param);
+        if (encoder == nullptr) {
+            last_error = "x264_encoder_open failed";
+            return false;
+        }
+        if (x264_picture_alloc(&picture, X264_CSP_I420, new_width, new_height) < 0) {
+            close();
+            last_error = "x264_picture_alloc failed";
+            return false;
+        }
+        picture_allocated = true;
+        width = new_width;
+        height = new_height;
+        pts = 0;
+        return true;
+    }
+
+    // Copies luma and resamples chroma of the decoded JPEG into the picture.
+    bool convert() {
+        const int chroma_width = width / 2;
+        const int chroma_height = height / 2;
+        for (int y = 0; y < height; ++y) {
+            std::memcpy(picture.img.plane[0] + static_cast<size_t>(y) * static_cast<size_t>(picture.img.i_stride[0]),
+                        yuv.planes[0].data() + static_cast<size_t>(y) * static_cast<size_t>(yuv.strides[0]),
+                        static_cast<size_t>(width));
+        }
+        for (int plane = 1; plane < 3; ++plane) {
+            uint8_t *dst = picture.img.plane[plane];
+            const int dst_stride = picture.img.i_stride[plane];
+            if (yuv.plane_count == 1) {
+                for (int y = 0; y < chroma_height; ++y) {
+                    std::memset(dst + static_cast<size_t>(y) * static_cast<size_t>(dst_stride), 128,
+                                static_cast<size_t>(chroma_width));
+                }
+                continue;
+            }
+            const auto src = static_cast<size_t>(plane);
+            if (yuv.widths[src] < chroma_width || yuv.heights[src] < chroma_height) {
+                last_error = "unsupported chroma subsampling";
+                return false;
+            }
+            const int fx = yuv.widths[src] >= 2 * chroma_width ? 2 : 1;
+            const int fy = yuv.heights[src] >= 2 * chroma_height ? 2 : 1;
+            downsample_plane(yuv.planes[src].data(), yuv.strides[src], fx, fy, dst, dst_stride, chroma_width,
+                             chroma_height);
+        }
+        return true;
+    }
+};
+
+H264Encoder::H264Encoder(const H264Options &options)
+    : impl_(std::make_unique<Impl>()) {
+    if (options.fps == 0 || options.bitrate_kbps == 0) {
+        throw std::runtime_error("fatal: H.264 frame rate and bitrate must be positive");
+    }
+    impl_->options = options;
+}
+
+H264Encoder::~H264Encoder() = default;
+
+bool H264Encoder::available() {
+    return true;
+}
+
+const std::string &H264Encoder::last_error() const {
+    return impl_->last_error;
+}
+
+bool H264Encoder::encode(std::span<const uint8_t> jpeg, ByteVector *out) {
+    Impl &impl = *impl_;
+    JpegDecoder &decoder = JpegDecoder::for_current_thread();
+    if (!decoder.decode_yuv(jpeg, &impl.yuv)) {
+        impl.last_error = decoder.last_error();
+        return false;
+    }
+    if (impl.yuv.width % 2 != 0 || impl.yuv.height % 2 != 0) {
+        impl.last_error = "frame size must be even";
+        return false;
+    }
+    if ((impl.yuv.width != impl.width || impl.yuv.height != impl.height || impl.encoder == nullptr)
+        && !impl.open(impl.yuv.width, impl.yuv.height)) {
+        return false;
+    }
+    if (!impl.convert()) {
+        return false;
+    }
+
+    impl.picture.i_pts = impl.pts++;
+    x264_nal_t *nals = nullptr;
+    int nal_count = 0;
+    x264_picture_t encoded;
+    const int size = x264_encoder_encode(impl.encoder, &nals, &nal_count, &impl.picture, &encoded);
+    if (size < 0) {
+        impl.last_error = "x264_encoder_encode failed";
+        return false;
+    }
+    // The NAL payloads of one call are contiguous. Without lookahead or
+    // B-frames every input frame comes out immediately.
+    if (size == 0) {
+        out->clear();
+    } else {
+        out->assign(nals[0].p_payload, nals[0].p_payload + size);
+    }
+    return true;
+}
+
+#else
+
+struct H264Encoder::Impl {};
+
+H264Encoder::H264Encoder(const H264Options &) {
+    throw std::runtime_error("fatal: built without H.264 support (x264 not found)");
+}
+
+H264Encoder::~H264Encoder() = default;
+
+bool H264Encoder::available() {
+    return false;
+}
+
+const std::string &H264Encoder::last_error() const {
+    static const std::string error = "built without H.264 support";
+    return error;
+}
+
+bool H264Encoder::encode(std::span<const uint8_t>, ByteVector *) {
+    return false;
+}
+
+#endif
+
+} // namespace supercamera
@@ -0,0 +1,108 @@
+#include "supercamera_motion.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+
+namespace supercamera {
+
+MotionDetector::MotionDetector(const MotionOptions &options)
+    : options_(options) {}
+
+std::optional<MotionEvent> MotionDetector::update(const CapturedFrame &frame) {
+    if (!JpegDecoder::for_current_thread().decode_yuv(frame.jpeg, &thumbnail_, 8)) {
+        return std::nullopt;
+    }
+    return update_dc(thumbnail_.planes[0], thumbnail_.widths[0], thumbnail_.heights[0], thumbnail_.strides[0],
+                     frame.source_id, frame.frame_id, frame.timestamp_us);
+}
+
+std::optional<MotionEvent> MotionDetector::update_dc(std::span<const uint8_t> dc, int width, int height, int stride,
+                                                     uint16_t source_id, uint32_t frame_id, uint64_t timestamp_us) {
+    if (width <= 0 || height <= 0 || dc.size() < static_cast<size_t>(stride) * static_cast<size_t>(height)) {
+        return std::nullopt;
+    }
+
+    // A size change (e.g. another camera mode) invalidates the background.
+    if (width != width_ || height != height_) {
+        width_ = width;
+        height_ = height;
+        frames_seen_ = 0;
+        background_.assign(static_cast<size_t>(width) * static_cast<size_t>(height), 0);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                background_[static_cast<size_t>(y * width + x)] = dc[static_cast<size_t>(y * stride + x)] << 8;
+            }
+        }
+    }
+
+    const int32_t threshold = options_.block_threshold << 8;
+    int changed = 0;
+    int min_x = width;
+    int min_y = height;
+    int max_x = -1;
+    int max_y = -1;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *row = dc.data() + static_cast<size_t>(y) * static_cast<size_t>(stride);
+        int32_t *bg = background_.data() + static_cast<size_t>(y) * static_cast<size_t>(width);
+        for (int x = 0; x < width; ++x) {
+            const int32_t delta = (static_cast<int32_t>(row[x]) << 8) - bg[x];
+            if (std::abs(delta) > threshold) {
+                ++changed;
+                min_x = std::min(min_x, x);
+                max_x = std::max(max_x, x);
+                min_y = std::min(min_y, y);
+                max_y = std::max(max_y, y);
+            }
+            bg[x] += delta >> options_.learn_shift;
+        }
+    }
+
+    if (++frames_seen_ <= options_.warmup_frames) {
+        return std::nullopt;
+    }
+
+    const double fraction = static_cast<double>(changed) / static_cast<double>(width * height);
+    const bool moving = changed > 0 && fraction >= options_.min_changed_fraction;
+    if (moving) {
+        last_region_ = {
+            .x = min_x * 8,
+            .y = min_y * 8,
+            .width = (max_x - min_x + 1) * 8,
+            .height = (max_y - min_y + 1) * 8,
+        };
+        last_motion_us_ = timestamp_us;
+        active_region_ = last_region_;
+        active_fraction_ = fraction;
+    } else {
+        last_region_ = {};
+    }
+
+    if (moving && !active_) {
+        active_ = true;
+        return MotionEvent{
+            .kind = MotionEvent::Kind::Started,
+            .source_id = source_id,
+            .frame_id = frame_id,
+            .timestamp_us = timestamp_us,
+            .region = last_region_,
+            .changed_fraction = fraction,
+        };
+    }
+    if (!moving && active_ && timestamp_us >= last_motion_us_ + static_cast<uint64_t>(options_.hold_ms) * 1000) {
+        active_ = false;
+        return MotionEvent{
+            .kind = MotionEvent::Kind::Ended,
+            .source_id = source_id,
+            .frame_id = frame_id,
+            .timestamp_us = timestamp_us,
+            .region = active_region_,
+            .changed_fraction = active_fraction_,
+        };
+    }
+    return std::nullopt;
+}
+
+} // namespace supercamera
@@ -0,0 +1,64 @@
+#include "supercamera_pipeline.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace supercamera {
+
+std::string format_stage_metrics(const StageMetrics &metrics) {
+    std::ostringstream out;
+    out << metrics.name << ": done=" << metrics.processed;
+    if (metrics.filtered > 0) {
+        out << " filtered=" << metrics.filtered;
+    }
+    out << " dropped=" << metrics.dropped << " latency=" << metrics.latency_mean_us << "/" << metrics.latency_max_us
+        << "us queue=" << metrics.queue_depth << "/" << metrics.queue_depth_max << "/" << metrics.queue_capacity;
+    return out.str();
+}
+
+Pipeline::Pipeline(WorkerPool &pool, uint16_t source_count)
+    : pool_(pool),
+      source_count_(source_count) {}
+
+Pipeline::~Pipeline() {
+    stop();
+}
+
+void Pipeline::stop() {
+    for (auto &stage : stages_) {
+        stage->stop();
+    }
+}
+
+void Pipeline::wait_idle() const {
+    // Stages hand items downstream before they go idle, so one pass in
+    // pipeline order that finds every stage idle sees the whole pipeline idle.
+    while (true) {
+        bool idle = true;
+        for (const auto &stage : stages_) {
+            if (!stage->idle()) {
+                idle = false;
+                break;
+            }
+        }
+        if (idle) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+std::vector<StageMetrics> Pipeline::metrics() const {
+    std::vector<StageMetrics> out;
+    out.reserve(stages_.size());
+    for (const auto &stage : stages_) {
+        out.push_back(stage->metrics());
+    }
+    return out;
+}
+
+} // namespace supercamera
@@ -4,17 +4,29 @@
  * SPDX-License-Identifier: CC0-1.0
  */
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 #include <version>
 
+#include <sys/resource.h>
+
 #ifndef __cpp_lib_format
 #include <ctime>
 #endif
@@ -25,107 +37,1051 @@
 #pragma GCC diagnostic ignored "-Wdeprecated-anon-enum-enum-conversion"
 #endif
 #include <opencv2/highgui.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 #pragma GCC diagnostic pop
 
 #include "supercamera_core.hpp"
+#include "supercamera_decoder.hpp"
+#include "supercamera_replay.hpp"
+#include "supercamera_snapshot.hpp"
+#include "supercamera_triple_buffer.hpp"
+#include "supercamera_undistort.hpp"
+#include "supercamera_upp_parser.hpp"
+#include "supercamera_worker_pool.hpp"
 
 #define KRST "\e[0m"
 #define KMAJ "\e[0;35m"
 #define KCYN "\e[0;36m"
 
-static std::mutex gui_mtx;
-static supercamera::ByteVector latest_frame;
-static std::atomic_uint32_t latest_frame_id = 0;
-static std::atomic_bool save_next_frame = false;
+struct EncodedFrame {
+    supercamera::ByteVector jpeg;
+    uint32_t frame_id = 0;
+    uint64_t timestamp_us = 0;
+};
+
+struct DecodedFrame {
+    supercamera::BgrImage image;
+    uint32_t frame_id = 0;
+    uint64_t timestamp_us = 0;
+    uint64_t decode_us = 0;
+    uint64_t decode_start_us = 0;
+    uint64_t decode_end_us = 0;
+    uint64_t undistort_us = 0;
+    size_t jpeg_size = 0;
+    int scale_denom = 1;
+};
+
+struct StageTiming {
+    uint64_t count = 0;
+    uint64_t total_us = 0;
+    uint64_t max_us = 0;
+
+    void add(uint64_t us) {
+        ++count;
+        total_us += us;
+        max_us = std::max(max_us, us);
+    }
+
+    double avg_ms() const {
+        return count == 0 ? 0.0 : static_cast<double>(total_us) / static_cast<double>(count) / 1000.0;
+    }
+
+    double max_ms() const {
+        return static_cast<double>(max_us) / 1000.0;
+    }
+};
+
+struct ViewerOptions {
+    uint16_t camera_count = 1;
+    bool mosaic = false;
+    int tile_width = 320;
+    int tile_height = 240;
+    int scale_denom = 0; // 0 picks the scale from the tile size
+    bool hud = true;
+    bool undistort = false;
+    supercamera::LensCalibration calibration;
+    uint32_t undistort_threads = 0;
+    uint32_t decode_threads = 1;
+    bool headless = false;
+    uint32_t headless_seconds = 10;
+    uint64_t headless_frames = 0;
+    std::string replay_path;
+    uint32_t replay_fps = 30;
+    std::string bench_path;
+    bool bench_parser = false;
+    uint32_t bench_iterations = 1000;
+    uint32_t snapshot_window_ms = 0; // 0 saves the frame following the button press
+    std::optional<uint8_t> lens; // dual-lens endoscopes: only show this lens
+};
+
+struct ViewerSource {
+    uint16_t source_id = 0;
+    std::unique_ptr<supercamera::FrameSource> capture;
+    // Same object as `capture` when it is a USB camera, for lens selection.
+    supercamera::SupercameraCapture *usb = nullptr;
+    supercamera::TripleBuffer<EncodedFrame> encoded;
+    supercamera::TripleBuffer<DecodedFrame> decoded;
+    std::atomic_bool save_next_frame = false;
+    // Snapshot mode; only touched by the capture thread, which also runs the
+    // button callback.
+    std::unique_ptr<supercamera::SnapshotSelector> snapshot;
+    std::atomic_uint64_t captured_frames = 0;
+    std::atomic_uint64_t decoded_frames = 0;
+    bool log_frames = true;
+    std::thread capture_thread;
+    std::thread decode_thread;
+};
+
 static std::atomic_bool exit_program = false;
 static constexpr std::string_view pic_dir = "pics";
+static constexpr uint64_t stats_every = 120;
+static constexpr auto hud_refresh = std::chrono::milliseconds(500);
 
-static void pic_callback(const supercamera::CapturedFrame &frame)
+// Undistortion pool size for --undistort-threads n. The count includes the
+// calling decode thread, which takes tiles too, so the pool gets n - 1
+// workers; 0 means one thread per core.
+static uint32_t undistort_pool_threads(uint32_t undistort_threads)
 {
-    std::cout << KCYN "PIC i:" << frame.frame_id << " size:" << frame.jpeg.size() << KRST << std::endl;
+    const uint32_t threads = undistort_threads > 0 ? undistort_threads
+                                                   : std::max(1u, std::thread::hardware_concurrency());
+    return threads - 1;
+}
 
-    if (save_next_frame) {
-        save_next_frame = false;
-        std::ostringstream filename;
-        auto tp = std::chrono::system_clock::now();
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point since)
+{
+    const auto elapsed = std::chrono::steady_clock::now() - since;
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+static uint64_t wall_clock_us()
+{
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+}
+
+static void save_frame(const supercamera::CapturedFrame &frame)
+{
+    std::ostringstream filename;
+    auto tp = std::chrono::system_clock::now();
 
 #ifdef __cpp_lib_format
-        std::string date = std::format("{:%FT%T}", std::chrono::floor<std::chrono::seconds>(tp));
+    std::string date = std::format("{:%FT%T}", std::chrono::floor<std::chrono::seconds>(tp));
 #else
-        std::time_t t = std::chrono::system_clock::to_time_t(tp);
-        auto date = std::put_time(std::localtime(&t), "%FT%T");
+    std::time_t t = std::chrono::system_clock::to_time_t(tp);
+    auto date = std::put_time(std::localtime(&t), "%FT%T");
 #endif
 
-        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(tp.time_since_epoch()).count() % 1000;
-        filename << pic_dir << "/frame_" << date
-                 << "." << std::setfill('0') << std::setw(3) << millis << ".jpg";
-        std::ofstream output(filename.str(), std::ios::binary);
-        output.write(reinterpret_cast<const char *>(frame.jpeg.data()), static_cast<std::streamsize>(frame.jpeg.size()));
-        std::cout << "Saved frame to " << filename.str() << std::endl;
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(tp.time_since_epoch()).count() % 1000;
+    filename << pic_dir << "/frame_" << date
+             << "." << std::setfill('0') << std::setw(3) << millis;
+    if (frame.source_id != 0) {
+        filename << "_s" << frame.source_id;
+    }
+    filename << ".jpg";
+    std::ofstream output(filename.str(), std::ios::binary);
+    output.write(reinterpret_cast<const char *>(frame.jpeg.data()), static_cast<std::streamsize>(frame.jpeg.size()));
+    std::cout << "Saved frame to " << filename.str();
+    if (frame.sharpness.has_value()) {
+        std::cout << " (frame " << frame.frame_id << ", sharpness " << std::fixed << std::setprecision(1)
+                  << *frame.sharpness << ")";
+    }
+    std::cout << std::endl;
+}
+
+static void pic_callback(ViewerSource &source, const supercamera::CapturedFrame &frame)
+{
+    if (source.log_frames) {
+        std::cout << KCYN "PIC s:" << frame.source_id << " i:" << frame.frame_id << " size:" << frame.jpeg.size()
+                  << KRST << std::endl;
     }
 
-    {
-        std::lock_guard lock(gui_mtx);
-        latest_frame = frame.jpeg;
-        latest_frame_id = frame.frame_id;
+    ++source.captured_frames;
+    if (source.snapshot) {
+        if (const auto best = source.snapshot->push(frame)) {
+            save_frame(*best);
+        }
+    } else if (source.save_next_frame) {
+        source.save_next_frame = false;
+        save_frame(frame);
     }
+
+    EncodedFrame &slot = source.encoded.write_slot();
+    slot.jpeg.assign(frame.jpeg.begin(), frame.jpeg.end());
+    slot.frame_id = frame.frame_id;
+    slot.timestamp_us = frame.timestamp_us;
+    source.encoded.publish();
 }
 
-static void button_callback() {
+static void button_callback(ViewerSource &source) {
     std::cout << KMAJ "BUTTON PRESS" KRST << std::endl;
-    save_next_frame = true;
+    if (source.snapshot) {
+        source.snapshot->trigger(wall_clock_us());
+    } else {
+        source.save_next_frame = true;
+    }
+}
+
+// Cycles the lens shown: any, 0, 1, any, ...
+static void select_next_lens(supercamera::SupercameraCapture &usb)
+{
+    const std::optional<uint8_t> selected = usb.selected_lens();
+    std::optional<uint8_t> next;
+    if (!selected.has_value()) {
+        next = 0;
+    } else if (*selected + 1 < supercamera::MAX_LENSES) {
+        next = static_cast<uint8_t>(*selected + 1);
+    }
+    usb.select_lens(next);
+
+    const std::optional<uint8_t> active = usb.active_lens();
+    std::cout << "showing " << (next.has_value() ? "lens " + std::to_string(*next) : std::string("any lens"));
+    if (next.has_value() && active.has_value() && *active != *next) {
+        std::cout << " (camera is streaming lens " << static_cast<int>(*active)
+                  << "; long-press its button to switch)";
+    }
+    std::cout << std::endl;
 }
 
-static void gui() {
+static cv::Mat as_mat(supercamera::BgrImage &image)
+{
+    return cv::Mat(image.height, image.width, CV_8UC3, image.pixels.data(), static_cast<size_t>(image.stride));
+}
+
+static void decode_worker(ViewerSource &source, const ViewerOptions &opts, supercamera::WorkerPool *pool,
+                          supercamera::WorkerPool *decode_pool) {
+    supercamera::JpegDecoder &decoder = supercamera::JpegDecoder::for_current_thread();
+    std::unique_ptr<supercamera::LensUndistorter> undistorter;
+    supercamera::BgrImage distorted;
+    StageTiming decode_timing;
+    int scale_denom = opts.mosaic ? opts.scale_denom : 1;
+    uint64_t seen = source.encoded.sequence();
+
+    while (!exit_program) {
+        seen = source.encoded.wait(seen);
+        if (!source.encoded.acquire()) {
+            continue;
+        }
+
+        const EncodedFrame &encoded = source.encoded.read_slot();
+        if (scale_denom == 0) {
+            supercamera::JpegInfo info;
+            if (!decoder.read_info(encoded.jpeg, &info)) {
+                continue;
+            }
+            scale_denom = supercamera::JpegDecoder::pick_scale_denom(
+                info.width, info.height, opts.tile_width, opts.tile_height);
+            std::cout << "source " << source.source_id << ": " << info.width << "x" << info.height
+                      << " decoded at 1/" << scale_denom << " for " << opts.tile_width << "x" << opts.tile_height
+                      << " tiles" << std::endl;
+        }
+
+        DecodedFrame &decoded = source.decoded.write_slot();
+        decoded.decode_start_us = wall_clock_us();
+        const auto start = std::chrono::steady_clock::now();
+        const bool ok =
+            decoder.decode_bgr(encoded.jpeg, opts.undistort ? &distorted : &decoded.image, scale_denom, decode_pool);
+        decoded.decode_us = elapsed_us(start);
+        if (!ok) {
+            std::cerr << "decode failed source=" << source.source_id << " frame=" << encoded.frame_id << ": "
+                      << decoder.last_error() << std::endl;
+            continue;
+        }
+
+        decoded.undistort_us = 0;
+        if (opts.undistort) {
+            if (!undistorter || undistorter->width() != distorted.width || undistorter->height() != distorted.height) {
+                undistorter = std::make_unique<supercamera::LensUndistorter>(
+                    opts.calibration, distorted.width, distorted.height, pool);
+            }
+            const auto undistort_start = std::chrono::steady_clock::now();
+            undistorter->apply(distorted, &decoded.image);
+            decoded.undistort_us = elapsed_us(undistort_start);
+        }
+        decoded.decode_end_us = decoded.decode_start_us + decoded.decode_us + decoded.undistort_us;
+        decoded.frame_id = encoded.frame_id;
+        decoded.timestamp_us = encoded.timestamp_us;
+        decoded.jpeg_size = encoded.jpeg.size();
+        decoded.scale_denom = scale_denom;
+        source.decoded.publish();
+        ++source.decoded_frames;
+
+        decode_timing.add(decoded.decode_us);
+        if (!opts.headless && decode_timing.count % stats_every == 0) {
+            std::cout << "decode[" << source.source_id << "]: frames=" << decode_timing.count
+                      << " avg=" << std::fixed << std::setprecision(2) << decode_timing.avg_ms() << "ms"
+                      << " max=" << decode_timing.max_ms() << "ms"
+                      << " skipped=" << source.encoded.dropped_count() << std::endl;
+        }
+    }
+}
+
+static void place_tile(cv::Mat &canvas, const cv::Rect &tile, cv::Mat image)
+{
+    cv::Mat target = canvas(tile);
+    if (image.cols == tile.width && image.rows == tile.height) {
+        image.copyTo(target);
+    } else {
+        cv::resize(image, target, tile.size(), 0, 0, cv::INTER_AREA);
+    }
+}
+
+// Per-source statistics overlay. Samples are accumulated on every displayed
+// frame, but text is only rasterized into `panel` at hud_refresh intervals;
+// in between, drawing the HUD is a single small copy.
+struct SourceHud {
+    cv::Mat panel;
+    uint64_t displayed = 0;
+    uint64_t decode_us_total = 0;
+    uint64_t undistort_us_total = 0;
+    uint64_t latency_us_total = 0;
+    uint64_t latency_us_max = 0;
+    uint64_t captured_at_refresh = 0;
+    size_t jpeg_size = 0;
+    int width = 0;
+    int height = 0;
+    int scale_denom = 1;
+
+    void record(const DecodedFrame &decoded, uint64_t now_us) {
+        const uint64_t latency_us = now_us > decoded.timestamp_us ? now_us - decoded.timestamp_us : 0;
+        ++displayed;
+        decode_us_total += decoded.decode_us;
+        undistort_us_total += decoded.undistort_us;
+        latency_us_total += latency_us;
+        latency_us_max = std::max(latency_us_max, latency_us);
+        jpeg_size = decoded.jpeg_size;
+        width = decoded.image.width;
+        height = decoded.image.height;
+        scale_denom = decoded.scale_denom;
+    }
+
+    void refresh(const ViewerSource &source, double interval_s) {
+        const uint64_t captured = source.captured_frames.load();
+        const uint64_t dropped = source.encoded.dropped_count() + source.decoded.dropped_count();
+        const double shown = static_cast<double>(std::max<uint64_t>(displayed, 1));
+
+        std::ostringstream lines[4];
+        lines[0] << std::fixed << std::setprecision(1)
+                 << "src " << source.source_id << "  " << width << "x" << height << " (1/" << scale_denom << ")";
+        lines[1] << std::fixed << std::setprecision(1)
+                 << "cap " << static_cast<double>(captured - captured_at_refresh) / interval_s << " fps"
+                 << "  disp " << static_cast<double>(displayed) / interval_s << " fps";
+        lines[2] << std::fixed << std::setprecision(1)
+                 << "decode " << static_cast<double>(decode_us_total) / shown / 1000.0 << " ms";
+        if (undistort_us_total > 0) {
+            lines[2] << " +" << static_cast<double>(undistort_us_total) / shown / 1000.0;
+        }
+        lines[2] << "  size " << jpeg_size / 1024 << " KB";
+        lines[3] << std::fixed << std::setprecision(0)
+                 << "lat " << static_cast<double>(latency_us_total) / shown / 1000.0 << " ms"
+                 << " (max " << static_cast<double>(latency_us_max) / 1000.0 << ")"
+                 << "  drop " << dropped;
+
+        constexpr int font = cv::FONT_HERSHEY_PLAIN;
+        constexpr double font_scale = 1.0;
+        constexpr int line_height = 16;
+        int panel_width = 0;
+        for (const auto &line : lines) {
+            int baseline = 0;
+            panel_width = std::max(panel_width, cv::getTextSize(line.str(), font, font_scale, 1, &baseline).width);
+        }
+        panel.create(line_height * 4 + 6, panel_width + 8, CV_8UC3);
+        panel.setTo(cv::Scalar::all(0));
+        for (int i = 0; i < 4; ++i) {
+            cv::putText(panel, lines[i].str(), cv::Point(4, line_height * (i + 1)), font, font_scale,
+                        cv::Scalar(0, 255, 0), 1, cv::LINE_8);
+        }
+
+        displayed = 0;
+        decode_us_total = 0;
+        undistort_us_total = 0;
+        latency_us_total = 0;
+        latency_us_max = 0;
+        captured_at_refresh = captured;
+    }
+
+    void draw(cv::Mat &target, const cv::Rect &area) const {
+        if (panel.empty()) {
+            return;
+        }
+        const cv::Rect visible(0, 0, std::min(panel.cols, area.width), std::min(panel.rows, area.height));
+        cv::Mat destination = target(cv::Rect(area.x, area.y, visible.width, visible.height));
+        panel(visible).copyTo(destination);
+    }
+};
+
+static void gui(std::vector<std::unique_ptr<ViewerSource>> &sources, const ViewerOptions &opts) {
     constexpr const char *window_name = "Geek szitman supercamera - PoC";
-    uint32_t frame_done = latest_frame_id.load();
+    StageTiming display_timing;
+    std::vector<SourceHud> huds(sources.size());
+    bool show_hud = opts.hud;
+    auto last_hud_refresh = std::chrono::steady_clock::now();
 
+    const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(sources.size()))));
+    const int rows = (static_cast<int>(sources.size()) + columns - 1) / columns;
+    cv::Mat canvas;
+    if (opts.mosaic) {
+        canvas.create(rows * opts.tile_height, columns * opts.tile_width, CV_8UC3);
+        canvas.setTo(cv::Scalar::all(0));
+    }
+
+    cv::namedWindow(window_name, cv::WINDOW_AUTOSIZE);
     while (!exit_program) {
         int key = cv::waitKey(10);
         if (key == 'q' || key == '\e') {
             exit_program = true;
         }
+        if (key == 'h') {
+            show_hud = !show_hud;
+        }
+        if (key == 'l') {
+            for (auto &source : sources) {
+                if (source->usb != nullptr) {
+                    select_next_lens(*source->usb);
+                }
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (show_hud && now - last_hud_refresh >= hud_refresh) {
+            const double interval_s = std::chrono::duration<double>(now - last_hud_refresh).count();
+            for (size_t i = 0; i < sources.size(); ++i) {
+                huds[i].refresh(*sources[i], interval_s);
+            }
+            last_hud_refresh = now;
+        }
+
+        bool updated = false;
+        const uint64_t now_us = wall_clock_us();
+        for (size_t i = 0; i < sources.size(); ++i) {
+            ViewerSource &source = *sources[i];
+            if (!source.decoded.acquire()) {
+                continue;
+            }
+            updated = true;
 
-        const uint32_t newest_frame = latest_frame_id.load();
-        if (frame_done != newest_frame) {
-            cv::Mat img;
-            {
-                std::lock_guard lock(gui_mtx);
-                img = cv::imdecode(latest_frame, cv::IMREAD_COLOR);
-                frame_done = newest_frame;
+            DecodedFrame &decoded = source.decoded.read_slot();
+            huds[i].record(decoded, now_us);
+            cv::Rect tile(0, 0, decoded.image.width, decoded.image.height);
+            if (opts.mosaic) {
+                const int index = static_cast<int>(i);
+                tile = cv::Rect(
+                    (index % columns) * opts.tile_width, (index / columns) * opts.tile_height,
+                    opts.tile_width, opts.tile_height);
+                place_tile(canvas, tile, as_mat(decoded.image));
+            } else {
+                canvas = as_mat(decoded.image);
             }
-            if (img.data != nullptr) {
-                cv::namedWindow(window_name, cv::WINDOW_AUTOSIZE);
-                cv::imshow(window_name, img);
+            if (show_hud) {
+                huds[i].draw(canvas, tile);
             }
         }
+        if (!updated) {
+            continue;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        cv::imshow(window_name, canvas);
+        display_timing.add(elapsed_us(start));
+        if (display_timing.count % stats_every == 0) {
+            uint64_t skipped = 0;
+            for (const auto &source : sources) {
+                skipped += source->decoded.dropped_count();
+            }
+            std::cout << "display: frames=" << display_timing.count
+                      << " avg=" << std::fixed << std::setprecision(2) << display_timing.avg_ms() << "ms"
+                      << " max=" << display_timing.max_ms() << "ms"
+                      << " skipped=" << skipped << std::endl;
+        }
     }
 
     cv::destroyWindow(window_name);
 }
 
-int main()
+// Fixed-size latency histogram, so --duration 0 can run for days: exact
+// below 64 us, then 32 buckets per doubling (percentiles within about 3%).
+// The max is exact.
+struct LatencySamples {
+    static constexpr uint64_t EXACT_US = 64;
+    static constexpr int SUB_BUCKET_BITS = 5;
+
+    std::array<uint64_t, EXACT_US + (64 - 6) * (1 << SUB_BUCKET_BITS)> counts{};
+    uint64_t samples = 0;
+    uint64_t max_us = 0;
+
+    static size_t bucket(uint64_t us) {
+        if (us < EXACT_US) {
+            return static_cast<size_t>(us);
+        }
+        const int shift = std::bit_width(us) - 1 - SUB_BUCKET_BITS;
+        const uint64_t sub_bucket = (us >> shift) - (uint64_t{1} << SUB_BUCKET_BITS);
+        return static_cast<size_t>(EXACT_US + static_cast<uint64_t>(shift - 1) * (1 << SUB_BUCKET_BITS) + sub_bucket);
+    }
+
+    // Smallest latency that falls into `index`.
+    static uint64_t bucket_floor_us(size_t index) {
+        if (index < EXACT_US) {
+            return index;
+        }
+        const size_t offset = index - EXACT_US;
+        const int shift = static_cast<int>(offset >> SUB_BUCKET_BITS) + 1;
+        const uint64_t sub_bucket = offset & ((1 << SUB_BUCKET_BITS) - 1);
+        return (sub_bucket + (uint64_t{1} << SUB_BUCKET_BITS)) << shift;
+    }
+
+    void add(uint64_t us) {
+        ++counts[bucket(us)];
+        ++samples;
+        max_us = std::max(max_us, us);
+    }
+
+    double percentile_ms(double p) const {
+        if (samples == 0) {
+            return 0.0;
+        }
+        if (p >= 1.0) {
+            return static_cast<double>(max_us) / 1000.0;
+        }
+        // The sample at this index in sorted order.
+        const auto rank = static_cast<uint64_t>(p * static_cast<double>(samples - 1));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return static_cast<double>(std::min(bucket_floor_us(i), max_us)) / 1000.0;
+            }
+        }
+        return static_cast<double>(max_us) / 1000.0;
+    }
+};
+
+static double cpu_seconds(const rusage &usage, bool system)
+{
+    const timeval &tv = system ? usage.ru_stime : usage.ru_utime;
+    return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6;
+}
+
+static void stop_signal_handler(int)
+{
+    exit_program = true;
+}
+
+// Same capture and decode threads as the GUI; this thread stands in for the
+// display loop (including mosaic compositing) without creating a window.
+static int run_headless(std::vector<std::unique_ptr<ViewerSource>> &sources, const ViewerOptions &opts)
 {
+    LatencySamples queue_wait;
+    LatencySamples decode;
+    LatencySamples undistort;
+    LatencySamples handoff;
+    LatencySamples total;
+
+    const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(sources.size()))));
+    const int rows = (static_cast<int>(sources.size()) + columns - 1) / columns;
+    cv::Mat canvas;
+    if (opts.mosaic) {
+        canvas.create(rows * opts.tile_height, columns * opts.tile_width, CV_8UC3);
+        canvas.setTo(cv::Scalar::all(0));
+    }
+
+    rusage usage_start{};
+    getrusage(RUSAGE_SELF, &usage_start);
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + std::chrono::seconds(opts.headless_seconds);
+    uint64_t consumed = 0;
+
+    while (!exit_program) {
+        if (opts.headless_seconds > 0 && std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+        if (opts.headless_frames > 0 && consumed >= opts.headless_frames) {
+            break;
+        }
+
+        bool updated = false;
+        const uint64_t now_us = wall_clock_us();
+        for (size_t i = 0; i < sources.size(); ++i) {
+            ViewerSource &source = *sources[i];
+            if (!source.decoded.acquire()) {
+                continue;
+            }
+            updated = true;
+            ++consumed;
+
+            DecodedFrame &decoded = source.decoded.read_slot();
+            queue_wait.add(decoded.decode_start_us - std::min(decoded.decode_start_us, decoded.timestamp_us));
+            decode.add(decoded.decode_us);
+            undistort.add(decoded.undistort_us);
+            handoff.add(now_us - std::min(now_us, decoded.decode_end_us));
+            total.add(now_us - std::min(now_us, decoded.timestamp_us));
+            if (opts.mosaic) {
+                const int index = static_cast<int>(i);
+                place_tile(canvas, cv::Rect((index % columns) * opts.tile_width, (index / columns) * opts.tile_height,
+                                            opts.tile_width, opts.tile_height),
+                           as_mat(decoded.image));
+            }
+        }
+        if (!updated) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    const double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    rusage usage_end{};
+    getrusage(RUSAGE_SELF, &usage_end);
+    const double user_s = cpu_seconds(usage_end, false) - cpu_seconds(usage_start, false);
+    const double system_s = cpu_seconds(usage_end, true) - cpu_seconds(usage_start, true);
+
+    uint64_t captured = 0;
+    uint64_t decoded_total = 0;
+    uint64_t skipped_decode = 0;
+    uint64_t skipped_display = 0;
+    for (const auto &source : sources) {
+        captured += source->captured_frames.load();
+        decoded_total += source->decoded_frames.load();
+        skipped_decode += source->encoded.dropped_count();
+        skipped_display += source->decoded.dropped_count();
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "headless: " << wall_s << " s, sources=" << sources.size() << "\n"
+              << "frames: captured=" << captured << " decoded=" << decoded_total << " consumed=" << consumed
+              << " skipped_before_decode=" << skipped_decode << " skipped_before_display=" << skipped_display << "\n"
+              << "throughput: capture=" << static_cast<double>(captured) / wall_s << " fps"
+              << " decode=" << static_cast<double>(decoded_total) / wall_s << " fps"
+              << " display=" << static_cast<double>(consumed) / wall_s << " fps\n"
+              << std::setprecision(2)
+              << "cpu: user=" << user_s << " s sys=" << system_s << " s"
+              << " load=" << (user_s + system_s) / wall_s * 100.0 << "% of one core"
+              << " per_decoded_frame=" << (decoded_total > 0 ? (user_s + system_s) * 1000.0 / static_cast<double>(decoded_total) : 0.0)
+              << " ms\n"
+              << "latency (ms)          p50      p90      p99      max\n";
+    const auto print_row = [](const char *name, const LatencySamples &samples) {
+        std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(9) << samples.percentile_ms(0.50)
+                  << std::setw(9) << samples.percentile_ms(0.90)
+                  << std::setw(9) << samples.percentile_ms(0.99)
+                  << std::setw(9) << samples.percentile_ms(1.0) << "\n";
+    };
+    print_row("capture->decode", queue_wait);
+    print_row("decode", decode);
+    if (opts.undistort) {
+        print_row("undistort", undistort);
+    }
+    print_row("decode->display", handoff);
+    print_row("capture->display", total);
+    std::cout.flush();
+    return consumed > 0 ? 0 : 1;
+}
+
+static bool read_file(const std::string &path, supercamera::ByteVector *out)
+{
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    out->assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    return !out->empty();
+}
+
+template <typename Fn>
+static StageTiming bench_loop(uint32_t iterations, Fn &&fn)
+{
+    StageTiming timing;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        if (!fn()) {
+            break;
+        }
+        timing.add(elapsed_us(start));
+    }
+    return timing;
+}
+
+static void print_bench(const char *name, const StageTiming &timing)
+{
+    std::cout << std::left << std::setw(20) << name << std::right
+              << " frames=" << timing.count
+              << " avg=" << std::fixed << std::setprecision(3) << timing.avg_ms() << "ms"
+              << " max=" << timing.max_ms() << "ms"
+              << " fps=" << std::setprecision(1) << (timing.avg_ms() > 0.0 ? 1000.0 / timing.avg_ms() : 0.0)
+              << std::endl;
+}
+
+static int bench_decode(const ViewerOptions &opts)
+{
+    const std::string &path = opts.bench_path;
+    const uint32_t iterations = opts.bench_iterations;
+    supercamera::ByteVector jpeg;
+    if (!read_file(path, &jpeg)) {
+        std::cerr << "cannot read " << path << std::endl;
+        return 1;
+    }
+
+    supercamera::JpegDecoder &decoder = supercamera::JpegDecoder::for_current_thread();
+    supercamera::JpegInfo info;
+    if (!decoder.read_info(jpeg, &info)) {
+        std::cerr << "not a JPEG: " << decoder.last_error() << std::endl;
+        return 1;
+    }
+    std::cout << path << ": " << info.width << "x" << info.height << " " << jpeg.size() << " bytes, "
+              << iterations << " iterations" << std::endl;
+
+    cv::Mat reused;
+    supercamera::BgrImage bgr;
+    supercamera::YuvImage yuv;
+    print_bench("cv::imdecode", bench_loop(iterations, [&] {
+        return !cv::imdecode(jpeg, cv::IMREAD_COLOR).empty();
+    }));
+    print_bench("cv::imdecode (dst)", bench_loop(iterations, [&] {
+        return !cv::imdecode(jpeg, cv::IMREAD_COLOR, &reused).empty();
+    }));
+    print_bench("turbojpeg bgr", bench_loop(iterations, [&] {
+        return decoder.decode_bgr(jpeg, &bgr);
+    }));
+    if (opts.decode_threads > 1) {
+        supercamera::WorkerPool pool(opts.decode_threads - 1);
+        const std::string name = "turbojpeg bgr " + std::to_string(opts.decode_threads) + " threads";
+        print_bench(name.c_str(), bench_loop(iterations, [&] {
+            return decoder.decode_bgr(jpeg, &bgr, 1, &pool);
+        }));
+    }
+    print_bench("turbojpeg yuv", bench_loop(iterations, [&] {
+        return decoder.decode_yuv(jpeg, &yuv);
+    }));
+    print_bench("turbojpeg bgr 1/2", bench_loop(iterations, [&] {
+        return decoder.decode_bgr(jpeg, &bgr, 2);
+    }));
+    print_bench("turbojpeg bgr 1/4", bench_loop(iterations, [&] {
+        return decoder.decode_bgr(jpeg, &bgr, 4);
+    }));
+    print_bench("turbojpeg bgr 1/8 dc", bench_loop(iterations, [&] {
+        return decoder.decode_bgr(jpeg, &bgr, 8);
+    }));
+
+    if (opts.undistort && decoder.decode_bgr(jpeg, &bgr)) {
+        supercamera::BgrImage undistorted;
+        const supercamera::LensUndistorter single(opts.calibration, bgr.width, bgr.height);
+        print_bench("undistort 1 thread", bench_loop(iterations, [&] {
+            return single.apply(bgr, &undistorted);
+        }));
+        if (const uint32_t pool_threads = undistort_pool_threads(opts.undistort_threads); pool_threads > 0) {
+            supercamera::WorkerPool pool(pool_threads);
+            const supercamera::LensUndistorter pooled(opts.calibration, bgr.width, bgr.height, &pool);
+            const std::string name = "undistort " + std::to_string(pool_threads + 1) + " threads";
+            print_bench(name.c_str(), bench_loop(iterations, [&] {
+                return pooled.apply(bgr, &undistorted);
+            }));
+        }
+    }
+    return 0;
+}
+
+// Bulk packets as the camera sends them: 5-byte USB header (magic 0xBBAA,
+// cid 7, length) and 7-byte camera header before each slice of the frame.
+static std::vector<supercamera::ByteVector> make_upp_packets(uint32_t frames, size_t packets_per_frame,
+                                                             size_t payload_size)
+{
+    std::vector<supercamera::ByteVector> packets;
+    packets.reserve(frames * packets_per_frame);
+    for (uint32_t fid = 0; fid < frames; ++fid) {
+        for (size_t i = 0; i < packets_per_frame; ++i) {
+            const auto length = static_cast<uint16_t>(7 + payload_size);
+            supercamera::ByteVector packet = {
+                0xAA, 0xBB, 7, static_cast<uint8_t>(length & 0xFF), static_cast<uint8_t>(length >> 8),
+                static_cast<uint8_t>(fid), 0, 0, 0, 0, 0, 0,
+            };
+            packet.resize(packet.size() + payload_size, static_cast<uint8_t>(i));
+            packets.push_back(std::move(packet));
+        }
+    }
+    return packets;
+}
+
+template <typename FrameSink>
+static double bench_parser_ns(const std::vector<supercamera::ByteVector> &packets, uint32_t iterations,
+                              FrameSink frame_sink)
+{
+    supercamera::LensState lens;
+    supercamera::UppParser parser(std::move(frame_sink), supercamera::IgnoreButton{}, 0, false, lens);
+    // Warm-up pass: grows the frame buffer to full size before timing.
+    for (const supercamera::ByteVector &packet : packets) {
+        parser.handle_upp_frame(packet);
+    }
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        for (const supercamera::ByteVector &packet : packets) {
+            parser.handle_upp_frame(packet);
+        }
+    }
+    parser.flush_pending();
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    return static_cast<double>(ns.count()) / (static_cast<double>(packets.size()) * iterations);
+}
+
+// Per-packet cost of handle_upp_frame with the sink called through
+// std::function (as run() does) and inlined (as run_with() does). Packets are
+// small so the header parsing, not the payload copy, dominates.
+static int bench_parser(const ViewerOptions &opts)
+{
+    const uint32_t iterations = std::max<uint32_t>(opts.bench_iterations / 10, 1);
+    const std::vector<supercamera::ByteVector> packets = make_upp_packets(30, 64, 64);
+    std::cout << packets.size() << " packets of " << packets.front().size() << " bytes, " << iterations
+              << " iterations" << std::endl;
+
+    uint64_t frames = 0;
+    const supercamera::FrameCallback callback = [&](const supercamera::CapturedFrame &frame) {
+        frames += frame.jpeg.size() > 0;
+    };
+    const auto print = [](const char *name, double ns) {
+        std::cout << std::left << std::setw(20) << name << std::right << " " << std::fixed << std::setprecision(1)
+                  << ns << "ns/packet" << std::endl;
+    };
+    print("std::function sink", bench_parser_ns(packets, iterations, [&](const supercamera::CapturedFrame &frame) {
+        callback(frame);
+    }));
+    print("inline sink", bench_parser_ns(packets, iterations, [&](const supercamera::CapturedFrame &frame) {
+        frames += frame.jpeg.size() > 0;
+    }));
+    std::cout << frames << " frames" << std::endl;
+    return 0;
+}
+
+static void print_usage(const char *argv0)
+{
+    std::cout << "Usage: " << argv0 << " [options]\n"
+              << "\n"
+              << "Options:\n"
+              << "  --camera-count <n>         Number of USB cameras to show (default: 1).\n"
+              << "  --mosaic                   Show all cameras as tiles of one window (implied by n > 1).\n"
+              << "  --tile <WxH>               Mosaic tile size (default: 320x240).\n"
+              << "  --scale <1|2|4|8>          Mosaic decode scale denominator (default: picked from tile).\n"
+              << "  --no-hud                   Start with the statistics overlay hidden (toggle with 'h').\n"
+              << "  --undistort <fx,fy,cx,cy,k1,k2[,p1,p2[,k3]]>\n"
+              << "                             Correct lens distortion using a calibration made at 640x480.\n"
+              << "  --undistort-threads <n>    Threads undistorting each frame, counting the decode thread,\n"
+              << "                             which takes tiles too; 0 for one per core (default: 0).\n"
+              << "  --decode-threads <n>       Decode JPEGs with restart markers in n parallel strips\n"
+              << "                             (default: 1, serial).\n"
+              << "  --snapshot-window <ms>     On a button press, save the sharpest frame captured within\n"
+              << "                             this many ms before or after it (default: 0, next frame).\n"
+              << "  --lens <0|1>               Dual-lens endoscopes: only decode and show this lens\n"
+              << "                             (default: any; cycle with 'l').\n"
+              << "  --replay <dir|file.jpg>    Replay recorded JPEG frames instead of capturing from USB.\n"
+              << "  --replay-fps <n>           Replay frame rate, 0 for unpaced (default: 30).\n"
+              << "  --headless                 Run capture and decode without a window and print a report.\n"
+              << "  --duration <s>             Headless run time in seconds, 0 for unlimited (default: 10).\n"
+              << "  --frames <n>               Stop headless run after n displayed frames (default: 0, no limit).\n"
+              << "  --bench-decode <file.jpg>  Benchmark JPEG decoders on a file and exit.\n"
+              << "  --bench-parser             Benchmark UPP packet parsing with std::function vs inline\n"
+              << "                             frame sinks and exit.\n"
+              << "  --iterations <n>           Benchmark iterations (default: 1000).\n"
+              << "  --help                     Show this help.\n";
+}
+
+static bool parse_tile(const std::string &value, ViewerOptions *opts)
+{
+    const size_t x = value.find('x');
+    if (x == std::string::npos) {
+        return false;
+    }
+    opts->tile_width = std::stoi(value.substr(0, x));
+    opts->tile_height = std::stoi(value.substr(x + 1));
+    return opts->tile_width > 0 && opts->tile_height > 0;
+}
+
+static int parse_args(int argc, char **argv, ViewerOptions *opts)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--camera-count" && has_value) {
+            const unsigned long count = std::stoul(argv[++i]);
+            if (count == 0 || count > 65535UL) {
+                throw std::runtime_error("invalid --camera-count value");
+            }
+            opts->camera_count = static_cast<uint16_t>(count);
+        } else if (arg == "--mosaic") {
+            opts->mosaic = true;
+        } else if (arg == "--tile" && has_value) {
+            if (!parse_tile(argv[++i], opts)) {
+                throw std::runtime_error("invalid --tile value");
+            }
+        } else if (arg == "--scale" && has_value) {
+            opts->scale_denom = std::stoi(argv[++i]);
+            if (opts->scale_denom != 1 && opts->scale_denom != 2 && opts->scale_denom != 4 && opts->scale_denom != 8) {
+                throw std::runtime_error("invalid --scale value");
+            }
+        } else if (arg == "--no-hud") {
+            opts->hud = false;
+        } else if (arg == "--undistort" && has_value) {
+            if (!supercamera::LensCalibration::parse(argv[++i], &opts->calibration)) {
+                throw std::runtime_error("invalid --undistort value");
+            }
+            opts->undistort = true;
+        } else if (arg == "--undistort-threads" && has_value) {
+            opts->undistort_threads = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--decode-threads" && has_value) {
+            opts->decode_threads = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (opts->decode_threads == 0) {
+                throw std::runtime_error("invalid --decode-threads value");
+            }
+        } else if (arg == "--snapshot-window" && has_value) {
+            opts->snapshot_window_ms = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--lens" && has_value) {
+            const std::string value = argv[++i];
+            if (value != "0" && value != "1") {
+                throw std::runtime_error("invalid --lens value");
+            }
+            opts->lens = static_cast<uint8_t>(value[0] - '0');
+        } else if (arg == "--replay" && has_value) {
+            opts->replay_path = argv[++i];
+        } else if (arg == "--replay-fps" && has_value) {
+            opts->replay_fps = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--headless") {
+            opts->headless = true;
+        } else if (arg == "--duration" && has_value) {
+            opts->headless_seconds = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--frames" && has_value) {
+            opts->headless_frames = std::stoull(argv[++i]);
+        } else if (arg == "--bench-parser") {
+            opts->bench_parser = true;
+        } else if (arg == "--bench-decode" && has_value) {
+            opts->bench_path = argv[++i];
+        } else if (arg == "--iterations" && has_value) {
+            opts->bench_iterations = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (opts->camera_count > 1) {
+        opts->mosaic = true;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    ViewerOptions opts;
+    std::unique_ptr<supercamera::WorkerPool> undistort_pool;
+    std::unique_ptr<supercamera::WorkerPool> decode_pool;
+    std::vector<std::unique_ptr<ViewerSource>> sources;
+    std::atomic_uint32_t active_capture_threads = 0;
+
     try {
+        const int parse_result = parse_args(argc, argv, &opts);
+        if (parse_result <= 0) {
+            return parse_result == 0 ? 0 : 1;
+        }
+
+        if (opts.bench_parser) {
+            return bench_parser(opts);
+        }
+        if (!opts.bench_path.empty()) {
+            return bench_decode(opts);
+        }
+
         std::filesystem::create_directory(pic_dir);
 
-        supercamera::SupercameraCapture capture(0, button_callback);
-        std::thread capture_thread([&capture] {
-            try {
-                capture.run(pic_callback);
-            } catch (const std::exception &e) {
-                std::cerr << e.what() << std::endl;
+        std::vector<supercamera::ByteVector> replay_frames;
+        if (!opts.replay_path.empty()) {
+            replay_frames = supercamera::ReplayCapture::load_jpegs(opts.replay_path);
+        } else {
+            const size_t available_devices = supercamera::SupercameraCapture::available_devices();
+            if (opts.camera_count > 1 && opts.camera_count > available_devices) {
+                std::cerr << "requested " << opts.camera_count << " cameras, but only "
+                          << available_devices << " available" << std::endl;
+                opts.camera_count = static_cast<uint16_t>(std::max<size_t>(available_devices, 1));
             }
-            exit_program = true;
-        });
+        }
+
+        for (uint16_t source_id = 0; source_id < opts.camera_count; ++source_id) {
+            auto source = std::make_unique<ViewerSource>();
+            source->source_id = source_id;
+            source->log_frames = !opts.headless;
+            if (opts.snapshot_window_ms > 0) {
+                source->snapshot = std::make_unique<supercamera::SnapshotSelector>(
+                    supercamera::SnapshotOptions{.window_ms = opts.snapshot_window_ms});
+            }
+            ViewerSource *raw = source.get();
+            if (!replay_frames.empty()) {
+                source->capture = std::make_unique<supercamera::ReplayCapture>(
+                    source_id, replay_frames, opts.replay_fps);
+            } else {
+                auto usb = std::make_unique<supercamera::SupercameraCapture>(
+                    source_id, [raw] { button_callback(*raw); });
+                usb->select_lens(opts.lens);
+                source->usb = usb.get();
+                source->capture = std::move(usb);
+            }
+            sources.push_back(std::move(source));
+        }
 
-        gui();
+        if (opts.undistort) {
+            if (const uint32_t pool_threads = undistort_pool_threads(opts.undistort_threads); pool_threads > 0) {
+                undistort_pool = std::make_unique<supercamera::WorkerPool>(pool_threads);
+            }
+        }
+        if (opts.decode_threads > 1) {
+            decode_pool = std::make_unique<supercamera::WorkerPool>(opts.decode_threads - 1);
+        }
 
-        capture.request_stop();
-        capture_thread.join();
-        return 0;
+        active_capture_threads = static_cast<uint32_t>(sources.size());
+        for (auto &source : sources) {
+            ViewerSource *raw = source.get();
+            source->capture_thread = std::thread([raw, &active_capture_threads] {
+                try {
+                    raw->capture->run([raw](const supercamera::CapturedFrame &frame) { pic_callback(*raw, frame); });
+                } catch (const std::exception &e) {
+                    std::cerr << e.what() << std::endl;
+                }
+                if (active_capture_threads.fetch_sub(1) == 1) {
+                    exit_program = true;
+                }
+                raw->encoded.wake();
+            });
+            source->decode_thread = std::thread([raw, &opts, pool = undistort_pool.get(), decode = decode_pool.get()] {
+                decode_worker(*raw, opts, pool, decode);
+            });
+        }
+
+        int exit_code = 0;
+        if (opts.headless) {
+            std::signal(SIGINT, stop_signal_handler);
+            std::signal(SIGTERM, stop_signal_handler);
+            exit_code = run_headless(sources, opts);
+        } else {
+            gui(sources, opts);
+        }
+
+        exit_program = true;
+        for (auto &source : sources) {
+            source->capture->request_stop();
+            source->encoded.wake();
+        }
+        for (auto &source : sources) {
+            source->decode_thread.join();
+            source->capture_thread.join();
+        }
+        return exit_code;
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
+        exit_program = true;
+        for (auto &source : sources) {
+            source->capture->request_stop();
+            source->encoded.wake();
+            if (source->decode_thread.joinable()) {
+                source->decode_thread.join();
+            }
+            if (source->capture_thread.joinable()) {
+                source->capture_thread.join();
+            }
+        }
         return 1;
     }
 }
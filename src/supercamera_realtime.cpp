@@ -0,0 +1,185 @@
+#include "supercamera_realtime.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+namespace supercamera {
+namespace {
+
+#if defined(__linux__)
+constexpr int64_t NS_PER_SECOND = 1'000'000'000;
+
+void add_ns(timespec &ts, int64_t ns) {
+    ts.tv_nsec += ns;
+    while (ts.tv_nsec >= NS_PER_SECOND) {
+        ts.tv_nsec -= NS_PER_SECOND;
+        ++ts.tv_sec;
+    }
+}
+
+int64_t diff_ns(const timespec &later, const timespec &earlier) {
+    return (later.tv_sec - earlier.tv_sec) * NS_PER_SECOND + (later.tv_nsec - earlier.tv_nsec);
+}
+
+// Whether the effective capability set holds CAP_IPC_LOCK, which lets locked
+// memory exceed RLIMIT_MEMLOCK.
+bool has_ipc_lock_capability() {
+    constexpr int cap_ipc_lock = 14;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("CapEff:")) {
+            return ((std::stoull(line.substr(7), nullptr, 16) >> cap_ipc_lock) & 1) != 0;
+        }
+    }
+    return false;
+}
+#endif
+
+} // namespace
+
+void apply_thread_options(const ThreadOptions &options) {
+#if defined(__linux__)
+    if (options.cpu.has_value()) {
+        if (*options.cpu < 0 || *options.cpu >= CPU_SETSIZE) {
+            throw std::runtime_error("CPU " + std::to_string(*options.cpu) + " out of range");
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(*options.cpu, &cpus);
+        if (const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus); err != 0) {
+            throw std::runtime_error("cannot pin thread to CPU " + std::to_string(*options.cpu) + ": "
+                                     + std::strerror(err));
+        }
+    }
+    if (options.fifo_priority > 0) {
+        sched_param param{};
+        param.sched_priority = options.fifo_priority;
+        if (const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param); err != 0) {
+            throw std::runtime_error("cannot run thread as SCHED_FIFO priority " + std::to_string(options.fifo_priority)
+                                     + ": " + std::strerror(err) + " (needs CAP_SYS_NICE or an rtprio limit)");
+        }
+    }
+#else
+    if (options.cpu.has_value() || options.fifo_priority > 0) {
+        throw std::runtime_error("thread pinning and SCHED_FIFO are only supported on Linux");
+    }
+#endif
+}
+
+void lock_process_memory() {
+#if defined(__linux__)
+    rlimit limit{};
+    if (!has_ipc_lock_capability() && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        throw std::runtime_error("cannot lock memory: the memlock limit is " + std::to_string(limit.rlim_cur / 1024)
+                                 + " KiB, which later thread stacks and buffers would exceed (" + MEMLOCK_HINT + ")");
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        throw std::runtime_error(std::string("cannot lock memory: ") + std::strerror(errno) + " (" + MEMLOCK_HINT
+                                 + ")");
+    }
+#else
+    throw std::runtime_error("memory locking is only supported on Linux");
+#endif
+}
+
+std::string format_latency_summary(const LatencySummary &summary) {
+    std::ostringstream out;
+    out << summary.mean_us << "/" << summary.p99_us;
+    if (summary.p99_us >= LatencyHistogram::MAX_BUCKET_US) {
+        out << "+";
+    }
+    out << "/" << summary.max_us << "us";
+    return out.str();
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    const uint64_t us = std::min<uint64_t>(ns / 1000, MAX_BUCKET_US);
+    buckets_[us].fetch_add(1, std::memory_order_relaxed);
+    total_ns_.fetch_add(ns, std::memory_order_relaxed);
+    if (ns > max_ns_.load(std::memory_order_relaxed)) {
+        max_ns_.store(ns, std::memory_order_relaxed);
+    }
+    // Last, so a reader never sees more samples than bucket counts.
+    samples_.fetch_add(1, std::memory_order_release);
+}
+
+LatencySummary LatencyHistogram::summary() const {
+    LatencySummary summary;
+    summary.samples = samples_.load(std::memory_order_acquire);
+    if (summary.samples == 0) {
+        return summary;
+    }
+    summary.mean_us = total_ns_.load(std::memory_order_relaxed) / summary.samples / 1000;
+    summary.max_us = max_ns_.load(std::memory_order_relaxed) / 1000;
+
+    // The sample at or below which 99% of the samples fall.
+    const uint64_t rank = summary.samples - summary.samples / 100;
+    uint64_t seen = 0;
+    for (size_t us = 0; us < buckets_.size(); ++us) {
+        seen += buckets_[us].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            summary.p99_us = us;
+            break;
+        }
+    }
+    return summary;
+}
+
+SchedulingLatencyProbe::SchedulingLatencyProbe(const ThreadOptions &options, std::chrono::microseconds interval)
+    : thread_([this, options, interval] { run(options, interval); }) {}
+
+SchedulingLatencyProbe::~SchedulingLatencyProbe() {
+    stop_requested_ = true;
+    thread_.join();
+}
+
+void SchedulingLatencyProbe::run(ThreadOptions options, std::chrono::microseconds interval) {
+    try {
+        apply_thread_options(options);
+    } catch (const std::exception &e) {
+        std::cerr << "scheduling latency probe: " << e.what() << "\n";
+        return;
+    }
+
+#if defined(__linux__)
+    const int64_t interval_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count();
+    timespec next{};
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!stop_requested_) {
+        add_ns(next, interval_ns);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR) {
+        }
+        timespec now{};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const int64_t late_ns = diff_ns(now, next);
+        histogram_.record(late_ns > 0 ? static_cast<uint64_t>(late_ns) : 0);
+        // After a stall longer than an interval, measure from now rather
+        // than count the missed wakeups as ever later.
+        if (late_ns > interval_ns) {
+            next = now;
+        }
+    }
+#else
+    (void)interval;
+#endif
+}
+
+} // namespace supercamera
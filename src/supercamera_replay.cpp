@@ -0,0 +1,111 @@
+#include "supercamera_replay.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace supercamera {
+namespace {
+
+bool is_jpeg(const ByteVector &data) {
+    return data.size() >= 4 && data[0] == 0xFF && data[1] == 0xD8;
+}
+
+bool has_jpeg_extension(const std::filesystem::path &path) {
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return ext == ".jpg" || ext == ".jpeg";
+}
+
+ByteVector read_file(const std::filesystem::path &path) {
+    std::ifstream input(path, std::ios::binary);
+    return ByteVector(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+}
+
+uint64_t now_us() {
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+}
+
+} // namespace
+
+ReplayCapture::ReplayCapture(uint16_t source_id, std::vector<ByteVector> frames, uint32_t fps)
+    : frames_(std::move(frames)),
+      source_id_(source_id),
+      fps_(fps) {
+    if (frames_.empty()) {
+        throw std::invalid_argument("replay needs at least one frame");
+    }
+}
+
+void ReplayCapture::request_stop() {
+    stop_requested_ = true;
+}
+
+void ReplayCapture::run(const FrameCallback &frame_callback) {
+    if (!frame_callback) {
+        throw std::invalid_argument("frame callback is required");
+    }
+
+    stop_requested_ = false;
+    const auto frame_interval =
+        (fps_ > 0) ? std::chrono::microseconds(1000000 / fps_) : std::chrono::microseconds(0);
+    auto next_frame_time = std::chrono::steady_clock::now();
+    uint32_t frame_id = 0;
+
+    CapturedFrame frame = {
+        .jpeg = {},
+        .source_id = source_id_,
+        .frame_id = 0,
+        .timestamp_us = 0,
+    };
+    while (!stop_requested_) {
+        if (fps_ > 0) {
+            std::this_thread::sleep_until(next_frame_time);
+            next_frame_time += frame_interval;
+        }
+
+        const ByteVector &jpeg = frames_[frame_id % frames_.size()];
+        frame.jpeg.assign(jpeg.begin(), jpeg.end());
+        frame.frame_id = frame_id++;
+        frame.timestamp_us = now_us();
+        frame_callback(frame);
+    }
+}
+
+std::vector<ByteVector> ReplayCapture::load_jpegs(const std::string &path) {
+    std::vector<std::filesystem::path> files;
+    if (std::filesystem::is_directory(path)) {
+        for (const auto &entry : std::filesystem::directory_iterator(path)) {
+            if (entry.is_regular_file() && has_jpeg_extension(entry.path())) {
+                files.push_back(entry.path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+    } else {
+        files.emplace_back(path);
+    }
+
+    std::vector<ByteVector> frames;
+    for (const auto &file : files) {
+        ByteVector data = read_file(file);
+        if (is_jpeg(data)) {
+            frames.push_back(std::move(data));
+        }
+    }
+    if (frames.empty()) {
+        throw std::runtime_error("fatal: no JPEG frames found in " + path);
+    }
+    return frames;
+}
+
+} // namespace supercamera
@@ -0,0 +1,77 @@
+#include "supercamera_snapshot.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+#include "supercamera_transcoder.hpp"
+
+namespace supercamera {
+
+SnapshotSelector::SnapshotSelector(const SnapshotOptions &options)
+    : window_us_(static_cast<uint64_t>(options.window_ms) * 1000) {}
+
+void SnapshotSelector::trigger(uint64_t timestamp_us) {
+    if (!trigger_us_.has_value()) {
+        trigger_us_ = timestamp_us;
+    }
+}
+
+void SnapshotSelector::score(Candidate &candidate) {
+    double sharpness = 0.0;
+    if (JpegTranscoder::for_current_thread().sharpness(candidate.frame.jpeg, &sharpness)) {
+        candidate.sharpness = sharpness;
+    }
+    candidate.scored = true;
+}
+
+std::optional<CapturedFrame> SnapshotSelector::push(const CapturedFrame &frame) {
+    recent_.push_back({.frame = frame, .sharpness = std::nullopt, .scored = false});
+
+    // Keep what the window before a pending trigger (or before a trigger that
+    // could still come) needs.
+    const uint64_t horizon_us = trigger_us_.has_value() ? std::min(*trigger_us_, frame.timestamp_us)
+                                                        : frame.timestamp_us;
+    while (recent_.front().frame.timestamp_us + window_us_ < horizon_us) {
+        recent_.pop_front();
+    }
+
+    if (!trigger_us_.has_value()) {
+        return std::nullopt;
+    }
+    const uint64_t window_end_us = *trigger_us_ + window_us_;
+    if (frame.timestamp_us < window_end_us) {
+        // The window after the trigger holds about as many frames as the one
+        // before it, so scoring one backlog frame per push catches up by the
+        // time the window closes.
+        score(recent_.back());
+        const auto backlog = std::find_if(recent_.begin(), recent_.end(),
+                                          [](const Candidate &candidate) { return !candidate.scored; });
+        if (backlog != recent_.end()) {
+            score(*backlog);
+        }
+        return std::nullopt;
+    }
+    trigger_us_.reset();
+
+    const Candidate *best = nullptr;
+    for (Candidate &candidate : recent_) {
+        if (candidate.frame.timestamp_us > window_end_us) {
+            continue;
+        }
+        if (!candidate.scored) {
+            score(candidate);
+        }
+        if (candidate.sharpness.has_value() && (best == nullptr || *candidate.sharpness > *best->sharpness)) {
+            best = &candidate;
+        }
+    }
+    if (best == nullptr) {
+        return std::nullopt;
+    }
+    CapturedFrame chosen = best->frame;
+    chosen.sharpness = best->sharpness;
+    return chosen;
+}
+
+} // namespace supercamera
@@ -0,0 +1,173 @@
+#include "supercamera_stream_integrity.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define SUPERCAMERA_CRC32C_X86 1
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#if defined(__linux__) && defined(__GNUC__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define SUPERCAMERA_CRC32C_ARM 1
+#endif
+#endif
+
+namespace supercamera {
+namespace {
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78; // reflected 0x1EDC6F41
+
+constexpr std::array<uint32_t, 256> make_crc32c_table() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 256> CRC32C_TABLE = make_crc32c_table();
+
+// The kernels work on the raw register value; crc32c() applies the initial
+// and final inversion.
+uint32_t crc32c_table(const uint8_t *data, size_t size, uint32_t crc) {
+    for (size_t i = 0; i < size; ++i) {
+        crc = CRC32C_TABLE[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(SUPERCAMERA_CRC32C_X86)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(const uint8_t *data, size_t size, uint32_t crc) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word = 0;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; ++data, --size) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+#if defined(SUPERCAMERA_CRC32C_ARM)
+__attribute__((target("+crc"))) uint32_t crc32c_armv8(const uint8_t *data, size_t size, uint32_t crc) {
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word = 0;
+        std::memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; ++data, --size) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+using Crc32cKernel = uint32_t (*)(const uint8_t *, size_t, uint32_t);
+
+Crc32cKernel select_crc32c_kernel() {
+#if defined(SUPERCAMERA_CRC32C_X86)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42;
+    }
+#elif defined(SUPERCAMERA_CRC32C_ARM)
+    if ((getauxval(AT_HWCAP) & HWCAP_CRC32) != 0) {
+        return crc32c_armv8;
+    }
+#endif
+    return crc32c_table;
+}
+
+const Crc32cKernel CRC32C_KERNEL = select_crc32c_kernel();
+
+size_t find_magic_scalar(const uint8_t *data, size_t begin, size_t size, const uint8_t *magic) {
+    for (size_t i = begin; i + 4 <= size; ++i) {
+        if (data[i] == magic[0] && std::memcmp(data + i, magic, 4) == 0) {
+            return i;
+        }
+    }
+    return size;
+}
+
+} // namespace
+
+uint32_t crc32c(std::span<const uint8_t> data, uint32_t crc) {
+    return ~CRC32C_KERNEL(data.data(), data.size(), ~crc);
+}
+
+bool crc32c_hardware_accelerated() {
+    return CRC32C_KERNEL != crc32c_table;
+}
+
+size_t find_magic(std::span<const uint8_t> data, uint32_t magic) {
+    const uint8_t bytes[4] = {
+        static_cast<uint8_t>(magic >> 24),
+        static_cast<uint8_t>(magic >> 16),
+        static_cast<uint8_t>(magic >> 8),
+        static_cast<uint8_t>(magic),
+    };
+    const uint8_t *p = data.data();
+    const size_t size = data.size();
+    size_t i = 0;
+
+    // Each block compares positions i..i+15 against the first magic byte and
+    // i+1..i+16 against the second; only positions matching both are checked
+    // in full. Entropy-coded JPEG data rarely survives the two-byte filter.
+    // The loads read up to p[i + 16], so blocks stop 17 bytes before the end
+    // and the scalar tail covers the rest.
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(static_cast<char>(bytes[0]));
+    const __m128i second = _mm_set1_epi8(static_cast<char>(bytes[1]));
+    for (; i + 17 <= size; i += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 1));
+        const __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second));
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(eq));
+        while (mask != 0) {
+            const size_t at = i + static_cast<size_t>(__builtin_ctz(mask));
+            if (at + 4 <= size && std::memcmp(p + at, bytes, 4) == 0) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t first = vdupq_n_u8(bytes[0]);
+    const uint8x16_t second = vdupq_n_u8(bytes[1]);
+    for (; i + 17 <= size; i += 16) {
+        const uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(p + i), first), vceqq_u8(vld1q_u8(p + i + 1), second));
+        // Narrowing shift: one nibble per position.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask != 0) {
+            const size_t at = i + static_cast<size_t>(__builtin_ctzll(mask)) / 4;
+            if (at + 4 <= size && std::memcmp(p + at, bytes, 4) == 0) {
+                return at;
+            }
+            mask &= ~(0xFULL << ((at - i) * 4));
+        }
+    }
+#endif
+    return find_magic_scalar(p, i, size, bytes);
+}
+
+} // namespace supercamera
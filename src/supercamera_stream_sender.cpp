@@ -2,15 +2,19 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cerrno>
+#include <climits>
 #include <chrono>
 #include <condition_variable>
 #include <csignal>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <deque>
 #include <iostream>
@@ -18,20 +22,67 @@
 #include <mutex>
 #include <optional>
 #include <span>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <vector>
 
+#include "supercamera_allocation_stats.hpp"
 #include "supercamera_core.hpp"
+#include "supercamera_decoder.hpp"
+#include "supercamera_duplicate_filter.hpp"
+#include "supercamera_h264.hpp"
+#include "supercamera_motion.hpp"
+#include "supercamera_pipeline.hpp"
+#include "supercamera_realtime.hpp"
+#include "supercamera_replay.hpp"
+#include "supercamera_snapshot.hpp"
+#include "supercamera_stream_integrity.hpp"
+#include "supercamera_transcoder.hpp"
+#include "supercamera_upp_parser.hpp"
+#include "supercamera_worker_pool.hpp"
 
 namespace {
 
 constexpr uint32_t STREAM_MAGIC = 0x47535643; // GSVC
 constexpr uint8_t STREAM_VERSION = 1;
+// Protocol v2 (--protocol-version 2): the v1 header followed by a CRC-32C of
+// the first 28 header bytes and the payload.
+constexpr uint8_t STREAM_VERSION_CRC = 2;
 constexpr uint8_t STREAM_CODEC_JPEG = 1;
+constexpr uint8_t STREAM_CODEC_H264 = 2; // one Annex B access unit per message
 constexpr size_t STREAM_HEADER_SIZE = 28;
+constexpr size_t STREAM_HEADER_V2_SIZE = 32;
 constexpr uint32_t MAX_PAYLOAD_SIZE = 1024 * 1024;
+// Frames per source the Huffman stage may hold queued.
+constexpr uint32_t MAX_HUFFMAN_IN_FLIGHT = 2;
+// Frames per source the motion stage may hold queued.
+constexpr uint32_t MAX_MOTION_IN_FLIGHT = 2;
+// A --batch-us batch is written out early once it holds this much, or this
+// many frames.
+constexpr size_t MAX_BATCH_BYTES = 4 * MAX_PAYLOAD_SIZE;
+constexpr size_t MAX_BATCH_FRAMES = 16;
+// Messages a frame may need: metadata, header template and the frame itself.
+constexpr size_t MAX_MESSAGES_PER_FRAME = 3;
+
+// Header dedup mode (--dedup-headers). A template message carries a JPEG's
+// header segments (SOI through the SOS segment); a scan message carries the
+// rest (entropy-coded data through EOI) and names its template in the
+// template_id field. Templates are re-announced every
+// HeaderTemplates::REANNOUNCE_SCANS scans under a new id.
+constexpr uint16_t STREAM_FLAG_HEADER_TEMPLATE = 0x0001;
+constexpr uint16_t STREAM_FLAG_SCAN_ONLY = 0x0002;
+// Per-frame metadata (--sharpness): `key=value` text lines describing the
+// frame with the same source_id and frame_id, sent just before it.
+constexpr uint16_t STREAM_FLAG_METADATA = 0x0004;
+// Stereo bundle (--stereo): the payload holds one part per camera, each a
+// part header followed by that camera's complete JPEG.
+constexpr uint16_t STREAM_FLAG_BUNDLE = 0x0008;
+constexpr uint16_t STREAM_KNOWN_FLAGS =
+    STREAM_FLAG_HEADER_TEMPLATE | STREAM_FLAG_SCAN_ONLY | STREAM_FLAG_METADATA | STREAM_FLAG_BUNDLE;
+constexpr size_t STREAM_BUNDLE_PART_HEADER_SIZE = 20;
 
 std::atomic_bool g_stop = false;
 
@@ -42,6 +93,37 @@ struct SenderOptions {
     uint16_t camera_count = 1;
     uint32_t max_fps = 0;
     uint32_t log_every = 120;
+    std::optional<supercamera::CropRegion> crop;
+    supercamera::JpegTransform rotate = supercamera::JpegTransform::None;
+    bool auto_orient = false;
+    bool stitch = false;
+    bool stereo = false;
+    bool split_lenses = false;
+    std::optional<uint8_t> lens;
+    uint32_t pair_max_skew_ms = 50;
+    int quant_scale_percent = 100;
+    bool adaptive_quant = false;
+    bool optimize_huffman = false;
+    uint32_t huffman_threads = 0;
+    int restart_rows = 0;
+    bool dedup_headers = false;
+    bool suppress_duplicates = false;
+    supercamera::DuplicateFilterOptions duplicate_filter;
+    bool motion = false;
+    bool motion_gate = false;
+    supercamera::MotionOptions motion_options;
+    bool sharpness = false;
+    uint32_t batch_us = 0;
+    uint32_t frame_budget = 0; // --preallocate; 0 allocates on demand
+    // Camera n's capture thread runs on capture_cpus[n % size].
+    std::vector<int> capture_cpus;
+    int capture_priority = 0;
+    std::optional<int> sender_cpu;
+    bool lock_memory = false;
+    bool sched_latency = false;
+    uint8_t protocol_version = STREAM_VERSION;
+    uint8_t codec = STREAM_CODEC_JPEG;
+    supercamera::H264Options h264;
     bool transport_set = false;
 };
 
@@ -61,23 +143,25 @@ uint64_t be64_to_host(uint64_t value) {
 #endif
 }
 
-std::array<uint8_t, STREAM_HEADER_SIZE> serialize_header(const supercamera::CapturedFrame &frame) {
+std::array<uint8_t, STREAM_HEADER_SIZE> serialize_header(const supercamera::CapturedFrame &frame, size_t payload_size,
+                                                         uint16_t flags, uint16_t template_id,
+                                                         uint8_t codec = STREAM_CODEC_JPEG) {
     std::array<uint8_t, STREAM_HEADER_SIZE> out{};
 
     const uint32_t magic_be = htonl(STREAM_MAGIC);
-    const uint16_t flags_be = htons(0);
+    const uint16_t flags_be = htons(flags);
     const uint16_t source_id_be = htons(frame.source_id);
-    const uint16_t reserved_be = htons(0);
+    const uint16_t template_id_be = htons(template_id);
     const uint32_t frame_id_be = htonl(frame.frame_id);
     const uint64_t timestamp_be = host_to_be64(frame.timestamp_us);
-    const uint32_t payload_size_be = htonl(static_cast<uint32_t>(frame.jpeg.size()));
+    const uint32_t payload_size_be = htonl(static_cast<uint32_t>(payload_size));
 
     std::memcpy(out.data() + 0, &magic_be, sizeof(magic_be));
     out[4] = STREAM_VERSION;
-    out[5] = STREAM_CODEC_JPEG;
+    out[5] = codec;
     std::memcpy(out.data() + 6, &flags_be, sizeof(flags_be));
     std::memcpy(out.data() + 8, &source_id_be, sizeof(source_id_be));
-    std::memcpy(out.data() + 10, &reserved_be, sizeof(reserved_be));
+    std::memcpy(out.data() + 10, &template_id_be, sizeof(template_id_be));
     std::memcpy(out.data() + 12, &frame_id_be, sizeof(frame_id_be));
     std::memcpy(out.data() + 16, &timestamp_be, sizeof(timestamp_be));
     std::memcpy(out.data() + 24, &payload_size_be, sizeof(payload_size_be));
@@ -85,13 +169,39 @@ std::array<uint8_t, STREAM_HEADER_SIZE> serialize_header(const supercamera::Capt
     return out;
 }
 
+std::array<uint8_t, STREAM_HEADER_SIZE> serialize_header(const supercamera::CapturedFrame &frame) {
+    return serialize_header(frame, frame.jpeg.size(), 0, 0);
+}
+
+uint32_t message_crc(std::span<const uint8_t> header, std::span<const uint8_t> payload) {
+    return supercamera::crc32c(payload, supercamera::crc32c(header.first(STREAM_HEADER_SIZE)));
+}
+
+// Turns a v1 header for `payload` into a v2 header.
+std::array<uint8_t, STREAM_HEADER_V2_SIZE> seal_header(const std::array<uint8_t, STREAM_HEADER_SIZE> &header,
+                                                       std::span<const uint8_t> payload) {
+    std::array<uint8_t, STREAM_HEADER_V2_SIZE> out{};
+    std::memcpy(out.data(), header.data(), header.size());
+    out[4] = STREAM_VERSION_CRC;
+    const uint32_t crc_be = htonl(message_crc(out, payload));
+    std::memcpy(out.data() + STREAM_HEADER_SIZE, &crc_be, sizeof(crc_be));
+    return out;
+}
+
+// For a v2 message whose first 28 bytes passed decode_and_validate_header.
+bool verify_message_crc(std::span<const uint8_t, STREAM_HEADER_V2_SIZE> header, std::span<const uint8_t> payload) {
+    uint32_t crc_be = 0;
+    std::memcpy(&crc_be, header.data() + STREAM_HEADER_SIZE, sizeof(crc_be));
+    return ntohl(crc_be) == message_crc(header, payload);
+}
+
 struct DecodedHeader {
     uint32_t magic;
     uint8_t version;
     uint8_t codec;
     uint16_t flags;
     uint16_t source_id;
-    uint16_t reserved;
+    uint16_t template_id;
     uint32_t frame_id;
     uint64_t timestamp_us;
     uint32_t payload_size;
@@ -101,7 +211,7 @@ bool decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE> dat
     uint32_t magic_be = 0;
     uint16_t flags_be = 0;
     uint16_t source_id_be = 0;
-    uint16_t reserved_be = 0;
+    uint16_t template_id_be = 0;
     uint32_t frame_id_be = 0;
     uint64_t timestamp_be = 0;
     uint32_t payload_size_be = 0;
@@ -109,7 +219,7 @@ bool decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE> dat
     std::memcpy(&magic_be, data.data() + 0, sizeof(magic_be));
     std::memcpy(&flags_be, data.data() + 6, sizeof(flags_be));
     std::memcpy(&source_id_be, data.data() + 8, sizeof(source_id_be));
-    std::memcpy(&reserved_be, data.data() + 10, sizeof(reserved_be));
+    std::memcpy(&template_id_be, data.data() + 10, sizeof(template_id_be));
     std::memcpy(&frame_id_be, data.data() + 12, sizeof(frame_id_be));
     std::memcpy(&timestamp_be, data.data() + 16, sizeof(timestamp_be));
     std::memcpy(&payload_size_be, data.data() + 24, sizeof(payload_size_be));
@@ -120,7 +230,7 @@ bool decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE> dat
         .codec = data[5],
         .flags = ntohs(flags_be),
         .source_id = ntohs(source_id_be),
-        .reserved = ntohs(reserved_be),
+        .template_id = ntohs(template_id_be),
         .frame_id = ntohl(frame_id_be),
         .timestamp_us = be64_to_host(timestamp_be),
         .payload_size = ntohl(payload_size_be),
@@ -129,24 +239,145 @@ bool decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE> dat
     if (parsed.magic != STREAM_MAGIC) {
         return false;
     }
-    if (parsed.version != STREAM_VERSION) {
+    if (parsed.version != STREAM_VERSION && parsed.version != STREAM_VERSION_CRC) {
         return false;
     }
-    if (parsed.codec != STREAM_CODEC_JPEG) {
+    if (parsed.codec != STREAM_CODEC_JPEG && parsed.codec != STREAM_CODEC_H264) {
         return false;
     }
     if (parsed.payload_size > MAX_PAYLOAD_SIZE) {
         return false;
     }
+    // At most one flag may be set.
+    if ((parsed.flags & ~STREAM_KNOWN_FLAGS) != 0 || (parsed.flags & (parsed.flags - 1)) != 0) {
+        return false;
+    }
+    const bool uses_template = (parsed.flags & (STREAM_FLAG_HEADER_TEMPLATE | STREAM_FLAG_SCAN_ONLY)) != 0;
+    if (uses_template != (parsed.template_id != 0)) {
+        return false;
+    }
 
     *out = parsed;
     return true;
 }
 
+std::string format_frame_metadata(const supercamera::CapturedFrame &frame) {
+    std::string out;
+    if (frame.sharpness.has_value()) {
+        char line[64];
+        std::snprintf(line, sizeof(line), "sharpness=%.2f\n", *frame.sharpness);
+        out += line;
+    }
+    return out;
+}
+
+// Appends one part of a stereo bundle: source_id, a reserved zero, frame_id,
+// timestamp_us and the JPEG size, big-endian, then the JPEG.
+void append_bundle_part(const supercamera::CapturedFrame &frame, supercamera::ByteVector *out) {
+    std::array<uint8_t, STREAM_BUNDLE_PART_HEADER_SIZE> part{};
+    const uint16_t source_id_be = htons(frame.source_id);
+    const uint32_t frame_id_be = htonl(frame.frame_id);
+    const uint64_t timestamp_be = host_to_be64(frame.timestamp_us);
+    const uint32_t size_be = htonl(static_cast<uint32_t>(frame.jpeg.size()));
+    std::memcpy(part.data() + 0, &source_id_be, sizeof(source_id_be));
+    std::memcpy(part.data() + 4, &frame_id_be, sizeof(frame_id_be));
+    std::memcpy(part.data() + 8, &timestamp_be, sizeof(timestamp_be));
+    std::memcpy(part.data() + 16, &size_be, sizeof(size_be));
+    out->insert(out->end(), part.begin(), part.end());
+    out->insert(out->end(), frame.jpeg.begin(), frame.jpeg.end());
+}
+
+// Returns the offset of the entropy-coded data, just past the SOS segment, or
+// 0 if the markers before it cannot be walked.
+size_t jpeg_scan_offset(std::span<const uint8_t> jpeg) {
+    if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        return 0;
+    }
+    size_t pos = 2;
+    while (pos + 4 <= jpeg.size()) {
+        if (jpeg[pos] != 0xFF) {
+            return 0;
+        }
+        const uint8_t marker = jpeg[pos + 1];
+        if (marker == 0xFF) {
+            ++pos; // fill byte
+            continue;
+        }
+        const size_t length = (static_cast<size_t>(jpeg[pos + 2]) << 8) | jpeg[pos + 3];
+        if (length < 2 || pos + 2 + length > jpeg.size()) {
+            return 0;
+        }
+        pos += 2 + length;
+        if (marker == 0xDA) {
+            return pos;
+        }
+    }
+    return 0;
+}
+
+// Header templates announced to the current client, one per source. Ids are
+// unique within a connection; 0 means "none".
+class HeaderTemplates {
+public:
+    // A template is announced again after this many scans, so a receiver that
+    // dropped the announcement (bad CRC on a v2 connection) recovers.
+    static constexpr uint32_t REANNOUNCE_SCANS = 256;
+
+    // Returns the id of the template announced for this source if it matches
+    // `header`, 0 otherwise or when it is due to be announced again.
+    uint16_t find(uint16_t source_id, std::span<const uint8_t> header) {
+        if (source_id >= entries_.size()) {
+            return 0;
+        }
+        Entry &entry = entries_[source_id];
+        if (entry.id == 0 || !std::equal(header.begin(), header.end(), entry.header.begin(), entry.header.end())
+            || entry.scans >= REANNOUNCE_SCANS) {
+            return 0;
+        }
+        ++entry.scans;
+        return entry.id;
+    }
+
+    uint16_t add(uint16_t source_id, std::span<const uint8_t> header) {
+        if (source_id >= entries_.size()) {
+            entries_.resize(static_cast<size_t>(source_id) + 1);
+        }
+        Entry &entry = entries_[source_id];
+        entry.header.assign(header.begin(), header.end());
+        entry.id = next_id_;
+        entry.scans = 0;
+        next_id_ = next_id_ == 0xFFFF ? 1 : static_cast<uint16_t>(next_id_ + 1);
+        return entry.id;
+    }
+
+private:
+    struct Entry {
+        supercamera::ByteVector header;
+        uint16_t id = 0;
+        uint32_t scans = 0;
+    };
+
+    std::vector<Entry> entries_;
+    uint16_t next_id_ = 1;
+};
+
+// Keeps the latest frame of each source for the send loop. No memory is
+// allocated per frame once the slots have seen the largest frame: frames are
+// copied into a slot's existing buffer, and handed out by swapping with the
+// caller's frame, so buffers circulate instead of being freed.
 class MultiCameraFrameBuffer {
 public:
     explicit MultiCameraFrameBuffer(uint16_t camera_count)
-        : slots_(camera_count) {}
+        : slots_(camera_count),
+          pending_ids_(camera_count) {}
+
+    // Sizes every slot for frames of up to `bytes`.
+    void reserve(size_t bytes) {
+        std::lock_guard lock(mtx_);
+        for (Slot &slot : slots_) {
+            slot.frame.jpeg.reserve(bytes);
+        }
+    }
 
     void push(const supercamera::CapturedFrame &frame) {
         std::lock_guard lock(mtx_);
@@ -155,35 +386,51 @@ public:
         }
 
         Slot &slot = slots_[frame.source_id];
+        // A frame that went through the Huffman stage may arrive after a
+        // newer one that bypassed it, and must not replace it.
+        if (slot.latest_frame_id.has_value() && frame.frame_id < *slot.latest_frame_id) {
+            ++slot.dropped_count;
+            ++dropped_total_;
+            return;
+        }
         if (slot.pending) {
             ++slot.dropped_count;
             ++dropped_total_;
         } else {
+            // Each source is pending at most once, so the ring never fills.
             slot.pending = true;
-            pending_ids_.push_back(frame.source_id);
+            pending_ids_[(pending_head_ + pending_count_) % pending_ids_.size()] = frame.source_id;
+            ++pending_count_;
         }
-        slot.latest = frame;
+        // Copy assignment reuses the slot's buffer when it is large enough.
+        slot.frame = frame;
+        slot.latest_frame_id = frame.frame_id;
         cv_.notify_one();
     }
 
     bool wait_next(supercamera::CapturedFrame *out_frame) {
         std::unique_lock lock(mtx_);
-        cv_.wait(lock, [&] { return stopped_ || !pending_ids_.empty(); });
-        if (stopped_) {
-            return false;
-        }
-
-        const uint16_t source_id = pending_ids_.front();
-        pending_ids_.pop_front();
+        cv_.wait(lock, [&] { return stopped_ || pending_count_ > 0; });
+        return take_next(out_frame);
+    }
 
-        Slot &slot = slots_[source_id];
-        slot.pending = false;
-        if (!slot.latest.has_value()) {
+    // Like wait_next, but also returns false once `deadline` passes.
+    bool wait_next_until(supercamera::CapturedFrame *out_frame, std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock lock(mtx_);
+        if (!cv_.wait_until(lock, deadline, [&] { return stopped_ || pending_count_ > 0; })) {
             return false;
         }
+        return take_next(out_frame);
+    }
 
-        *out_frame = *slot.latest;
-        return true;
+    bool stopped() const {
+        std::lock_guard lock(mtx_);
+        return stopped_;
+    }
+
+    bool has_pending() const {
+        std::lock_guard lock(mtx_);
+        return pending_count_ > 0;
     }
 
     void stop() {
@@ -199,19 +446,180 @@ public:
 
 private:
     struct Slot {
-        std::optional<supercamera::CapturedFrame> latest;
+        // Holds the latest frame while pending, and otherwise just a buffer
+        // swapped in by take_next().
+        supercamera::CapturedFrame frame = {};
+        std::optional<uint32_t> latest_frame_id;
         uint64_t dropped_count = 0;
         bool pending = false;
     };
 
+    // Called with mtx_ held.
+    bool take_next(supercamera::CapturedFrame *out_frame) {
+        if (stopped_) {
+            return false;
+        }
+
+        const uint16_t source_id = pending_ids_[pending_head_];
+        pending_head_ = (pending_head_ + 1) % pending_ids_.size();
+        --pending_count_;
+
+        Slot &slot = slots_[source_id];
+        slot.pending = false;
+        std::swap(*out_frame, slot.frame);
+        return true;
+    }
+
     mutable std::mutex mtx_;
     std::condition_variable cv_;
     std::vector<Slot> slots_;
-    std::deque<uint16_t> pending_ids_;
+    // Ring of the sources with a pending frame, oldest first.
+    std::vector<uint16_t> pending_ids_;
+    size_t pending_head_ = 0;
+    size_t pending_count_ = 0;
     uint64_t dropped_total_ = 0;
     bool stopped_ = false;
 };
 
+struct PairingStats {
+    uint64_t pairs = 0;
+    // Frames of each camera that were replaced or discarded without a partner.
+    std::array<uint64_t, 2> unpaired = {};
+    uint64_t skew_total_us = 0;
+    uint64_t skew_max_us = 0;
+
+    uint64_t mean_skew_us() const {
+        return pairs > 0 ? skew_total_us / pairs : 0;
+    }
+};
+
+// Pairs each frame with the latest unpaired frame of the other camera when
+// their capture times are at most max_skew_us apart. A frame without a partner
+// waits until the other camera delivers, or is replaced by its own camera's
+// next frame. Pairing is greedy, so no frame is held back waiting for a
+// closer match; when one camera runs faster, its extra frames are counted as
+// unpaired and each pair is built from the slower camera's frames.
+class FramePairer {
+public:
+    explicit FramePairer(uint64_t max_skew_us)
+        : max_skew_us_(max_skew_us) {}
+
+    bool push(supercamera::CapturedFrame &&frame, supercamera::CapturedFrame *left, supercamera::CapturedFrame *right) {
+        if (frame.source_id > 1) {
+            return false;
+        }
+
+        const size_t own = frame.source_id;
+        std::optional<supercamera::CapturedFrame> &other = pending_[1 - own];
+        if (other.has_value()) {
+            const uint64_t skew = frame.timestamp_us > other->timestamp_us ? frame.timestamp_us - other->timestamp_us
+                                                                           : other->timestamp_us - frame.timestamp_us;
+            if (skew <= max_skew_us_) {
+                supercamera::CapturedFrame *own_slot = own == 0 ? left : right;
+                supercamera::CapturedFrame *other_slot = own == 0 ? right : left;
+                *own_slot = std::move(frame);
+                *other_slot = std::move(*other);
+                other.reset();
+                discard(own);
+                ++stats_.pairs;
+                stats_.skew_total_us += skew;
+                stats_.skew_max_us = std::max(stats_.skew_max_us, skew);
+                return true;
+            }
+            // Later frames of this camera are further away still, so an
+            // older partner can never pair; drop it instead of letting it
+            // linger. A frame older than its partner (finished late by a
+            // worker) cannot pair either.
+            if (other->timestamp_us < frame.timestamp_us) {
+                discard(1 - own);
+            } else {
+                ++stats_.unpaired[own];
+                return false;
+            }
+        }
+
+        discard(own);
+        pending_[own] = std::move(frame);
+        return false;
+    }
+
+    const PairingStats &stats() const {
+        return stats_;
+    }
+
+private:
+    void discard(size_t index) {
+        if (pending_[index].has_value()) {
+            ++stats_.unpaired[index];
+            pending_[index].reset();
+        }
+    }
+
+    uint64_t max_skew_us_;
+    std::array<std::optional<supercamera::CapturedFrame>, 2> pending_;
+    PairingStats stats_;
+};
+
+// Chooses a client's quantization scale from how long each frame takes to hand
+// to the socket. Once the kernel send buffer is full, send() blocks for as long
+// as the link needs, so a send time approaching the frame budget means the
+// link cannot keep up. Quality drops quickly and recovers slowly.
+class QuantScaleController {
+public:
+    explicit QuantScaleController(uint64_t frame_budget_us)
+        : frame_budget_us_(frame_budget_us) {}
+
+    int scale_percent() const {
+        return scale_percent_;
+    }
+
+    void record_send(uint64_t send_us) {
+        constexpr uint32_t adjust_every = 15;
+        average_send_us_ = (average_send_us_ * 7 + send_us) / 8;
+        if (++frames_since_adjust_ < adjust_every) {
+            return;
+        }
+
+        if (average_send_us_ * 4 > frame_budget_us_ * 3) {
+            scale_percent_ = std::min(scale_percent_ + std::max(scale_percent_ / 4, 25),
+                                      supercamera::MAX_QUANT_SCALE_PERCENT);
+        } else if (average_send_us_ * 10 < frame_budget_us_ * 3) {
+            scale_percent_ = std::max(scale_percent_ - 25, supercamera::MIN_QUANT_SCALE_PERCENT);
+        } else {
+            return;
+        }
+        frames_since_adjust_ = 0;
+    }
+
+private:
+    uint64_t frame_budget_us_;
+    uint64_t average_send_us_ = 0;
+    uint32_t frames_since_adjust_ = 0;
+    int scale_percent_ = supercamera::MIN_QUANT_SCALE_PERCENT;
+};
+
+struct HuffmanStats {
+    std::atomic_uint64_t input_bytes = 0;
+    std::atomic_uint64_t output_bytes = 0;
+};
+
+std::optional<double> score_sharpness(
+    supercamera::JpegTranscoder &transcoder, const supercamera::CapturedFrame &frame) {
+    double score = 0.0;
+    if (!transcoder.sharpness(frame.jpeg, &score)) {
+        return std::nullopt;
+    }
+    return score;
+}
+
+void log_motion_event(const supercamera::MotionEvent &event) {
+    std::cout << "motion " << (event.kind == supercamera::MotionEvent::Kind::Started ? "started" : "ended")
+              << " source=" << event.source_id << " frame_id=" << event.frame_id
+              << " timestamp_us=" << event.timestamp_us << " region=" << event.region.width << "x"
+              << event.region.height << "+" << event.region.x << "+" << event.region.y
+              << " changed=" << event.changed_fraction * 100.0 << "%\n";
+}
+
 void print_help(const char *argv0) {
     std::cout << "Usage: " << argv0 << " --transport <tcp|udp> [options]\n"
               << "\n"
@@ -222,6 +630,77 @@ void print_help(const char *argv0) {
               << "  --camera-count <n>     Number of USB cameras to stream (default: 1).\n"
               << "  --max-fps <n>          Max send frame rate, 0 for unlimited (default: 0).\n"
               << "  --log-every <n>        Print stats every N sent frames (default: 120).\n"
+              << "  --crop <WxH[+X+Y]>     Send only this region of each frame, widened to whole\n"
+              << "                         JPEG MCUs; without +X+Y the region is centered.\n"
+              << "  --rotate <mode>        Lossless transform applied to every sent frame: none, flip-h,\n"
+              << "                         flip-v, rotate-90, rotate-180, rotate-270, transpose or\n"
+              << "                         transverse (default: none).\n"
+              << "  --auto-orient          Rotate sent frames by quarter turns so the G-sensor's\n"
+              << "                         gravity direction points down in the image.\n"
+              << "  --stitch               Send cameras 0 and 1 side by side as one JPEG on source 2,\n"
+              << "                         joined losslessly. Requires --camera-count 2.\n"
+              << "  --split-lenses         Send each lens of a dual-lens endoscope as its own source:\n"
+              << "                         camera n's lenses become sources 2n and 2n+1.\n"
+              << "  --lens <0|1|any>       Only capture frames from this lens; frames from the other\n"
+              << "                         lens are dropped on arrival (default: any).\n"
+              << "  --stereo               Send each pair of camera 0 and 1 frames as one bundle\n"
+              << "                         message on source 2 (see STREAM_PROTOCOL.md). Requires\n"
+              << "                         --camera-count 2.\n"
+              << "  --pair-max-skew <ms>   Largest capture time difference of a stitched or stereo\n"
+              << "                         pair (default: 50). --stitch-max-skew is an alias.\n"
+              << "  --quant-scale <p|auto> Requantize frames with every quantization step scaled to\n"
+              << "                         p percent (100-1000), or adapt it to the client's link\n"
+              << "                         (default: 100, unchanged).\n"
+              << "  --optimize-huffman     Losslessly re-encode every frame with Huffman tables built\n"
+              << "                         for that frame, on worker threads.\n"
+              << "  --huffman-threads <n>  Worker threads for --optimize-huffman, 0 for one per CPU\n"
+              << "                         (default: 0).\n"
+              << "  --restart-rows <n>     Losslessly re-encode frames with a restart marker every n\n"
+              << "                         MCU rows, so receivers can decode strips in parallel\n"
+              << "                         (default: 0, none).\n"
+              << "  --dedup-headers        Announce each source's JPEG header once and send only scan\n"
+              << "                         data afterwards (see STREAM_PROTOCOL.md).\n"
+              << "  --suppress-duplicates  Skip frames identical to the last one sent for their source.\n"
+              << "  --dc-threshold <x>     Also skip frames whose 1/8-scale luma differs from the last\n"
+              << "                         sent one by at most x levels on average. Implies\n"
+              << "                         --suppress-duplicates (default: 0, exact matches only).\n"
+              << "  --keepalive-ms <n>     Send a suppressed frame anyway after n ms without one\n"
+              << "                         (default: 1000).\n"
+              << "  --motion               Detect motion from each camera's DC coefficients and log\n"
+              << "                         motion start/end events with the changed region. All\n"
+              << "                         cameras share one worker thread, off the capture threads.\n"
+              << "  --motion-gate          Only send a camera's frames while it shows motion. Implies\n"
+              << "                         --motion.\n"
+              << "  --motion-threshold <n> Luma change per 8x8 block that counts as motion (default: 12).\n"
+              << "  --motion-hold-ms <n>   Keep motion active this long after the last moving frame\n"
+              << "                         (default: 2000).\n"
+              << "  --codec <jpeg|h264>    Payload codec (default: jpeg). h264 decodes each frame and\n"
+              << "                         re-encodes it with x264 for low latency: no B-frames,\n"
+              << "                         intra refresh instead of keyframes.\n"
+              << "  --h264-bitrate <kbps>  H.264 target bitrate (default: 1000).\n"
+              << "  --h264-refresh <n>     Frames per H.264 intra refresh cycle (default: 60).\n"
+              << "  --h264-threads <n>     H.264 encoder threads, 0 for one per CPU (default: 0).\n"
+              << "  --sharpness            Send each frame's focus score (AC coefficient energy) as a\n"
+              << "                         metadata message before it (see STREAM_PROTOCOL.md).\n"
+              << "  --batch-us <n>         While more frames are pending, hold sent frames up to n\n"
+              << "                         microseconds and write them with one syscall (default: 0,\n"
+              << "                         one write per frame).\n"
+              << "  --preallocate <bytes>  Allocate frame and queue memory for JPEGs of up to this size\n"
+              << "                         at startup, so the capture-to-socket path allocates nothing\n"
+              << "                         per frame (default: 0, allocate as frames arrive).\n"
+              << "  --capture-cpus <list>  Pin camera n's capture thread to the n-th CPU of this\n"
+              << "                         comma-separated list, wrapping around (default: unpinned).\n"
+              << "  --capture-priority <n> Run capture threads as SCHED_FIFO with this priority, 1-99\n"
+              << "                         (default: 0, normal scheduling). Needs CAP_SYS_NICE.\n"
+              << "  --sender-cpu <n>       Pin the send loop to this CPU (default: unpinned).\n"
+              << "  --mlock                Lock all memory in RAM once every thread has started,\n"
+              << "                         including the --preallocate frame buffers, so it never\n"
+              << "                         pages. Needs CAP_IPC_LOCK or an unlimited memlock limit.\n"
+              << "  --sched-latency        Measure the wakeup latency a thread set up like each capture\n"
+              << "                         thread and the send loop sees, and add it to the stats.\n"
+              << "  --protocol-version <n> 1, or 2 to add a CRC-32C of header and payload to every\n"
+              << "                         message so receivers can drop corrupt frames and resync\n"
+              << "                         (default: 1).\n"
               << "  --help                 Show this help.\n";
 }
 
@@ -296,6 +775,169 @@ int parse_args(int argc, char **argv, SenderOptions *opts) {
                     throw std::runtime_error("invalid --log-every value");
                 }
                 opts->log_every = log_every;
+            } else if (arg == "--crop") {
+                supercamera::CropRegion crop;
+                if (!supercamera::CropRegion::parse(need_value("--crop"), &crop)) {
+                    throw std::runtime_error("invalid --crop value");
+                }
+                opts->crop = crop;
+            } else if (arg == "--rotate") {
+                if (!supercamera::parse_jpeg_transform(need_value("--rotate"), &opts->rotate)) {
+                    throw std::runtime_error("invalid --rotate value");
+                }
+            } else if (arg == "--auto-orient") {
+                opts->auto_orient = true;
+            } else if (arg == "--quant-scale") {
+                const std::string value = need_value("--quant-scale");
+                uint32_t percent = 0;
+                if (value == "auto") {
+                    opts->adaptive_quant = true;
+                } else if (parse_u32(value, &percent)
+                           && percent >= static_cast<uint32_t>(supercamera::MIN_QUANT_SCALE_PERCENT)
+                           && percent <= static_cast<uint32_t>(supercamera::MAX_QUANT_SCALE_PERCENT)) {
+                    opts->adaptive_quant = false;
+                    opts->quant_scale_percent = static_cast<int>(percent);
+                } else {
+                    throw std::runtime_error("invalid --quant-scale value");
+                }
+            } else if (arg == "--optimize-huffman") {
+                opts->optimize_huffman = true;
+            } else if (arg == "--huffman-threads") {
+                if (!parse_u32(need_value("--huffman-threads"), &opts->huffman_threads)) {
+                    throw std::runtime_error("invalid --huffman-threads value");
+                }
+            } else if (arg == "--restart-rows") {
+                uint32_t rows = 0;
+                if (!parse_u32(need_value("--restart-rows"), &rows) || rows > supercamera::MAX_RESTART_ROWS) {
+                    throw std::runtime_error("invalid --restart-rows value");
+                }
+                opts->restart_rows = static_cast<int>(rows);
+            } else if (arg == "--dedup-headers") {
+                opts->dedup_headers = true;
+            } else if (arg == "--suppress-duplicates") {
+                opts->suppress_duplicates = true;
+            } else if (arg == "--dc-threshold") {
+                double threshold = -1.0;
+                try {
+                    threshold = std::stod(need_value("--dc-threshold"));
+                } catch (const std::logic_error &) {
+                }
+                if (!(threshold >= 0.0 && threshold <= 255.0)) {
+                    throw std::runtime_error("invalid --dc-threshold value");
+                }
+                opts->suppress_duplicates = true;
+                opts->duplicate_filter.dc_threshold = threshold;
+            } else if (arg == "--keepalive-ms") {
+                if (!parse_u32(need_value("--keepalive-ms"), &opts->duplicate_filter.keepalive_ms)) {
+                    throw std::runtime_error("invalid --keepalive-ms value");
+                }
+            } else if (arg == "--motion") {
+                opts->motion = true;
+            } else if (arg == "--motion-gate") {
+                opts->motion = true;
+                opts->motion_gate = true;
+            } else if (arg == "--motion-threshold") {
+                uint32_t threshold = 0;
+                if (!parse_u32(need_value("--motion-threshold"), &threshold) || threshold == 0 || threshold > 255) {
+                    throw std::runtime_error("invalid --motion-threshold value");
+                }
+                opts->motion_options.block_threshold = static_cast<int>(threshold);
+            } else if (arg == "--motion-hold-ms") {
+                if (!parse_u32(need_value("--motion-hold-ms"), &opts->motion_options.hold_ms)) {
+                    throw std::runtime_error("invalid --motion-hold-ms value");
+                }
+            } else if (arg == "--codec") {
+                const std::string codec = need_value("--codec");
+                if (codec == "jpeg") {
+                    opts->codec = STREAM_CODEC_JPEG;
+                } else if (codec == "h264") {
+                    opts->codec = STREAM_CODEC_H264;
+                } else {
+                    throw std::runtime_error("invalid --codec value");
+                }
+            } else if (arg == "--h264-bitrate") {
+                if (!parse_u32(need_value("--h264-bitrate"), &opts->h264.bitrate_kbps)
+                    || opts->h264.bitrate_kbps == 0) {
+                    throw std::runtime_error("invalid --h264-bitrate value");
+                }
+            } else if (arg == "--h264-refresh") {
+                if (!parse_u32(need_value("--h264-refresh"), &opts->h264.refresh_frames)
+                    || opts->h264.refresh_frames == 0) {
+                    throw std::runtime_error("invalid --h264-refresh value");
+                }
+            } else if (arg == "--h264-threads") {
+                if (!parse_u32(need_value("--h264-threads"), &opts->h264.threads)) {
+                    throw std::runtime_error("invalid --h264-threads value");
+                }
+            } else if (arg == "--sharpness") {
+                opts->sharpness = true;
+            } else if (arg == "--stitch") {
+                opts->stitch = true;
+            } else if (arg == "--split-lenses") {
+                opts->split_lenses = true;
+            } else if (arg == "--lens") {
+                const std::string value = need_value("--lens");
+                if (value == "0" || value == "1") {
+                    opts->lens = static_cast<uint8_t>(value[0] - '0');
+                } else if (value != "any") {
+                    throw std::runtime_error("invalid --lens value");
+                }
+            } else if (arg == "--stereo") {
+                opts->stereo = true;
+            } else if (arg == "--batch-us") {
+                if (!parse_u32(need_value("--batch-us"), &opts->batch_us)) {
+                    throw std::runtime_error("invalid --batch-us value");
+                }
+            } else if (arg == "--preallocate") {
+                if (!parse_u32(need_value("--preallocate"), &opts->frame_budget)
+                    || opts->frame_budget > MAX_PAYLOAD_SIZE) {
+                    throw std::runtime_error("invalid --preallocate value");
+                }
+            } else if (arg == "--capture-cpus") {
+                opts->capture_cpus.clear();
+                std::istringstream list(need_value("--capture-cpus"));
+                std::string item;
+                while (std::getline(list, item, ',')) {
+                    uint32_t cpu = 0;
+                    if (!parse_u32(item, &cpu) || cpu > INT_MAX) {
+                        throw std::runtime_error("invalid --capture-cpus value");
+                    }
+                    opts->capture_cpus.push_back(static_cast<int>(cpu));
+                }
+                if (opts->capture_cpus.empty()) {
+                    throw std::runtime_error("invalid --capture-cpus value");
+                }
+            } else if (arg == "--capture-priority") {
+                uint32_t priority = 0;
+                if (!parse_u32(need_value("--capture-priority"), &priority) || priority > 99) {
+                    throw std::runtime_error("invalid --capture-priority value");
+                }
+                opts->capture_priority = static_cast<int>(priority);
+            } else if (arg == "--sender-cpu") {
+                uint32_t cpu = 0;
+                if (!parse_u32(need_value("--sender-cpu"), &cpu) || cpu > INT_MAX) {
+                    throw std::runtime_error("invalid --sender-cpu value");
+                }
+                opts->sender_cpu = static_cast<int>(cpu);
+            } else if (arg == "--mlock") {
+                opts->lock_memory = true;
+            } else if (arg == "--sched-latency") {
+                opts->sched_latency = true;
+            } else if (arg == "--protocol-version") {
+                const std::string value = need_value("--protocol-version");
+                if (value == "1") {
+                    opts->protocol_version = STREAM_VERSION;
+                } else if (value == "2") {
+                    opts->protocol_version = STREAM_VERSION_CRC;
+                } else {
+                    throw std::runtime_error("invalid --protocol-version value");
+                }
+            } else if (arg == "--pair-max-skew" || arg == "--stitch-max-skew") {
+                uint32_t max_skew_ms = 0;
+                if (!parse_u32(need_value(arg.c_str()), &max_skew_ms)) {
+                    throw std::runtime_error("invalid " + arg + " value");
+                }
+                opts->pair_max_skew_ms = max_skew_ms;
             } else {
                 throw std::runtime_error("unknown option: " + arg);
             }
@@ -312,6 +954,49 @@ int parse_args(int argc, char **argv, SenderOptions *opts) {
         return -1;
     }
 
+    if (opts->auto_orient && opts->rotate != supercamera::JpegTransform::None) {
+        std::cerr << "--rotate and --auto-orient are mutually exclusive\n";
+        return -1;
+    }
+    if (opts->stitch && opts->camera_count != 2) {
+        std::cerr << "--stitch requires --camera-count 2\n";
+        return -1;
+    }
+    if (opts->stitch && opts->auto_orient) {
+        std::cerr << "--stitch and --auto-orient are mutually exclusive\n";
+        return -1;
+    }
+    if (opts->split_lenses && (opts->stitch || opts->stereo)) {
+        std::cerr << "--split-lenses cannot be combined with --stitch or --stereo\n";
+        return -1;
+    }
+    if (opts->stereo) {
+        if (opts->camera_count != 2) {
+            std::cerr << "--stereo requires --camera-count 2\n";
+            return -1;
+        }
+        if (opts->stitch) {
+            std::cerr << "--stereo and --stitch are mutually exclusive\n";
+            return -1;
+        }
+        // Bundles carry complete JPEGs.
+        if (opts->dedup_headers || opts->codec != STREAM_CODEC_JPEG) {
+            std::cerr << "--stereo only supports --codec jpeg without --dedup-headers\n";
+            return -1;
+        }
+    }
+    if (opts->codec == STREAM_CODEC_H264) {
+        if (!supercamera::H264Encoder::available()) {
+            std::cerr << "--codec h264 is not available: built without x264\n";
+            return -1;
+        }
+        if (opts->dedup_headers) {
+            std::cerr << "--dedup-headers only applies to --codec jpeg\n";
+            return -1;
+        }
+        opts->h264.fps = opts->max_fps > 0 ? opts->max_fps : 30;
+    }
+
     if (opts->transport == "udp") {
         std::cerr << "UDP transport is not implemented yet. Use --transport tcp.\n";
         return -1;
@@ -324,19 +1009,164 @@ int parse_args(int argc, char **argv, SenderOptions *opts) {
     return 1;
 }
 
-bool send_all(int fd, const uint8_t *data, size_t len) {
-    size_t sent = 0;
-    while (sent < len) {
-        const ssize_t n = send(fd, data + sent, len - sent, 0);
-        if (n <= 0) {
-            if (n < 0 && errno == EINTR) {
-                continue;
+// Queues stream messages and writes everything queued with writev, so a
+// frame's header and payload (plus any metadata or template message) cost one
+// syscall, and a batch of frames costs one in total. Payloads are not copied:
+// they must stay alive until flush(). With protocol v2, headers are sealed
+// with the message CRC as they are queued.
+class MessageWriter {
+public:
+    explicit MessageWriter(int fd, uint8_t version = STREAM_VERSION)
+        : fd_(fd),
+          header_size_(version == STREAM_VERSION_CRC ? STREAM_HEADER_V2_SIZE : STREAM_HEADER_SIZE) {}
+
+    void add(const std::array<uint8_t, STREAM_HEADER_SIZE> &header, std::span<const uint8_t> payload) {
+        if (header_size_ == STREAM_HEADER_V2_SIZE) {
+            headers_.push_back(seal_header(header, payload));
+        } else {
+            std::memcpy(headers_.emplace_back().data(), header.data(), header.size());
+        }
+        payloads_.push_back(payload);
+        queued_bytes_ += header_size_ + payload.size();
+    }
+
+    // For small payloads built on the spot, like metadata text: the writer
+    // keeps them until flush().
+    void add(const std::array<uint8_t, STREAM_HEADER_SIZE> &header, std::string payload) {
+        const std::string &owned = owned_.emplace_back(std::move(payload));
+        add(header, std::span(reinterpret_cast<const uint8_t *>(owned.data()), owned.size()));
+    }
+
+    size_t queued_bytes() const {
+        return queued_bytes_;
+    }
+
+    // Makes room for `messages` queued messages, so queueing them does not
+    // allocate.
+    void reserve(size_t messages) {
+        headers_.reserve(messages);
+        payloads_.reserve(messages);
+        iov_.reserve(2 * messages);
+    }
+
+    bool flush() {
+        // iovecs are built here because headers_ may have moved while growing.
+        iov_.clear();
+        for (size_t i = 0; i < headers_.size(); ++i) {
+            iov_.push_back({headers_[i].data(), header_size_});
+            if (!payloads_[i].empty()) {
+                iov_.push_back({const_cast<uint8_t *>(payloads_[i].data()), payloads_[i].size()});
+            }
+        }
+        headers_.clear();
+        payloads_.clear();
+        queued_bytes_ = 0;
+
+        size_t next = 0;
+        while (next < iov_.size()) {
+            const int count = static_cast<int>(std::min<size_t>(iov_.size() - next, IOV_MAX));
+            const ssize_t n = writev(fd_, iov_.data() + next, count);
+            ++syscalls_;
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            bytes_ += static_cast<uint64_t>(n);
+            // Skip what was written; a partially written entry is resumed.
+            size_t written = static_cast<size_t>(n);
+            while (written > 0 && written >= iov_[next].iov_len) {
+                written -= iov_[next].iov_len;
+                ++next;
+            }
+            if (written > 0) {
+                iov_[next].iov_base = static_cast<uint8_t *>(iov_[next].iov_base) + written;
+                iov_[next].iov_len -= written;
             }
-            return false;
         }
-        sent += static_cast<size_t>(n);
+        owned_.clear();
+        return true;
     }
-    return true;
+
+    uint64_t syscalls() const {
+        return syscalls_;
+    }
+
+    uint64_t bytes() const {
+        return bytes_;
+    }
+
+private:
+    int fd_;
+    size_t header_size_;
+    std::vector<std::array<uint8_t, STREAM_HEADER_V2_SIZE>> headers_;
+    std::vector<std::span<const uint8_t>> payloads_;
+    // A deque, so growing it does not move the strings payloads_ points into.
+    std::deque<std::string> owned_;
+    std::vector<iovec> iov_;
+    size_t queued_bytes_ = 0;
+    uint64_t syscalls_ = 0;
+    uint64_t bytes_ = 0;
+};
+
+// The frames a MessageWriter's queued payloads point into, until it is
+// flushed. add() swaps a frame into a slot rather than moving it, so the
+// caller gets that slot's previous buffer back and clear() frees nothing:
+// buffers keep circulating between the frame buffer, the send loop and here.
+class FrameBatch {
+public:
+    // Sizes `frames` slots for JPEGs of up to `bytes`.
+    void reserve(size_t frames, size_t bytes) {
+        slots_.reserve(frames);
+        while (slots_.size() < frames) {
+            slots_.emplace_back().jpeg.reserve(bytes);
+        }
+    }
+
+    // A swap keeps the JPEG's heap buffer, so spans already queued from it
+    // stay valid.
+    void add(supercamera::CapturedFrame &frame) {
+        if (size_ == slots_.size()) {
+            slots_.emplace_back();
+        }
+        std::swap(slots_[size_++], frame);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    void clear() {
+        size_ = 0;
+    }
+
+private:
+    std::vector<supercamera::CapturedFrame> slots_;
+    size_t size_ = 0;
+};
+
+supercamera::ThreadOptions capture_thread_options(const SenderOptions &opts, uint16_t camera) {
+    supercamera::ThreadOptions options;
+    if (!opts.capture_cpus.empty()) {
+        options.cpu = opts.capture_cpus[camera % opts.capture_cpus.size()];
+    }
+    options.fifo_priority = opts.capture_priority;
+    return options;
+}
+
+// With --mlock a thread's stack counts against the memlock limit, the usual
+// reason std::thread fails on a host where threads otherwise start fine.
+void report_thread_start_error(const char *what, const std::system_error &e, const SenderOptions &opts) {
+    std::cerr << "cannot start " << what << ": " << e.what();
+    if (opts.lock_memory) {
+        std::cerr << " (--mlock " << supercamera::MEMLOCK_HINT << ")";
+    }
+    std::cerr << "\n";
 }
 
 void signal_handler(int) {
@@ -425,6 +1255,44 @@ bool run_self_tests() {
             return false;
         }
 
+        header = serialize_header(frame, frame.jpeg.size(), STREAM_FLAG_SCAN_ONLY, 0);
+        if (decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(header), &decoded)) {
+            std::cerr << "self-test failed: scan message without template accepted\n";
+            return false;
+        }
+
+        header = serialize_header(frame, frame.jpeg.size(), STREAM_FLAG_METADATA | STREAM_FLAG_SCAN_ONLY, 1);
+        if (decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(header), &decoded)) {
+            std::cerr << "self-test failed: combined flags accepted\n";
+            return false;
+        }
+
+        header = serialize_header(frame, frame.jpeg.size(), 0, 0, STREAM_CODEC_H264);
+        if (!decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(header), &decoded)
+            || decoded.codec != STREAM_CODEC_H264) {
+            std::cerr << "self-test failed: H.264 codec rejected\n";
+            return false;
+        }
+
+        header = serialize_header(frame, frame.jpeg.size(), 0, 0, 3);
+        if (decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(header), &decoded)) {
+            std::cerr << "self-test failed: unknown codec accepted\n";
+            return false;
+        }
+
+        header = serialize_header(frame, frame.jpeg.size(), STREAM_FLAG_METADATA, 1);
+        if (decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(header), &decoded)) {
+            std::cerr << "self-test failed: metadata message with template accepted\n";
+            return false;
+        }
+
+        header = serialize_header(frame, frame.jpeg.size(), STREAM_FLAG_BUNDLE, 0);
+        if (!decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(header), &decoded)
+            || decoded.flags != STREAM_FLAG_BUNDLE) {
+            std::cerr << "self-test failed: bundle header rejected\n";
+            return false;
+        }
+
         header = serialize_header(frame);
         const uint32_t oversized = htonl(MAX_PAYLOAD_SIZE + 1);
         std::memcpy(header.data() + 24, &oversized, sizeof(oversized));
@@ -434,6 +1302,64 @@ bool run_self_tests() {
         }
     }
 
+    {
+        supercamera::CapturedFrame frame = {
+            .jpeg = {1, 2, 3, 4, 5},
+            .source_id = 1,
+            .frame_id = 7,
+            .timestamp_us = 8,
+        };
+        const auto header = serialize_header(frame, 3, STREAM_FLAG_SCAN_ONLY, 42);
+        DecodedHeader decoded{};
+        if (!decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(header), &decoded)
+            || decoded.flags != STREAM_FLAG_SCAN_ONLY || decoded.template_id != 42 || decoded.payload_size != 3) {
+            std::cerr << "self-test failed: scan message header round-trip\n";
+            return false;
+        }
+
+        // SOI, APP0 (length 4), SOS (length 3), one scan byte, EOI.
+        const std::array<uint8_t, 16> jpeg = {
+            0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x04, 0xAA, 0xBB, 0xFF, 0xDA, 0x00, 0x03, 0x01, 0x55, 0xFF, 0xD9,
+        };
+        if (jpeg_scan_offset(jpeg) != 13 || jpeg_scan_offset(std::span(jpeg).first(10)) != 0) {
+            std::cerr << "self-test failed: JPEG scan offset\n";
+            return false;
+        }
+
+        frame.sharpness = 12.345;
+        const std::string metadata = format_frame_metadata(frame);
+        const auto metadata_header = serialize_header(frame, metadata.size(), STREAM_FLAG_METADATA, 0);
+        if (metadata != "sharpness=12.35\n"
+            || !decode_and_validate_header(std::span<const uint8_t, STREAM_HEADER_SIZE>(metadata_header), &decoded)
+            || decoded.flags != STREAM_FLAG_METADATA || decoded.frame_id != frame.frame_id) {
+            std::cerr << "self-test failed: frame metadata\n";
+            return false;
+        }
+
+        HeaderTemplates templates;
+        const auto jpeg_header = std::span(jpeg).first(13);
+        const uint16_t id = templates.add(1, jpeg_header);
+        if (id == 0 || templates.find(1, jpeg_header) != id || templates.find(0, jpeg_header) != 0
+            || templates.find(1, std::span(jpeg).first(12)) != 0) {
+            std::cerr << "self-test failed: header templates\n";
+            return false;
+        }
+
+        // The first find() above was scan 1.
+        for (uint32_t scan = 1; scan < HeaderTemplates::REANNOUNCE_SCANS; ++scan) {
+            templates.find(1, jpeg_header);
+        }
+        if (templates.find(1, jpeg_header) != 0) {
+            std::cerr << "self-test failed: header template re-announcement\n";
+            return false;
+        }
+        const uint16_t reannounced_id = templates.add(1, jpeg_header);
+        if (reannounced_id == id || templates.find(1, jpeg_header) != reannounced_id) {
+            std::cerr << "self-test failed: header template re-announcement\n";
+            return false;
+        }
+    }
+
     {
         MultiCameraFrameBuffer buffer(2);
         const supercamera::CapturedFrame a1 = {
@@ -474,9 +1400,468 @@ bool run_self_tests() {
             return false;
         }
 
+        buffer.push(a1);
+        if (buffer.dropped_count() != 2) {
+            std::cerr << "self-test failed: stale frame accepted\n";
+            return false;
+        }
+
         buffer.stop();
     }
 
+    {
+        int fds[2] = {-1, -1};
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            std::cerr << "self-test failed: socketpair\n";
+            return false;
+        }
+        const supercamera::CapturedFrame frame = {
+            .jpeg = {0xFF, 0xD8, 0xFF, 0xD9},
+            .source_id = 1,
+            .frame_id = 7,
+            .timestamp_us = 42,
+        };
+        MessageWriter writer(fds[0]);
+        writer.add(serialize_header(frame), frame.jpeg);
+        writer.add(serialize_header(frame, 3, STREAM_FLAG_METADATA, 0), std::string("a=1"));
+        writer.add(serialize_header(frame), frame.jpeg);
+        const size_t expected = 3 * STREAM_HEADER_SIZE + 2 * frame.jpeg.size() + 3;
+        const bool flushed = writer.queued_bytes() == expected && writer.flush() && writer.queued_bytes() == 0;
+
+        std::vector<uint8_t> received(expected + 1);
+        size_t received_size = 0;
+        while (flushed && received_size < expected) {
+            const ssize_t n = read(fds[1], received.data() + received_size, received.size() - received_size);
+            if (n <= 0) {
+                break;
+            }
+            received_size += static_cast<size_t>(n);
+        }
+        close(fds[0]);
+        close(fds[1]);
+
+        const uint8_t *metadata = received.data() + 2 * STREAM_HEADER_SIZE + frame.jpeg.size();
+        if (!flushed || received_size != expected || writer.syscalls() != 1 || writer.bytes() != expected
+            || !std::equal(frame.jpeg.begin(), frame.jpeg.end(), received.begin() + STREAM_HEADER_SIZE)
+            || std::memcmp(metadata, "a=1", 3) != 0) {
+            std::cerr << "self-test failed: batched message write\n";
+            return false;
+        }
+    }
+
+    {
+        // Frames flagged has_g are dropped unless G-sensor data was asked
+        // for, as the parser always did; with it, the word is decoded.
+        auto parse_g_frame = [](bool accept_g_sensor, std::optional<supercamera::CapturedFrame> *parsed) {
+            supercamera::LensState lens;
+            supercamera::UppParser parser(
+                [parsed](const supercamera::CapturedFrame &frame) { *parsed = frame; }, supercamera::IgnoreButton{},
+                0, false, accept_g_sensor, lens);
+            const std::array<uint8_t, 14> packet = {
+                0xAA, 0xBB, 7, 9, 0, 1, 0, 0x01, 0x40, 0xFF, 0x00, 0x01, 0xFF, 0xD8,
+            };
+            parser.handle_upp_frame(packet);
+            parser.flush_pending();
+        };
+        std::optional<supercamera::CapturedFrame> rejected;
+        std::optional<supercamera::CapturedFrame> accepted;
+        parse_g_frame(false, &rejected);
+        parse_g_frame(true, &accepted);
+        if (rejected.has_value() || !accepted.has_value() || !accepted->g_sensor.has_value()
+            || accepted->g_sensor->x != -192 || accepted->g_sensor->y != 256) {
+            std::cerr << "self-test failed: G-sensor frame filtering\n";
+            return false;
+        }
+    }
+
+    {
+        // A replayed stream, cut into UPP packets, through the --preallocate
+        // path: parser, latest-frame buffer, batch and socket writes. Once a
+        // pass over the replayed frames has warmed everything up, frames must
+        // not allocate.
+        constexpr size_t budget = 16 * 1024;
+        constexpr uint32_t warmup_frames = 8;
+        constexpr uint32_t measured_frames = 32;
+        int fds[2] = {-1, -1};
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            std::cerr << "self-test failed: socketpair\n";
+            return false;
+        }
+
+        MultiCameraFrameBuffer buffer(1);
+        buffer.reserve(budget);
+        supercamera::CapturedFrame frame{};
+        frame.jpeg.reserve(budget);
+        FrameBatch batch;
+        batch.reserve(1, budget);
+        MessageWriter writer(fds[0], STREAM_VERSION_CRC);
+        writer.reserve(MAX_MESSAGES_PER_FRAME);
+        supercamera::LensState lens;
+        supercamera::UppParser parser(
+            [&buffer](const supercamera::CapturedFrame &parsed) { buffer.push(parsed); }, supercamera::IgnoreButton{},
+            0, false, false, lens);
+        parser.reserve(budget);
+        supercamera::ByteVector packet;
+        packet.reserve(0x400);
+
+        std::array<uint8_t, 4096> received{};
+        uint64_t received_bytes = 0;
+        bool ok = true;
+        auto send_pending = [&] {
+            while (buffer.has_pending() && buffer.wait_next(&frame)) {
+                writer.add(serialize_header(frame), frame.jpeg);
+                batch.add(frame);
+                ok = writer.flush() && ok;
+                batch.clear();
+                while (received_bytes < writer.bytes()) {
+                    const ssize_t n = read(fds[1], received.data(), received.size());
+                    if (n <= 0) {
+                        ok = false;
+                        return;
+                    }
+                    received_bytes += static_cast<uint64_t>(n);
+                }
+            }
+        };
+
+        supercamera::ReplayCapture replay(
+            0, {supercamera::ByteVector(3000, 0x11), supercamera::ByteVector(9000, 0x22),
+                supercamera::ByteVector(5000, 0x33)},
+            0);
+        uint32_t replayed = 0;
+        supercamera::AllocationCounters warm{};
+        uint64_t allocations = 0;
+        replay.run([&](const supercamera::CapturedFrame &replayed_frame) {
+            const std::span<const uint8_t> jpeg(replayed_frame.jpeg);
+            constexpr size_t chunk_size = 0x400 - 12;
+            for (size_t offset = 0; offset < jpeg.size(); offset += chunk_size) {
+                const std::span<const uint8_t> chunk = jpeg.subspan(offset, std::min(chunk_size, jpeg.size() - offset));
+                const auto length = static_cast<uint16_t>(7 + chunk.size());
+                const std::array<uint8_t, 12> headers = {
+                    0xAA, 0xBB, 7, static_cast<uint8_t>(length), static_cast<uint8_t>(length >> 8),
+                    static_cast<uint8_t>(replayed_frame.frame_id), 0, 0, 0, 0, 0, 0,
+                };
+                packet.assign(headers.begin(), headers.end());
+                packet.insert(packet.end(), chunk.begin(), chunk.end());
+                parser.handle_upp_frame(packet);
+            }
+            send_pending();
+
+            ++replayed;
+            if (replayed == warmup_frames) {
+                warm = supercamera::thread_allocations();
+            } else if (replayed == warmup_frames + measured_frames) {
+                allocations = supercamera::thread_allocations().allocations - warm.allocations;
+                replay.request_stop();
+            }
+        });
+        close(fds[0]);
+        close(fds[1]);
+
+        if (!ok || allocations != 0 || received_bytes != writer.bytes()
+            || writer.bytes() < measured_frames * (STREAM_HEADER_V2_SIZE + 3000)) {
+            std::cerr << "self-test failed: zero-allocation replay (" << allocations << " allocations in "
+                      << measured_frames << " frames)\n";
+            return false;
+        }
+    }
+
+    {
+        // Later items finish first in the parallel stage; the sink must still
+        // see each source in push order, without the filtered item.
+        supercamera::WorkerPool pool(3);
+        std::vector<std::vector<uint32_t>> delivered(2);
+        supercamera::Pipeline pipeline(pool, 2);
+        auto &work = pipeline.add_stage<uint32_t>(
+            "work",
+            [](uint32_t &&value) -> std::optional<uint32_t> {
+                std::this_thread::sleep_for(std::chrono::microseconds(200 * (8 - value % 8)));
+                if (value == 5) {
+                    return std::nullopt;
+                }
+                return value;
+            },
+            {.queue_capacity = 16, .concurrency = 3});
+        auto &sink = pipeline.add_stage<uint32_t, void>(
+            "sink", [&](uint32_t &&value) { delivered[value % 2].push_back(value); }, {.queue_capacity = 16});
+        work.then(sink);
+        for (uint32_t value = 0; value < 12; ++value) {
+            work.push(static_cast<uint16_t>(value % 2), value);
+        }
+        pipeline.wait_idle();
+        const auto metrics = pipeline.metrics();
+        if (delivered[0] != std::vector<uint32_t>{0, 2, 4, 6, 8, 10}
+            || delivered[1] != std::vector<uint32_t>{1, 3, 7, 9, 11} || metrics[0].processed != 12
+            || metrics[0].filtered != 1 || metrics[1].processed != 11 || work.push(2, 0)) {
+            std::cerr << "self-test failed: pipeline ordering\n";
+            return false;
+        }
+    }
+
+    {
+        const std::array<uint8_t, 9> check = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+        if (supercamera::crc32c(check) != 0xE3069283
+            || supercamera::crc32c(std::span(check).subspan(4), supercamera::crc32c(std::span(check).first(4)))
+                != 0xE3069283) {
+            std::cerr << "self-test failed: crc32c\n";
+            return false;
+        }
+
+        // Three v2 messages, the second corrupted: a receiver that resyncs on
+        // the magic loses only that one.
+        supercamera::ByteVector stream = {0x47, 0x53, 0x00};
+        for (uint32_t frame_id = 1; frame_id <= 3; ++frame_id) {
+            const supercamera::CapturedFrame frame = {
+                .jpeg = supercamera::ByteVector(40, static_cast<uint8_t>(frame_id)),
+                .source_id = 0,
+                .frame_id = frame_id,
+                .timestamp_us = frame_id,
+            };
+            const auto header = seal_header(serialize_header(frame), frame.jpeg);
+            stream.insert(stream.end(), header.begin(), header.end());
+            stream.insert(stream.end(), frame.jpeg.begin(), frame.jpeg.end());
+        }
+        stream[3 + 2 * STREAM_HEADER_V2_SIZE + 40 + 5] ^= 0x10;
+
+        std::vector<uint32_t> received;
+        size_t pos = 0;
+        while (pos + STREAM_HEADER_V2_SIZE <= stream.size()) {
+            const std::span<const uint8_t, STREAM_HEADER_V2_SIZE> header(stream.data() + pos, STREAM_HEADER_V2_SIZE);
+            DecodedHeader decoded{};
+            if (decode_and_validate_header(header.first<STREAM_HEADER_SIZE>(), &decoded)
+                && decoded.version == STREAM_VERSION_CRC
+                && pos + STREAM_HEADER_V2_SIZE + decoded.payload_size <= stream.size()) {
+                const std::span<const uint8_t> payload(stream.data() + pos + STREAM_HEADER_V2_SIZE,
+                                                       decoded.payload_size);
+                if (verify_message_crc(header, payload)) {
+                    received.push_back(decoded.frame_id);
+                    pos += STREAM_HEADER_V2_SIZE + payload.size();
+                    continue;
+                }
+            }
+            pos += 1 + supercamera::find_magic(std::span(stream).subspan(pos + 1), STREAM_MAGIC);
+        }
+        if (received != std::vector<uint32_t>{1, 3}) {
+            std::cerr << "self-test failed: v2 resync\n";
+            return false;
+        }
+    }
+
+    {
+        using supercamera::JpegTransform;
+        supercamera::OrientationTracker tracker;
+        const struct {
+            supercamera::GSensorSample sample;
+            JpegTransform expected;
+        } steps[] = {
+            {{.x = 0, .y = 1000}, JpegTransform::None},
+            {{.x = 900, .y = 1000}, JpegTransform::None}, // ~42 deg: still upright
+            {{.x = 1000, .y = 0}, JpegTransform::Rotate90},
+            {{.x = 1000, .y = 900}, JpegTransform::Rotate90}, // ~48 deg: inside hysteresis
+            {{.x = 0, .y = -1000}, JpegTransform::Rotate180},
+            {{.x = -1000, .y = 0}, JpegTransform::Rotate270},
+            {{.x = 0, .y = 10}, JpegTransform::Rotate270}, // too weak to judge
+        };
+        for (const auto &step : steps) {
+            if (tracker.update(step.sample) != step.expected) {
+                std::cerr << "self-test failed: orientation tracking\n";
+                return false;
+            }
+        }
+
+        supercamera::CropRegion crop;
+        if (!supercamera::CropRegion::parse("320x240+16+32", &crop) || crop.centered || crop.x != 16
+            || crop.y != 32 || crop.width != 320 || crop.height != 240) {
+            std::cerr << "self-test failed: crop parsing\n";
+            return false;
+        }
+        if (!supercamera::CropRegion::parse("200x100", &crop) || !crop.centered
+            || supercamera::CropRegion::parse("200x100+5", &crop)) {
+            std::cerr << "self-test failed: centered crop parsing\n";
+            return false;
+        }
+
+        FramePairer pairer(10000);
+        supercamera::CapturedFrame left{};
+        supercamera::CapturedFrame right{};
+        auto push = [&](uint16_t source_id, uint32_t frame_id, uint64_t timestamp_us) {
+            return pairer.push(
+                {.jpeg = {1}, .source_id = source_id, .frame_id = frame_id, .timestamp_us = timestamp_us}, &left,
+                &right);
+        };
+        const bool paired_alone = push(0, 1, 1000);
+        const bool paired_far = push(1, 1, 50000);
+        const bool paired_near = push(0, 2, 45000);
+        if (paired_alone || paired_far || !paired_near || left.frame_id != 2 || right.frame_id != 1) {
+            std::cerr << "self-test failed: stitch pairing\n";
+            return false;
+        }
+        // Camera 0's first frame was too old for any later partner, and a
+        // late frame older than the pending partner is dropped on arrival.
+        const bool paired_late = push(1, 2, 90000) || push(0, 3, 60000);
+        const bool paired_next = push(0, 4, 88000);
+        const PairingStats &pairing = pairer.stats();
+        if (paired_late || !paired_next || pairing.pairs != 2 || pairing.unpaired[0] != 2 || pairing.unpaired[1] != 0
+            || pairing.skew_max_us != 5000 || pairing.mean_skew_us() != 3500) {
+            std::cerr << "self-test failed: pairing stats\n";
+            return false;
+        }
+
+        supercamera::ByteVector bundle;
+        append_bundle_part({.jpeg = {0xFF, 0xD8}, .source_id = 1, .frame_id = 7, .timestamp_us = 0x0102}, &bundle);
+        const std::array<uint8_t, STREAM_BUNDLE_PART_HEADER_SIZE + 2> expected_part = {
+            0, 1, 0, 0, 0, 0, 0, 7, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0, 2, 0xFF, 0xD8,
+        };
+        if (!std::equal(bundle.begin(), bundle.end(), expected_part.begin(), expected_part.end())) {
+            std::cerr << "self-test failed: bundle part layout\n";
+            return false;
+        }
+
+        QuantScaleController controller(10000);
+        for (int i = 0; i < 60; ++i) {
+            controller.record_send(20000);
+        }
+        const int congested = controller.scale_percent();
+        for (int i = 0; i < 600; ++i) {
+            controller.record_send(100);
+        }
+        if (congested <= supercamera::MIN_QUANT_SCALE_PERCENT
+            || controller.scale_percent() != supercamera::MIN_QUANT_SCALE_PERCENT) {
+            std::cerr << "self-test failed: adaptive quantization\n";
+            return false;
+        }
+
+        supercamera::DuplicateFilter filter({.dc_threshold = 0.0, .keepalive_ms = 1000});
+        const supercamera::CapturedFrame still = {.jpeg = {1, 2, 3}, .source_id = 0, .frame_id = 1, .timestamp_us = 0};
+        supercamera::CapturedFrame repeat = still;
+        supercamera::CapturedFrame changed = still;
+        changed.jpeg[1] = 9;
+        changed.timestamp_us = repeat.timestamp_us = 500000;
+        supercamera::CapturedFrame keepalive = still;
+        keepalive.timestamp_us = 1000000;
+        if (!filter.accept(still) || filter.accept(repeat) || !filter.accept(changed) || filter.accept(changed)
+            || filter.suppressed_count() != 2) {
+            std::cerr << "self-test failed: duplicate suppression\n";
+            return false;
+        }
+        if (!filter.accept(keepalive)) {
+            std::cerr << "self-test failed: duplicate keepalive\n";
+            return false;
+        }
+
+        supercamera::MotionDetector detector({.block_threshold = 10, .hold_ms = 100, .warmup_frames = 2});
+        std::array<uint8_t, 80 * 60> dc;
+        dc.fill(100);
+        std::optional<supercamera::MotionEvent> event;
+        uint64_t now_us = 0;
+        for (int i = 0; i < 5 && !event; ++i, now_us += 33000) {
+            event = detector.update_dc(dc, 80, 60, 80, 0, static_cast<uint32_t>(i), now_us);
+        }
+        for (int y = 10; y < 20; ++y) {
+            std::fill_n(dc.begin() + y * 80 + 30, 5, 200);
+        }
+        const auto started = detector.update_dc(dc, 80, 60, 80, 0, 5, now_us);
+        if (event || !started || started->kind != supercamera::MotionEvent::Kind::Started
+            || started->region.x != 240 || started->region.y != 80 || started->region.width != 40
+            || started->region.height != 80) {
+            std::cerr << "self-test failed: motion start\n";
+            return false;
+        }
+        dc.fill(100);
+        std::optional<supercamera::MotionEvent> ended;
+        for (int i = 0; i < 10 && !ended; ++i) {
+            now_us += 33000;
+            ended = detector.update_dc(dc, 80, 60, 80, 0, static_cast<uint32_t>(6 + i), now_us);
+        }
+        if (!ended || ended->kind != supercamera::MotionEvent::Kind::Ended || detector.in_motion()) {
+            std::cerr << "self-test failed: motion end\n";
+            return false;
+        }
+
+        // 8x8 grayscale checkerboard of 2x2 squares, quality 90.
+        const supercamera::ByteVector checkerboard = {
+            0xFF, 0xD8, 0xFF, 0xDB, 0x00, 0x43, 0x00, 0x03, 0x02, 0x02, 0x03, 0x02, 0x02, 0x03, 0x03, 0x03,
+            0x03, 0x04, 0x03, 0x03, 0x04, 0x05, 0x08, 0x05, 0x05, 0x04, 0x04, 0x05, 0x0A, 0x07, 0x07, 0x06,
+            0x08, 0x0C, 0x0A, 0x0C, 0x0C, 0x0B, 0x0A, 0x0B, 0x0B, 0x0D, 0x0E, 0x12, 0x10, 0x0D, 0x0E, 0x11,
+            0x0E, 0x0B, 0x0B, 0x10, 0x16, 0x10, 0x11, 0x13, 0x14, 0x15, 0x15, 0x15, 0x0C, 0x0F, 0x17, 0x18,
+            0x16, 0x14, 0x18, 0x12, 0x14, 0x15, 0x14, 0xFF, 0xC0, 0x00, 0x0B, 0x08, 0x00, 0x08, 0x00, 0x08,
+            0x01, 0x01, 0x11, 0x00, 0xFF, 0xC4, 0x00, 0x14, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0xFF, 0xC4, 0x00, 0x1F, 0x10, 0x00,
+            0x00, 0x03, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x12,
+            0x14, 0x16, 0x00, 0x11, 0x15, 0x36, 0x41, 0x62, 0x66, 0x85, 0x91, 0xFF, 0xDA, 0x00, 0x08, 0x01,
+            0x01, 0x00, 0x00, 0x3F, 0x00, 0x3C, 0xAB, 0x82, 0xA5, 0x36, 0x28, 0x43, 0x5D, 0x89, 0x1E, 0x15,
+            0xC5, 0xC7, 0x47, 0x37, 0xFF, 0xD9,
+        };
+        supercamera::JpegTranscoder transcoder;
+        // Same headers with a scan of one flat block: a DC value and an
+        // immediate end-of-block, so no AC energy at all.
+        const auto checkerboard_header = std::span(checkerboard).first(jpeg_scan_offset(checkerboard));
+        supercamera::ByteVector blurred(checkerboard_header.begin(), checkerboard_header.end());
+        blurred.insert(blurred.end(), {0x43, 0x7F, 0xFF, 0xD9});
+        double sharp_score = 0.0;
+        double blurred_score = -1.0;
+        if (!transcoder.sharpness(checkerboard, &sharp_score)
+            || !transcoder.sharpness(blurred, &blurred_score) || blurred_score != 0.0 || !(sharp_score > 0.0)) {
+            std::cerr << "self-test failed: sharpness score\n";
+            return false;
+        }
+
+        supercamera::ByteVector with_restarts;
+        const std::array<uint8_t, 2> dri_marker = {0xFF, 0xDD};
+        if (!transcoder.transcode(checkerboard, {.restart_rows = 1}, &with_restarts)
+            || std::ranges::search(with_restarts, dri_marker).empty()
+            || transcoder.transcode(checkerboard, {.restart_rows = -1}, &with_restarts)) {
+            std::cerr << "self-test failed: restart marker insertion\n";
+            return false;
+        }
+
+        // Transcoder output must decode to the input's pixels, including a
+        // plain write right after an optimized one on the same instance: the
+        // optimized Huffman tables must not leak into it.
+        supercamera::JpegDecoder decoder;
+        auto same_pixels = [&](std::span<const uint8_t> a, std::span<const uint8_t> b) {
+            supercamera::BgrImage image_a;
+            supercamera::BgrImage image_b;
+            return decoder.decode_bgr(a, &image_a) && decoder.decode_bgr(b, &image_b)
+                && image_a.width == image_b.width && image_a.height == image_b.height
+                && image_a.pixels == image_b.pixels;
+        };
+        supercamera::ByteVector optimized;
+        if (!transcoder.transcode(blurred, {.optimize_huffman = true}, &optimized)
+            || !transcoder.transcode(checkerboard, {.restart_rows = 1}, &with_restarts)
+            || !same_pixels(optimized, blurred) || !same_pixels(with_restarts, checkerboard)) {
+            std::cerr << "self-test failed: transcoder output round-trip\n";
+            return false;
+        }
+
+        supercamera::SnapshotSelector selector({.window_ms = 50});
+        auto snapshot_frame = [&](uint32_t frame_id, uint64_t timestamp_us, bool sharp) {
+            return supercamera::CapturedFrame{
+                .jpeg = sharp ? checkerboard : blurred,
+                .source_id = 0,
+                .frame_id = frame_id,
+                .timestamp_us = timestamp_us,
+            };
+        };
+        selector.trigger(100000);
+        const bool early = selector.push(snapshot_frame(1, 40000, true)).has_value()
+            || selector.push(snapshot_frame(2, 60000, false)).has_value()
+            || selector.push(snapshot_frame(3, 100000, true)).has_value()
+            || selector.push(snapshot_frame(4, 140000, false)).has_value();
+        const auto snapshot = selector.push(snapshot_frame(5, 160000, true));
+        if (early || !snapshot || snapshot->frame_id != 3 || snapshot->sharpness != sharp_score || selector.pending()) {
+            std::cerr << "self-test failed: snapshot selection\n";
+            return false;
+        }
+
+        const std::array<uint8_t, 4> not_a_jpeg = {1, 2, 3, 4};
+        supercamera::ByteVector out;
+        if (transcoder.transform(not_a_jpeg, JpegTransform::Rotate90, &out) || transcoder.last_error().empty()) {
+            std::cerr << "self-test failed: transcoder accepted garbage\n";
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -509,15 +1894,119 @@ int main(int argc, char **argv) {
         active_camera_count = static_cast<uint16_t>(available_devices);
     }
 
-    MultiCameraFrameBuffer frame_buffer(active_camera_count);
+    if ((opts.stitch || opts.stereo) && active_camera_count != 2) {
+        std::cerr << (opts.stitch ? "--stitch" : "--stereo") << " needs two cameras\n";
+        return 1;
+    }
+
+    // With --split-lenses, camera n's lenses are sources 2n and 2n + 1.
+    const uint16_t lenses_per_camera = opts.split_lenses ? supercamera::MAX_LENSES : 1;
+    const uint16_t source_count = static_cast<uint16_t>(active_camera_count * lenses_per_camera);
+
+    MultiCameraFrameBuffer frame_buffer(source_count);
+    // The send loop's working frame and batch outlive clients, so their
+    // buffers are allocated once.
+    supercamera::CapturedFrame frame{};
+    FrameBatch batch;
+    if (opts.frame_budget > 0) {
+        frame_buffer.reserve(opts.frame_budget);
+        frame.jpeg.reserve(opts.frame_budget);
+        batch.reserve(MAX_BATCH_FRAMES, opts.frame_budget);
+    }
+    // Trackers are only touched by their source's capture thread; the send
+    // loop reads the resulting orientation.
+    std::vector<supercamera::OrientationTracker> trackers(source_count);
+    std::vector<std::atomic<supercamera::JpegTransform>> orientations(source_count);
+    // Detectors are only touched by the motion stage; the send loop reads
+    // the resulting state.
+    std::vector<supercamera::MotionDetector> motion_detectors(
+        source_count, supercamera::MotionDetector(opts.motion_options));
+    std::vector<std::atomic_bool> motion_active(source_count);
+    // Time the motion stage spends per frame, and in total for its load.
+    supercamera::LatencyHistogram motion_cost;
+    std::atomic_uint64_t motion_busy_ns = 0;
     std::atomic_uint64_t captured_frames = 0;
     std::atomic_uint64_t sent_frames = 0;
 
+    // Huffman optimization runs as a pipeline on its own pool: a stage
+    // running on every worker, with frames put back in capture order per
+    // source, then a stage that hands them to the send loop. Declared after
+    // everything its stages touch, so it drains first on exit.
+    std::vector<HuffmanStats> huffman_stats(source_count);
+    std::unique_ptr<supercamera::WorkerPool> huffman_pool;
+    std::unique_ptr<supercamera::Pipeline> huffman_pipeline;
+    supercamera::StageInput<supercamera::CapturedFrame> *huffman_input = nullptr;
+    if (opts.optimize_huffman) {
+        try {
+            huffman_pool = std::make_unique<supercamera::WorkerPool>(opts.huffman_threads);
+        } catch (const std::system_error &e) {
+            report_thread_start_error("Huffman workers", e, opts);
+            return 1;
+        }
+        huffman_pipeline = std::make_unique<supercamera::Pipeline>(*huffman_pool, source_count);
+        auto &optimize = huffman_pipeline->add_stage<supercamera::CapturedFrame>(
+            "huffman",
+            [&huffman_stats](supercamera::CapturedFrame &&frame) -> std::optional<supercamera::CapturedFrame> {
+                supercamera::JpegTranscoder &transcoder = supercamera::JpegTranscoder::for_current_thread();
+                supercamera::ByteVector optimized;
+                if (transcoder.transcode(frame.jpeg, {.optimize_huffman = true}, &optimized)) {
+                    HuffmanStats &stats = huffman_stats[frame.source_id];
+                    stats.input_bytes += frame.jpeg.size();
+                    stats.output_bytes += optimized.size();
+                    frame.jpeg.swap(optimized);
+                }
+                return std::move(frame);
+            },
+            {.queue_capacity = MAX_HUFFMAN_IN_FLIGHT * source_count, .concurrency = huffman_pool->thread_count()});
+        auto &deliver = huffman_pipeline->add_stage<supercamera::CapturedFrame, void>(
+            "deliver", [&frame_buffer](supercamera::CapturedFrame &&frame) { frame_buffer.push(frame); },
+            {.queue_capacity = MAX_HUFFMAN_IN_FLIGHT * source_count});
+        optimize.then(deliver);
+        huffman_input = &optimize;
+    }
+
+    // Motion detection runs off the capture threads, so a frame's entropy
+    // decode never delays the next USB read. Every source shares one worker
+    // thread, which the stats line's motion_load shows as a share of one
+    // core. A frame that finds the queue full is not examined.
+    std::unique_ptr<supercamera::WorkerPool> motion_pool;
+    std::unique_ptr<supercamera::Pipeline> motion_pipeline;
+    supercamera::StageInput<supercamera::CapturedFrame> *motion_input = nullptr;
+    if (opts.motion) {
+        try {
+            motion_pool = std::make_unique<supercamera::WorkerPool>(1);
+        } catch (const std::system_error &e) {
+            report_thread_start_error("motion worker", e, opts);
+            return 1;
+        }
+        motion_pipeline = std::make_unique<supercamera::Pipeline>(*motion_pool, source_count);
+        motion_input = &motion_pipeline->add_stage<supercamera::CapturedFrame, void>(
+            "motion",
+            [&](supercamera::CapturedFrame &&frame) {
+                const auto start = std::chrono::steady_clock::now();
+                supercamera::MotionDetector &detector = motion_detectors[frame.source_id];
+                if (const auto event = detector.update(frame)) {
+                    log_motion_event(*event);
+                }
+                motion_active[frame.source_id].store(detector.in_motion());
+                const auto cost_ns = static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                        .count());
+                motion_cost.record(cost_ns);
+                motion_busy_ns += cost_ns;
+            },
+            {.queue_capacity = MAX_MOTION_IN_FLIGHT * source_count});
+    }
+
     std::vector<std::unique_ptr<supercamera::SupercameraCapture>> captures;
     captures.reserve(active_camera_count);
     try {
-        for (uint16_t source_id = 0; source_id < active_camera_count; ++source_id) {
-            captures.emplace_back(std::make_unique<supercamera::SupercameraCapture>(source_id));
+        for (uint16_t camera = 0; camera < active_camera_count; ++camera) {
+            captures.emplace_back(std::make_unique<supercamera::SupercameraCapture>(
+                static_cast<uint16_t>(camera * lenses_per_camera), supercamera::ButtonCallback{}, opts.split_lenses));
+            captures.back()->select_lens(opts.lens);
+            captures.back()->set_frame_budget(opts.frame_budget);
+            captures.back()->set_accept_g_sensor(opts.auto_orient);
         }
     } catch (const std::exception &e) {
         std::cerr << "capture setup error: " << e.what() << "\n";
@@ -527,27 +2016,7 @@ int main(int argc, char **argv) {
     std::atomic_uint32_t active_capture_threads = active_camera_count;
     std::vector<std::thread> capture_threads;
     capture_threads.reserve(active_camera_count);
-
-    for (uint16_t source_id = 0; source_id < active_camera_count; ++source_id) {
-        capture_threads.emplace_back([&, source_id] {
-            try {
-                captures[source_id]->run([&](const supercamera::CapturedFrame &frame) {
-                    ++captured_frames;
-                    frame_buffer.push(frame);
-                });
-            } catch (const std::exception &e) {
-                std::cerr << "capture error (camera " << source_id << "): " << e.what() << "\n";
-            }
-
-            if (active_capture_threads.fetch_sub(1) == 1) {
-                frame_buffer.stop();
-                g_stop = true;
-            }
-        });
-    }
-
-    const int server_fd = make_server_socket(opts);
-    if (server_fd < 0) {
+    auto stop_capture = [&] {
         for (auto &capture : captures) {
             capture->request_stop();
         }
@@ -557,11 +2026,108 @@ int main(int argc, char **argv) {
                 thread.join();
             }
         }
+    };
+
+    bool sender_ready = true;
+    for (uint16_t camera = 0; camera < active_camera_count && sender_ready; ++camera) {
+        try {
+            capture_threads.emplace_back([&, camera] {
+                try {
+                    supercamera::apply_thread_options(capture_thread_options(opts, camera));
+                    // run_with inlines this sink into the capture loop.
+                    captures[camera]->run_with([&](const supercamera::CapturedFrame &frame) {
+                        const uint16_t source_id = frame.source_id;
+                        ++captured_frames;
+                        if (opts.auto_orient && frame.g_sensor.has_value()) {
+                            orientations[source_id].store(trackers[source_id].update(*frame.g_sensor));
+                        }
+                        if (motion_input != nullptr) {
+                            motion_input->push(source_id, frame);
+                        }
+
+                        // The capture thread never waits on Huffman optimization:
+                        // when its queue is full, frames pass through unoptimized.
+                        if (huffman_input != nullptr && huffman_input->push(source_id, frame)) {
+                            return;
+                        }
+                        frame_buffer.push(frame);
+                    });
+                } catch (const std::exception &e) {
+                    std::cerr << "capture error (camera " << camera << "): " << e.what() << "\n";
+                }
+
+                if (active_capture_threads.fetch_sub(1) == 1) {
+                    frame_buffer.stop();
+                    g_stop = true;
+                }
+            });
+        } catch (const std::system_error &e) {
+            report_thread_start_error("capture thread", e, opts);
+            sender_ready = false;
+        }
+    }
+
+    // Each probe mirrors one capture thread's setup, the last one the send
+    // loop's.
+    std::vector<std::unique_ptr<supercamera::SchedulingLatencyProbe>> latency_probes;
+    if (opts.sched_latency && sender_ready) {
+        try {
+            for (uint16_t camera = 0; camera < active_camera_count; ++camera) {
+                latency_probes.push_back(
+                    std::make_unique<supercamera::SchedulingLatencyProbe>(capture_thread_options(opts, camera)));
+            }
+            latency_probes.push_back(std::make_unique<supercamera::SchedulingLatencyProbe>(
+                supercamera::ThreadOptions{.cpu = opts.sender_cpu, .fifo_priority = 0}));
+        } catch (const std::system_error &e) {
+            report_thread_start_error("latency probe", e, opts);
+            sender_ready = false;
+        }
+    }
+
+    // Locked only once every thread and pool exists: their stacks are then
+    // part of MCL_CURRENT, and nothing needs a new mapping the memlock limit
+    // could refuse. The --preallocate buffers are already sized.
+    if (opts.lock_memory && sender_ready) {
+        try {
+            supercamera::lock_process_memory();
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << "\n";
+            sender_ready = false;
+        }
+    }
+
+    // Pinned only now, so the threads started above do not inherit the mask.
+    if (sender_ready) {
+        try {
+            supercamera::apply_thread_options({.cpu = opts.sender_cpu, .fifo_priority = 0});
+        } catch (const std::exception &e) {
+            std::cerr << "sender thread setup error: " << e.what() << "\n";
+            sender_ready = false;
+        }
+    }
+
+    const int server_fd = sender_ready ? make_server_socket(opts) : -1;
+    if (server_fd < 0) {
+        latency_probes.clear();
+        stop_capture();
         return 1;
     }
 
     std::cout << "stream sender listening on " << opts.bind_ip << ":" << opts.port
-              << " transport=tcp cameras=" << active_camera_count << "\n";
+              << " transport=tcp cameras=" << active_camera_count << " sources=" << source_count;
+    if (opts.protocol_version == STREAM_VERSION_CRC) {
+        std::cout << " protocol=v2 crc32c=" << (supercamera::crc32c_hardware_accelerated() ? "hardware" : "table");
+    }
+    if (opts.frame_budget > 0) {
+        // Two assembly buffers per capture, one per slot, the send loop's
+        // frame and the batch.
+        const uint64_t buffers = 2ULL * active_camera_count + source_count + 1 + MAX_BATCH_FRAMES;
+        std::cout << " preallocated=" << buffers * opts.frame_budget / 1024 << "KiB";
+    }
+    std::cout << "\n";
+
+    supercamera::JpegTranscoder transcoder;
+    supercamera::ByteVector transcoded;
 
     while (!g_stop) {
         sockaddr_in client_addr{};
@@ -587,10 +2153,269 @@ int main(int argc, char **argv) {
                 ? std::chrono::microseconds(1000000 / opts.max_fps)
                 : std::chrono::microseconds(0);
 
+        // Stitched pairs and stereo bundles go out as one extra virtual source
+        // after the cameras.
+        const bool paired = opts.stitch || opts.stereo;
+        FramePairer pairer(static_cast<uint64_t>(opts.pair_max_skew_ms) * 1000);
+        supercamera::CapturedFrame left{};
+        supercamera::CapturedFrame right{};
+        uint32_t paired_frame_id = 0;
+
+        // Each output source gets an equal share of the send loop's time.
+        const uint16_t output_sources = paired ? 1 : source_count;
+        const uint64_t frame_budget_us =
+            1000000ULL / ((opts.max_fps > 0 ? opts.max_fps : 30) * uint64_t{output_sources});
+        QuantScaleController quant_controller(frame_budget_us);
+        HeaderTemplates templates;
+        uint64_t dedup_saved_bytes = 0;
+        supercamera::DuplicateFilter duplicate_filter(opts.duplicate_filter);
+        uint64_t gated_frames = 0;
+        std::vector<std::unique_ptr<supercamera::H264Encoder>> h264_encoders(source_count + 1);
+
+        // Queued messages point into the frames in `batch`, which stay alive
+        // until the batch is written. With --batch-us 0 every batch is one
+        // frame.
+        MessageWriter writer(client_fd, opts.protocol_version);
+        writer.reserve(MAX_BATCH_FRAMES * MAX_MESSAGES_PER_FRAME);
+        batch.clear();
+        std::optional<std::chrono::steady_clock::time_point> batch_deadline;
+        const auto client_start = std::chrono::steady_clock::now();
+        uint64_t client_frames = 0;
+        // Heap allocations of every thread per sent frame, since the last
+        // stats line.
+        supercamera::AllocationCounters stats_allocations = supercamera::process_allocations();
+        uint64_t stats_frames = 0;
+        const uint64_t client_motion_busy_ns = motion_busy_ns.load();
+
+        auto log_stats = [&](uint64_t total_sent) {
+            std::cout << "stats: captured=" << captured_frames.load()
+                      << " sent=" << total_sent
+                      << " overwritten=" << frame_buffer.dropped_count();
+            const uint64_t elapsed_us = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - client_start)
+                    .count());
+            std::cout << " syscalls/frame=" << (writer.syscalls() * 100 / client_frames) / 100.0;
+            const supercamera::AllocationCounters allocations = supercamera::process_allocations();
+            if (client_frames > stats_frames) {
+                std::cout << " allocs/frame="
+                          << ((allocations.allocations - stats_allocations.allocations) * 100
+                              / (client_frames - stats_frames))
+                                 / 100.0;
+            }
+            stats_allocations = allocations;
+            stats_frames = client_frames;
+            if (elapsed_us > 0) {
+                std::cout << " throughput=" << (writer.bytes() * 80 / elapsed_us) / 10.0 << "Mbit/s";
+            }
+            for (size_t i = 0; i < latency_probes.size(); ++i) {
+                std::cout << " sched_latency[";
+                if (i + 1 < latency_probes.size()) {
+                    std::cout << "capture" << i;
+                } else {
+                    std::cout << "send";
+                }
+                std::cout << "]=" << supercamera::format_latency_summary(latency_probes[i]->summary());
+            }
+            if (opts.adaptive_quant) {
+                std::cout << " quant_scale=" << quant_controller.scale_percent() << "%";
+            }
+            if (opts.motion) {
+                std::cout << " motion_cost=" << supercamera::format_latency_summary(motion_cost.summary());
+                if (elapsed_us > 0) {
+                    // Busy time per wall time since the client connected, in
+                    // percent of one core.
+                    std::cout << " motion_load=" << (motion_busy_ns.load() - client_motion_busy_ns) / elapsed_us / 10.0
+                              << "%";
+                }
+                for (const supercamera::StageMetrics &stage : motion_pipeline->metrics()) {
+                    std::cout << " [" << supercamera::format_stage_metrics(stage) << "]";
+                }
+            }
+            if (opts.motion_gate) {
+                std::cout << " motion_gated=" << gated_frames;
+            }
+            if (opts.suppress_duplicates) {
+                std::cout << " suppressed=" << duplicate_filter.suppressed_count();
+            }
+            if (opts.dedup_headers) {
+                std::cout << " header_saved=" << dedup_saved_bytes << "B";
+            }
+            if (paired) {
+                const PairingStats &pairing = pairer.stats();
+                std::cout << " pairs=" << pairing.pairs << " unpaired=" << pairing.unpaired[0] << "/"
+                          << pairing.unpaired[1] << " skew_mean=" << pairing.mean_skew_us()
+                          << "us skew_max=" << pairing.skew_max_us << "us";
+            }
+            if (opts.optimize_huffman) {
+                for (const supercamera::StageMetrics &stage : huffman_pipeline->metrics()) {
+                    std::cout << " [" << supercamera::format_stage_metrics(stage) << "]";
+                }
+                for (uint16_t source_id = 0; source_id < source_count; ++source_id) {
+                    const uint64_t input = huffman_stats[source_id].input_bytes.load();
+                    const uint64_t output = huffman_stats[source_id].output_bytes.load();
+                    const uint64_t saved = input > output ? input - output : 0;
+                    std::cout << " huffman_saved[" << source_id << "]=" << saved << "B";
+                    if (input > 0) {
+                        std::cout << "(" << (saved * 1000 / input) / 10.0 << "%)";
+                    }
+                }
+            }
+            std::cout << "\n";
+        };
+
+        // Writes the batch; false once the client is gone.
+        auto flush_batch = [&] {
+            batch_deadline.reset();
+            if (batch.empty()) {
+                return true;
+            }
+
+            const auto send_start = std::chrono::steady_clock::now();
+            if (!writer.flush()) {
+                return false;
+            }
+            // The controller wants the link time per frame.
+            const uint64_t send_us = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - send_start)
+                    .count());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                quant_controller.record_send(send_us / batch.size());
+            }
+
+            const uint64_t previous_total = sent_frames.fetch_add(batch.size());
+            const uint64_t total_sent = previous_total + batch.size();
+            client_frames += batch.size();
+            batch.clear();
+            if (opts.log_every > 0 && total_sent / opts.log_every != previous_total / opts.log_every) {
+                log_stats(total_sent);
+            }
+            return true;
+        };
+
         while (!g_stop) {
-            supercamera::CapturedFrame frame{};
-            if (!frame_buffer.wait_next(&frame)) {
-                break;
+            const bool have_frame = batch_deadline ? frame_buffer.wait_next_until(&frame, *batch_deadline)
+                                                   : frame_buffer.wait_next(&frame);
+            if (!have_frame) {
+                // The batch deadline passed, or capture stopped.
+                if (!flush_batch()) {
+                    std::cout << "client disconnected\n";
+                    break;
+                }
+                if (frame_buffer.stopped()) {
+                    break;
+                }
+                continue;
+            }
+
+            if (opts.motion_gate && !motion_active[frame.source_id].load()) {
+                ++gated_frames;
+                continue;
+            }
+
+            // Only frames that are actually sent pay for the transcode. The
+            // "huffman" stage already optimized every frame it could, so
+            // Huffman optimization is only repeated here when something else
+            // forces a re-encode anyway.
+            supercamera::TranscodeOptions transcode = {
+                .crop = opts.crop,
+                .transform = opts.auto_orient ? orientations[frame.source_id].load() : opts.rotate,
+                .quant_scale_percent = opts.adaptive_quant ? quant_controller.scale_percent() : opts.quant_scale_percent,
+                .restart_rows = opts.restart_rows,
+            };
+            transcode.optimize_huffman = opts.optimize_huffman && (opts.stitch || !transcode.is_identity());
+            if (paired) {
+                if (!pairer.push(std::move(frame), &left, &right)) {
+                    continue;
+                }
+                frame.jpeg.clear();
+                if (opts.stitch) {
+                    if (!transcoder.stitch(left.jpeg, right.jpeg, transcode, &transcoded)) {
+                        std::cerr << "stitch failed frame_ids=" << left.frame_id << "/" << right.frame_id
+                                  << ": " << transcoder.last_error() << "\n";
+                        continue;
+                    }
+                    frame.jpeg.swap(transcoded);
+                }
+                frame.source_id = source_count;
+                frame.frame_id = ++paired_frame_id;
+                frame.timestamp_us = std::max(left.timestamp_us, right.timestamp_us);
+                frame.g_sensor.reset();
+            }
+
+            // Repeats are dropped before they cost a transcode. A stereo pair
+            // is sent when either camera's frame changed.
+            if (opts.suppress_duplicates) {
+                if (opts.stereo) {
+                    const bool left_new = duplicate_filter.accept(left);
+                    const bool right_new = duplicate_filter.accept(right);
+                    if (!left_new && !right_new) {
+                        continue;
+                    }
+                } else if (!duplicate_filter.accept(frame)) {
+                    continue;
+                }
+            }
+
+            // Scored on the captured JPEGs: requantization would lower the AC
+            // energy. A pair is as sharp as its blurrier half.
+            if (opts.sharpness) {
+                if (paired) {
+                    const auto left_score = score_sharpness(transcoder, left);
+                    const auto right_score = score_sharpness(transcoder, right);
+                    if (left_score && right_score) {
+                        frame.sharpness = std::min(*left_score, *right_score);
+                    }
+                } else {
+                    frame.sharpness = score_sharpness(transcoder, frame);
+                }
+            }
+
+            if (opts.stereo) {
+                for (supercamera::CapturedFrame *part : {&left, &right}) {
+                    supercamera::TranscodeOptions part_transcode = transcode;
+                    part_transcode.optimize_huffman = false;
+                    if (opts.auto_orient) {
+                        part_transcode.transform = orientations[part->source_id].load();
+                    }
+                    part_transcode.optimize_huffman = opts.optimize_huffman && !part_transcode.is_identity();
+                    if (!part_transcode.is_identity()) {
+                        if (transcoder.transcode(part->jpeg, part_transcode, &transcoded)) {
+                            part->jpeg.swap(transcoded);
+                        } else {
+                            std::cerr << "transcode failed source=" << part->source_id
+                                      << " frame_id=" << part->frame_id << ": " << transcoder.last_error() << "\n";
+                        }
+                    }
+                    append_bundle_part(*part, &frame.jpeg);
+                }
+            } else if (!opts.stitch && !transcode.is_identity()) {
+                if (transcoder.transcode(frame.jpeg, transcode, &transcoded)) {
+                    frame.jpeg.swap(transcoded);
+                } else {
+                    std::cerr << "transcode failed source=" << frame.source_id
+                              << " frame_id=" << frame.frame_id
+                              << ": " << transcoder.last_error() << "\n";
+                }
+            }
+
+            // The encoder is per client and source, so a new client starts
+            // with an IDR. Frames were already thinned out by the latest-frame
+            // buffer above; dropping after this point would break the
+            // reference chain.
+            if (opts.codec == STREAM_CODEC_H264) {
+                std::unique_ptr<supercamera::H264Encoder> &encoder = h264_encoders[frame.source_id];
+                if (!encoder) {
+                    encoder = std::make_unique<supercamera::H264Encoder>(opts.h264);
+                }
+                if (!encoder->encode(frame.jpeg, &transcoded)) {
+                    std::cerr << "H.264 encode failed source=" << frame.source_id << " frame_id=" << frame.frame_id
+                              << ": " << encoder->last_error() << "\n";
+                    continue;
+                }
+                if (transcoded.empty()) {
+                    continue;
+                }
+                frame.jpeg.swap(transcoded);
             }
 
             if (frame.jpeg.size() > MAX_PAYLOAD_SIZE) {
@@ -603,23 +2428,51 @@ int main(int argc, char **argv) {
             if (opts.max_fps > 0) {
                 const auto now = std::chrono::steady_clock::now();
                 if (now < next_send_time) {
+                    // Pacing must not hold a batch past its deadline.
+                    if (!flush_batch()) {
+                        std::cout << "client disconnected\n";
+                        break;
+                    }
                     std::this_thread::sleep_until(next_send_time);
                 }
                 next_send_time = std::chrono::steady_clock::now() + frame_interval;
             }
 
-            const auto header = serialize_header(frame);
-            if (!send_all(client_fd, header.data(), header.size())
-                || !send_all(client_fd, frame.jpeg.data(), frame.jpeg.size())) {
-                std::cout << "client disconnected\n";
-                break;
+            const size_t scan_offset = opts.dedup_headers ? jpeg_scan_offset(frame.jpeg) : 0;
+            if (std::string metadata = format_frame_metadata(frame); !metadata.empty()) {
+                const auto header = serialize_header(frame, metadata.size(), STREAM_FLAG_METADATA, 0, opts.codec);
+                writer.add(header, std::move(metadata));
             }
+            if (scan_offset > 0) {
+                const std::span<const uint8_t> jpeg_header(frame.jpeg.data(), scan_offset);
+                uint16_t template_id = templates.find(frame.source_id, jpeg_header);
+                if (template_id == 0) {
+                    template_id = templates.add(frame.source_id, jpeg_header);
+                    writer.add(serialize_header(frame, jpeg_header.size(), STREAM_FLAG_HEADER_TEMPLATE, template_id),
+                               jpeg_header);
+                } else {
+                    dedup_saved_bytes += scan_offset;
+                }
+                writer.add(serialize_header(frame, frame.jpeg.size() - scan_offset, STREAM_FLAG_SCAN_ONLY, template_id),
+                           std::span<const uint8_t>(frame.jpeg).subspan(scan_offset));
+            } else {
+                writer.add(serialize_header(frame, frame.jpeg.size(), opts.stereo ? STREAM_FLAG_BUNDLE : 0, 0, opts.codec),
+                           frame.jpeg);
+            }
+            batch.add(frame);
 
-            const uint64_t total_sent = ++sent_frames;
-            if (opts.log_every > 0 && total_sent % opts.log_every == 0) {
-                std::cout << "stats: captured=" << captured_frames.load()
-                          << " sent=" << total_sent
-                          << " overwritten=" << frame_buffer.dropped_count() << "\n";
+            // A batch stays open only while another frame is already waiting,
+            // so a lone frame is never delayed.
+            const auto now = std::chrono::steady_clock::now();
+            if (opts.batch_us > 0 && !batch_deadline) {
+                batch_deadline = now + std::chrono::microseconds(opts.batch_us);
+            }
+            if (!batch_deadline || now >= *batch_deadline || !frame_buffer.has_pending()
+                || writer.queued_bytes() >= MAX_BATCH_BYTES || batch.size() >= MAX_BATCH_FRAMES) {
+                if (!flush_batch()) {
+                    std::cout << "client disconnected\n";
+                    break;
+                }
             }
         }
 
@@ -627,15 +2480,7 @@ int main(int argc, char **argv) {
     }
 
     close(server_fd);
-    for (auto &capture : captures) {
-        capture->request_stop();
-    }
-    frame_buffer.stop();
-    for (auto &thread : capture_threads) {
-        if (thread.joinable()) {
-            thread.join();
-        }
-    }
+    stop_capture();
 
     return 0;
 }
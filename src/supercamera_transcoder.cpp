@@ -0,0 +1,743 @@
+#include "supercamera_transcoder.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+
+namespace supercamera {
+namespace {
+
+struct TransformSpec {
+    bool transpose;
+    bool flip_x;
+    bool flip_y;
+};
+
+// Every lossless transform is an optional transpose followed by optional
+// mirroring, applied both to block positions and to coefficients inside each
+// block (mirroring negates the odd horizontal or vertical frequencies).
+TransformSpec spec_for(JpegTransform transform) {
+    switch (transform) {
+    case JpegTransform::None:
+        return {false, false, false};
+    case JpegTransform::FlipHorizontal:
+        return {false, true, false};
+    case JpegTransform::FlipVertical:
+        return {false, false, true};
+    case JpegTransform::Rotate90:
+        return {true, true, false};
+    case JpegTransform::Rotate180:
+        return {false, true, true};
+    case JpegTransform::Rotate270:
+        return {true, false, true};
+    case JpegTransform::Transpose:
+        return {true, false, false};
+    case JpegTransform::Transverse:
+        return {true, true, true};
+    }
+    return {false, false, false};
+}
+
+struct ErrorManager {
+    jpeg_error_mgr pub;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+[[noreturn]] void error_exit(j_common_ptr cinfo) {
+    auto *err = reinterpret_cast<ErrorManager *>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->message);
+    std::longjmp(err->jump, 1);
+}
+
+void silent_output_message(j_common_ptr) {}
+
+struct VectorDestination {
+    jpeg_destination_mgr pub;
+    ByteVector *out;
+};
+
+void init_destination(j_compress_ptr cinfo) {
+    auto *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+    dest->out->resize(std::max<size_t>(dest->out->capacity(), 64 * 1024));
+    dest->pub.next_output_byte = dest->out->data();
+    dest->pub.free_in_buffer = dest->out->size();
+}
+
+boolean empty_output_buffer(j_compress_ptr cinfo) {
+    auto *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+    const size_t used = dest->out->size();
+    dest->out->resize(used * 2);
+    dest->pub.next_output_byte = dest->out->data() + used;
+    dest->pub.free_in_buffer = dest->out->size() - used;
+    return TRUE;
+}
+
+void term_destination(j_compress_ptr cinfo) {
+    auto *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+    dest->out->resize(dest->out->size() - dest->pub.free_in_buffer);
+}
+
+struct Block {
+    JCOEF coef[DCTSIZE2];
+};
+
+struct CoefficientPlane {
+    int component_id = 0;
+    int h_samp = 1;
+    int v_samp = 1;
+    int quant_index = 0;
+    int width_in_blocks = 0;
+    int height_in_blocks = 0;
+    std::vector<Block> blocks;
+
+    Block *row(int y) {
+        return blocks.data() + static_cast<size_t>(y) * static_cast<size_t>(width_in_blocks);
+    }
+
+    const Block *row(int y) const {
+        return blocks.data() + static_cast<size_t>(y) * static_cast<size_t>(width_in_blocks);
+    }
+};
+
+// Whole-frame coefficient image. Quantization tables are kept in natural
+// (row-major) order, as libjpeg stores them.
+struct CoefficientImage {
+    int width = 0;
+    int height = 0;
+    J_COLOR_SPACE color_space = JCS_UNKNOWN;
+    int max_h_samp = 1;
+    int max_v_samp = 1;
+    int plane_count = 0;
+    std::array<CoefficientPlane, MAX_COMPONENTS> planes;
+    std::array<std::array<uint16_t, DCTSIZE2>, NUM_QUANT_TBLS> quant = {};
+    std::array<bool, NUM_QUANT_TBLS> has_quant = {};
+
+    bool mcu_aligned() const {
+        return width % (max_h_samp * DCTSIZE) == 0 && height % (max_v_samp * DCTSIZE) == 0;
+    }
+};
+
+struct WriteOptions {
+    bool optimize_coding = false;
+    int restart_rows = 0;
+};
+
+int round_up(int value, int multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+void apply_transform(const CoefficientImage &src, JpegTransform transform, CoefficientImage *dst) {
+    const TransformSpec spec = spec_for(transform);
+
+    dst->width = spec.transpose ? src.height : src.width;
+    dst->height = spec.transpose ? src.width : src.height;
+    dst->color_space = src.color_space;
+    dst->max_h_samp = spec.transpose ? src.max_v_samp : src.max_h_samp;
+    dst->max_v_samp = spec.transpose ? src.max_h_samp : src.max_v_samp;
+    dst->plane_count = src.plane_count;
+    dst->has_quant = src.has_quant;
+    for (size_t t = 0; t < src.quant.size(); ++t) {
+        for (int v = 0; v < DCTSIZE; ++v) {
+            for (int u = 0; u < DCTSIZE; ++u) {
+                dst->quant[t][static_cast<size_t>(v * DCTSIZE + u)] =
+                    spec.transpose ? src.quant[t][static_cast<size_t>(u * DCTSIZE + v)]
+                                   : src.quant[t][static_cast<size_t>(v * DCTSIZE + u)];
+            }
+        }
+    }
+
+    // Per-coefficient source index and sign, identical for every block.
+    std::array<uint8_t, DCTSIZE2> source_index = {};
+    std::array<int8_t, DCTSIZE2> sign = {};
+    for (int v = 0; v < DCTSIZE; ++v) {
+        for (int u = 0; u < DCTSIZE; ++u) {
+            const auto k = static_cast<size_t>(v * DCTSIZE + u);
+            source_index[k] = static_cast<uint8_t>(spec.transpose ? u * DCTSIZE + v : v * DCTSIZE + u);
+            const bool negate = (spec.flip_x && (u & 1) != 0) != (spec.flip_y && (v & 1) != 0);
+            sign[k] = negate ? -1 : 1;
+        }
+    }
+
+    for (int ci = 0; ci < src.plane_count; ++ci) {
+        const CoefficientPlane &in = src.planes[static_cast<size_t>(ci)];
+        CoefficientPlane &out = dst->planes[static_cast<size_t>(ci)];
+        out.component_id = in.component_id;
+        out.quant_index = in.quant_index;
+        out.h_samp = spec.transpose ? in.v_samp : in.h_samp;
+        out.v_samp = spec.transpose ? in.h_samp : in.v_samp;
+        out.width_in_blocks = spec.transpose ? in.height_in_blocks : in.width_in_blocks;
+        out.height_in_blocks = spec.transpose ? in.width_in_blocks : in.height_in_blocks;
+        out.blocks.resize(static_cast<size_t>(out.width_in_blocks) * static_cast<size_t>(out.height_in_blocks));
+
+        for (int y = 0; y < out.height_in_blocks; ++y) {
+            Block *out_row = out.row(y);
+            const int ty = spec.flip_y ? out.height_in_blocks - 1 - y : y;
+            for (int x = 0; x < out.width_in_blocks; ++x) {
+                const int tx = spec.flip_x ? out.width_in_blocks - 1 - x : x;
+                const Block &block = spec.transpose ? in.row(tx)[ty] : in.row(ty)[tx];
+                JCOEF *coef = out_row[x].coef;
+                for (size_t k = 0; k < DCTSIZE2; ++k) {
+                    coef[k] = static_cast<JCOEF>(block.coef[source_index[k]] * sign[k]);
+                }
+            }
+        }
+    }
+}
+
+int blocks_for(int pixels, int samp, int max_samp) {
+    return (pixels * samp + max_samp * DCTSIZE - 1) / (max_samp * DCTSIZE);
+}
+
+// Copies the whole MCUs covering `region`. The right and bottom edges may end
+// on a partial MCU only where they coincide with the frame edge.
+bool crop_image(const CoefficientImage &src, const CropRegion &region, CoefficientImage *dst) {
+    const int mcu_width = src.max_h_samp * DCTSIZE;
+    const int mcu_height = src.max_v_samp * DCTSIZE;
+    int x = region.x;
+    int y = region.y;
+    if (region.centered) {
+        x = (src.width - region.width) / 2;
+        y = (src.height - region.height) / 2;
+    }
+    x = std::max(x, 0);
+    y = std::max(y, 0);
+    if (region.width <= 0 || region.height <= 0 || x >= src.width || y >= src.height) {
+        return false;
+    }
+
+    const int x0 = x / mcu_width * mcu_width;
+    const int y0 = y / mcu_height * mcu_height;
+    const int x1 = std::min(round_up(x + region.width, mcu_width), src.width);
+    const int y1 = std::min(round_up(y + region.height, mcu_height), src.height);
+
+    dst->width = x1 - x0;
+    dst->height = y1 - y0;
+    dst->color_space = src.color_space;
+    dst->max_h_samp = src.max_h_samp;
+    dst->max_v_samp = src.max_v_samp;
+    dst->plane_count = src.plane_count;
+    dst->quant = src.quant;
+    dst->has_quant = src.has_quant;
+
+    for (int ci = 0; ci < src.plane_count; ++ci) {
+        const CoefficientPlane &in = src.planes[static_cast<size_t>(ci)];
+        CoefficientPlane &out = dst->planes[static_cast<size_t>(ci)];
+        out.component_id = in.component_id;
+        out.h_samp = in.h_samp;
+        out.v_samp = in.v_samp;
+        out.quant_index = in.quant_index;
+        out.width_in_blocks = blocks_for(dst->width, in.h_samp, src.max_h_samp);
+        out.height_in_blocks = blocks_for(dst->height, in.v_samp, src.max_v_samp);
+        out.blocks.resize(static_cast<size_t>(out.width_in_blocks) * static_cast<size_t>(out.height_in_blocks));
+
+        const int block_x = x0 / mcu_width * in.h_samp;
+        const int block_y = y0 / mcu_height * in.v_samp;
+        for (int row = 0; row < out.height_in_blocks; ++row) {
+            std::memcpy(out.row(row), in.row(block_y + row) + block_x,
+                        sizeof(Block) * static_cast<size_t>(out.width_in_blocks));
+        }
+    }
+    return true;
+}
+
+// Places `right` directly after `left`. Both must share height, sampling and
+// quantization so that the blocks can be copied verbatim; the seam must fall
+// on an MCU boundary of the left image.
+const char *stitch_images(const CoefficientImage &left, const CoefficientImage &right, CoefficientImage *dst) {
+    if (left.height != right.height) {
+        return "stitched frames differ in height";
+    }
+    if (left.width % (left.max_h_samp * DCTSIZE) != 0) {
+        return "left frame width is not a multiple of the MCU width";
+    }
+    if (left.plane_count != right.plane_count || left.color_space != right.color_space
+        || left.max_h_samp != right.max_h_samp || left.max_v_samp != right.max_v_samp) {
+        return "stitched frames differ in color layout";
+    }
+    for (int ci = 0; ci < left.plane_count; ++ci) {
+        const CoefficientPlane &a = left.planes[static_cast<size_t>(ci)];
+        const CoefficientPlane &b = right.planes[static_cast<size_t>(ci)];
+        if (a.h_samp != b.h_samp || a.v_samp != b.v_samp || a.quant_index != b.quant_index
+            || left.quant[static_cast<size_t>(a.quant_index)] != right.quant[static_cast<size_t>(b.quant_index)]) {
+            return "stitched frames differ in sampling or quantization";
+        }
+    }
+
+    dst->width = left.width + right.width;
+    dst->height = left.height;
+    dst->color_space = left.color_space;
+    dst->max_h_samp = left.max_h_samp;
+    dst->max_v_samp = left.max_v_samp;
+    dst->plane_count = left.plane_count;
+    dst->quant = left.quant;
+    dst->has_quant = left.has_quant;
+
+    for (int ci = 0; ci < left.plane_count; ++ci) {
+        const CoefficientPlane &a = left.planes[static_cast<size_t>(ci)];
+        const CoefficientPlane &b = right.planes[static_cast<size_t>(ci)];
+        CoefficientPlane &out = dst->planes[static_cast<size_t>(ci)];
+        out.component_id = a.component_id;
+        out.h_samp = a.h_samp;
+        out.v_samp = a.v_samp;
+        out.quant_index = a.quant_index;
+        out.width_in_blocks = a.width_in_blocks + b.width_in_blocks;
+        out.height_in_blocks = a.height_in_blocks;
+        out.blocks.resize(static_cast<size_t>(out.width_in_blocks) * static_cast<size_t>(out.height_in_blocks));
+        for (int row = 0; row < out.height_in_blocks; ++row) {
+            Block *dst_row = out.row(row);
+            std::memcpy(dst_row, a.row(row), sizeof(Block) * static_cast<size_t>(a.width_in_blocks));
+            std::memcpy(dst_row + a.width_in_blocks, b.row(row), sizeof(Block) * static_cast<size_t>(b.width_in_blocks));
+        }
+    }
+    return nullptr;
+}
+
+// Rescales every table by `percent` (clamped to the baseline range 1..255)
+// and requantizes the coefficients to the new steps with rounding. The ratio
+// old/new step is applied in 16.16 fixed point.
+void requantize_image(const CoefficientImage &src, int percent, CoefficientImage *dst) {
+    *dst = src;
+    std::array<std::array<int32_t, DCTSIZE2>, NUM_QUANT_TBLS> ratios = {};
+    for (size_t t = 0; t < src.quant.size(); ++t) {
+        if (!src.has_quant[t]) {
+            continue;
+        }
+        for (size_t k = 0; k < DCTSIZE2; ++k) {
+            const int old_step = src.quant[t][k];
+            const int new_step = std::clamp((old_step * percent + 50) / 100, 1, 255);
+            dst->quant[t][k] = static_cast<uint16_t>(new_step);
+            ratios[t][k] = (old_step * 65536 + new_step / 2) / new_step;
+        }
+    }
+
+    for (int ci = 0; ci < dst->plane_count; ++ci) {
+        CoefficientPlane &plane = dst->planes[static_cast<size_t>(ci)];
+        const std::array<int32_t, DCTSIZE2> &ratio = ratios[static_cast<size_t>(plane.quant_index)];
+        for (Block &block : plane.blocks) {
+            for (size_t k = 0; k < DCTSIZE2; ++k) {
+                const int32_t coef = block.coef[k];
+                if (coef == 0) {
+                    continue;
+                }
+                const auto magnitude = static_cast<int32_t>((int64_t{std::abs(coef)} * ratio[k] + 32768) >> 16);
+                block.coef[k] = static_cast<JCOEF>(coef < 0 ? -magnitude : magnitude);
+            }
+        }
+    }
+}
+
+// Mean AC energy of the first (luma) plane, in dequantized DCT units.
+double luma_ac_energy(const CoefficientImage &image) {
+    const CoefficientPlane &plane = image.planes[0];
+    if (plane.blocks.empty() || !image.has_quant[static_cast<size_t>(plane.quant_index)]) {
+        return 0.0;
+    }
+    const std::array<uint16_t, DCTSIZE2> &quant = image.quant[static_cast<size_t>(plane.quant_index)];
+    uint64_t total = 0;
+    for (const Block &block : plane.blocks) {
+        for (size_t k = 1; k < DCTSIZE2; ++k) {
+            const int64_t value = int64_t{block.coef[k]} * quant[k];
+            total += static_cast<uint64_t>(value * value);
+        }
+    }
+    return static_cast<double>(total) / static_cast<double>(plane.blocks.size() * (DCTSIZE2 - 1));
+}
+
+} // namespace
+
+bool CropRegion::parse(const std::string &text, CropRegion *out) {
+    CropRegion region;
+    std::istringstream input(text);
+    char separator = 0;
+    if (!(input >> region.width >> separator) || separator != 'x' || !(input >> region.height)) {
+        return false;
+    }
+    if (input.peek() == std::char_traits<char>::eof()) {
+        region.centered = true;
+    } else {
+        char plus_x = 0;
+        char plus_y = 0;
+        if (!(input >> plus_x >> region.x >> plus_y >> region.y) || plus_x != '+' || plus_y != '+'
+            || input.peek() != std::char_traits<char>::eof()) {
+            return false;
+        }
+    }
+    if (region.width <= 0 || region.height <= 0 || region.x < 0 || region.y < 0) {
+        return false;
+    }
+    *out = region;
+    return true;
+}
+
+struct JpegTranscoder::Impl {
+    jpeg_decompress_struct src = {};
+    jpeg_compress_struct dst = {};
+    ErrorManager src_err = {};
+    ErrorManager dst_err = {};
+    VectorDestination destination = {};
+    CoefficientImage input;
+    CoefficientImage second;
+    CoefficientImage stitched;
+    CoefficientImage cropped;
+    CoefficientImage transformed;
+    CoefficientImage requantized;
+    std::string last_error;
+    // The standard Huffman tables, as the first jpeg_set_defaults() installed
+    // them. libjpeg-turbo's jpeg_set_defaults() keeps tables that already
+    // exist, and an optimize_coding write leaves its per-image tables in
+    // them, so every write puts these back first.
+    std::array<std::optional<JHUFF_TBL>, NUM_HUFF_TBLS> standard_dc_tables;
+    std::array<std::optional<JHUFF_TBL>, NUM_HUFF_TBLS> standard_ac_tables;
+    bool have_standard_tables = false;
+
+    Impl() {
+        src.err = jpeg_std_error(&src_err.pub);
+        src_err.pub.error_exit = error_exit;
+        src_err.pub.output_message = silent_output_message;
+        dst.err = jpeg_std_error(&dst_err.pub);
+        dst_err.pub.error_exit = error_exit;
+        dst_err.pub.output_message = silent_output_message;
+
+        // jpeg_create_* only fail on library version mismatch or out of memory.
+        if (setjmp(src_err.jump) != 0) {
+            throw std::runtime_error("fatal: jpeg_create_decompress failed");
+        }
+        jpeg_create_decompress(&src);
+        if (setjmp(dst_err.jump) != 0) {
+            jpeg_destroy_decompress(&src);
+            throw std::runtime_error("fatal: jpeg_create_compress failed");
+        }
+        jpeg_create_compress(&dst);
+
+        destination.pub.init_destination = init_destination;
+        destination.pub.empty_output_buffer = empty_output_buffer;
+        destination.pub.term_destination = term_destination;
+    }
+
+    ~Impl() {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+    }
+
+    bool fail(const char *message) {
+        last_error = message;
+        return false;
+    }
+
+    // Applies the crop and transform to an already entropy-decoded image and
+    // encodes the result.
+    bool finish(const CoefficientImage &image, const TranscodeOptions &options, ByteVector *out) {
+        const CoefficientImage *current = &image;
+        if (options.crop.has_value()) {
+            if (!crop_image(*current, *options.crop, &cropped)) {
+                return fail("crop region is outside the image");
+            }
+            current = &cropped;
+        }
+        if (options.transform != JpegTransform::None) {
+            if (!current->mcu_aligned()) {
+                return fail("image size is not a multiple of the MCU size");
+            }
+            apply_transform(*current, options.transform, &transformed);
+            current = &transformed;
+        }
+        if (options.quant_scale_percent != 100) {
+            if (options.quant_scale_percent < MIN_QUANT_SCALE_PERCENT
+                || options.quant_scale_percent > MAX_QUANT_SCALE_PERCENT) {
+                return fail("quantization scale out of range");
+            }
+            requantize_image(*current, options.quant_scale_percent, &requantized);
+            current = &requantized;
+        }
+        if (options.restart_rows < 0 || options.restart_rows > MAX_RESTART_ROWS) {
+            return fail("restart interval out of range");
+        }
+        return write(
+            *current, WriteOptions{.optimize_coding = options.optimize_huffman, .restart_rows = options.restart_rows},
+            out);
+    }
+
+    // Entropy-decodes `jpeg` into `image`. Only trivially destructible locals
+    // live between setjmp and the libjpeg calls that may longjmp back.
+    bool read(std::span<const uint8_t> jpeg, CoefficientImage *image) {
+        if (setjmp(src_err.jump) != 0) {
+            jpeg_abort_decompress(&src);
+            last_error = src_err.message;
+            return false;
+        }
+
+        jpeg_mem_src(&src, jpeg.data(), static_cast<unsigned long>(jpeg.size()));
+        jpeg_read_header(&src, TRUE);
+        jvirt_barray_ptr *arrays = jpeg_read_coefficients(&src);
+
+        image->width = static_cast<int>(src.image_width);
+        image->height = static_cast<int>(src.image_height);
+        image->color_space = src.jpeg_color_space;
+        image->max_h_samp = src.max_h_samp_factor;
+        image->max_v_samp = src.max_v_samp_factor;
+        image->plane_count = src.num_components;
+        for (int t = 0; t < NUM_QUANT_TBLS; ++t) {
+            const JQUANT_TBL *table = src.quant_tbl_ptrs[t];
+            image->has_quant[static_cast<size_t>(t)] = table != nullptr;
+            if (table != nullptr) {
+                std::copy(std::begin(table->quantval), std::end(table->quantval),
+                          image->quant[static_cast<size_t>(t)].begin());
+            }
+        }
+
+        for (int ci = 0; ci < src.num_components; ++ci) {
+            const jpeg_component_info &comp = src.comp_info[ci];
+            CoefficientPlane &plane = image->planes[static_cast<size_t>(ci)];
+            plane.component_id = comp.component_id;
+            plane.h_samp = comp.h_samp_factor;
+            plane.v_samp = comp.v_samp_factor;
+            plane.quant_index = comp.quant_tbl_no;
+            plane.width_in_blocks = static_cast<int>(comp.width_in_blocks);
+            plane.height_in_blocks = static_cast<int>(comp.height_in_blocks);
+            plane.blocks.resize(static_cast<size_t>(plane.width_in_blocks) * static_cast<size_t>(plane.height_in_blocks));
+            for (int y = 0; y < plane.height_in_blocks; ++y) {
+                JBLOCKARRAY rows = (*src.mem->access_virt_barray)(
+                    reinterpret_cast<j_common_ptr>(&src), arrays[ci], static_cast<JDIMENSION>(y), 1, FALSE);
+                std::memcpy(plane.row(y), rows[0], sizeof(Block) * static_cast<size_t>(plane.width_in_blocks));
+            }
+        }
+
+        jpeg_finish_decompress(&src);
+        return true;
+    }
+
+    // Called after jpeg_set_defaults(). Restoring in place, rather than
+    // dropping the tables so jpeg_set_defaults() allocates new ones, keeps
+    // the permanent pool from growing with every write.
+    void restore_standard_huffman_tables() {
+        for (int t = 0; t < NUM_HUFF_TBLS; ++t) {
+            const auto i = static_cast<size_t>(t);
+            JHUFF_TBL *dc = dst.dc_huff_tbl_ptrs[t];
+            JHUFF_TBL *ac = dst.ac_huff_tbl_ptrs[t];
+            if (!have_standard_tables) {
+                standard_dc_tables[i] = dc != nullptr ? std::optional<JHUFF_TBL>(*dc) : std::nullopt;
+                standard_ac_tables[i] = ac != nullptr ? std::optional<JHUFF_TBL>(*ac) : std::nullopt;
+                continue;
+            }
+            if (dc != nullptr && standard_dc_tables[i]) {
+                *dc = *standard_dc_tables[i];
+            }
+            if (ac != nullptr && standard_ac_tables[i]) {
+                *ac = *standard_ac_tables[i];
+            }
+        }
+        have_standard_tables = true;
+    }
+
+    bool write(const CoefficientImage &image, const WriteOptions &options, ByteVector *out) {
+        if (setjmp(dst_err.jump) != 0) {
+            jpeg_abort_compress(&dst);
+            last_error = dst_err.message;
+            return false;
+        }
+
+        dst.image_width = static_cast<JDIMENSION>(image.width);
+        dst.image_height = static_cast<JDIMENSION>(image.height);
+        dst.input_components = image.plane_count;
+        dst.in_color_space = image.color_space;
+        jpeg_set_defaults(&dst);
+        jpeg_set_colorspace(&dst, image.color_space);
+        restore_standard_huffman_tables();
+
+        for (int t = 0; t < NUM_QUANT_TBLS; ++t) {
+            if (!image.has_quant[static_cast<size_t>(t)]) {
+                continue;
+            }
+            unsigned int basic[DCTSIZE2];
+            std::copy(image.quant[static_cast<size_t>(t)].begin(), image.quant[static_cast<size_t>(t)].end(), basic);
+            jpeg_add_quant_table(&dst, t, basic, 100, FALSE);
+        }
+
+        jvirt_barray_ptr arrays[MAX_COMPONENTS] = {};
+        for (int ci = 0; ci < image.plane_count; ++ci) {
+            const CoefficientPlane &plane = image.planes[static_cast<size_t>(ci)];
+            jpeg_component_info &comp = dst.comp_info[ci];
+            comp.component_id = plane.component_id;
+            comp.h_samp_factor = plane.h_samp;
+            comp.v_samp_factor = plane.v_samp;
+            comp.quant_tbl_no = plane.quant_index;
+            arrays[ci] = (*dst.mem->request_virt_barray)(
+                reinterpret_cast<j_common_ptr>(&dst), JPOOL_IMAGE, TRUE,
+                static_cast<JDIMENSION>(round_up(plane.width_in_blocks, plane.h_samp)),
+                static_cast<JDIMENSION>(round_up(plane.height_in_blocks, plane.v_samp)),
+                static_cast<JDIMENSION>(plane.v_samp));
+        }
+
+        dst.optimize_coding = options.optimize_coding ? TRUE : FALSE;
+        dst.restart_in_rows = options.restart_rows;
+        destination.out = out;
+        dst.dest = &destination.pub;
+
+        jpeg_write_coefficients(&dst, arrays);
+        for (int ci = 0; ci < image.plane_count; ++ci) {
+            const CoefficientPlane &plane = image.planes[static_cast<size_t>(ci)];
+            for (int y = 0; y < plane.height_in_blocks; ++y) {
+                JBLOCKARRAY rows = (*dst.mem->access_virt_barray)(
+                    reinterpret_cast<j_common_ptr>(&dst), arrays[ci], static_cast<JDIMENSION>(y), 1, TRUE);
+                std::memcpy(rows[0], plane.row(y), sizeof(Block) * static_cast<size_t>(plane.width_in_blocks));
+            }
+        }
+        jpeg_finish_compress(&dst);
+        return true;
+    }
+};
+
+const char *to_string(JpegTransform transform) {
+    switch (transform) {
+    case JpegTransform::None:
+        return "none";
+    case JpegTransform::FlipHorizontal:
+        return "flip-h";
+    case JpegTransform::FlipVertical:
+        return "flip-v";
+    case JpegTransform::Rotate90:
+        return "rotate-90";
+    case JpegTransform::Rotate180:
+        return "rotate-180";
+    case JpegTransform::Rotate270:
+        return "rotate-270";
+    case JpegTransform::Transpose:
+        return "transpose";
+    case JpegTransform::Transverse:
+        return "transverse";
+    }
+    return "unknown";
+}
+
+bool parse_jpeg_transform(const std::string &text, JpegTransform *out) {
+    for (const JpegTransform transform :
+         {JpegTransform::None, JpegTransform::FlipHorizontal, JpegTransform::FlipVertical, JpegTransform::Rotate90,
+          JpegTransform::Rotate180, JpegTransform::Rotate270, JpegTransform::Transpose, JpegTransform::Transverse}) {
+        if (text == to_string(transform)) {
+            *out = transform;
+            return true;
+        }
+    }
+    return false;
+}
+
+JpegTranscoder::JpegTranscoder()
+    : impl_(std::make_unique<Impl>()) {}
+
+JpegTranscoder::~JpegTranscoder() = default;
+
+JpegTranscoder &JpegTranscoder::for_current_thread() {
+    thread_local JpegTranscoder transcoder;
+    return transcoder;
+}
+
+const std::string &JpegTranscoder::last_error() const {
+    return impl_->last_error;
+}
+
+bool JpegTranscoder::transform(std::span<const uint8_t> jpeg, JpegTransform transform, ByteVector *out) {
+    return transcode(jpeg, TranscodeOptions{.transform = transform}, out);
+}
+
+bool JpegTranscoder::crop(std::span<const uint8_t> jpeg, const CropRegion &region, ByteVector *out) {
+    return transcode(jpeg, TranscodeOptions{.crop = region}, out);
+}
+
+bool JpegTranscoder::transcode(std::span<const uint8_t> jpeg, const TranscodeOptions &options, ByteVector *out) {
+    if (options.is_identity()) {
+        out->assign(jpeg.begin(), jpeg.end());
+        return true;
+    }
+    if (!impl_->read(jpeg, &impl_->input)) {
+        return false;
+    }
+    return impl_->finish(impl_->input, options, out);
+}
+
+bool JpegTranscoder::stitch(
+    std::span<const uint8_t> left, std::span<const uint8_t> right, const TranscodeOptions &options, ByteVector *out) {
+    if (!impl_->read(left, &impl_->input) || !impl_->read(right, &impl_->second)) {
+        return false;
+    }
+    if (const char *error = stitch_images(impl_->input, impl_->second, &impl_->stitched); error != nullptr) {
+        return impl_->fail(error);
+    }
+    return impl_->finish(impl_->stitched, options, out);
+}
+
+bool JpegTranscoder::sharpness(std::span<const uint8_t> jpeg, double *score) {
+    if (!impl_->read(jpeg, &impl_->input)) {
+        return false;
+    }
+    *score = std::sqrt(luma_ac_energy(impl_->input));
+    return true;
+}
+
+JpegTransform OrientationTracker::update(const GSensorSample &sample) {
+    // Ignore readings where gravity is mostly along the optical axis (scope
+    // pointing straight up or down): the roll angle is meaningless there.
+    // The sensor's scale is unknown, so this threshold is a guess in raw
+    // counts; it assumes 1 g reads well above 64.
+    constexpr double min_magnitude = 64.0;
+    constexpr double hysteresis_deg = 15.0;
+
+    const double x = sample.x;
+    const double y = sample.y;
+    if (std::hypot(x, y) < min_magnitude) {
+        return current_;
+    }
+
+    // 0 degrees: gravity points to the bottom edge. Positive angles: gravity
+    // has swung towards the right edge, which a clockwise turn brings back
+    // to the bottom.
+    const double angle = std::atan2(x, y) * 180.0 / 3.14159265358979323846;
+    double current_angle = 0.0;
+    switch (current_) {
+    case JpegTransform::Rotate90:
+        current_angle = 90.0;
+        break;
+    case JpegTransform::Rotate180:
+        current_angle = 180.0;
+        break;
+    case JpegTransform::Rotate270:
+        current_angle = -90.0;
+        break;
+    default:
+        break;
+    }
+
+    double delta = std::fabs(angle - current_angle);
+    if (delta > 180.0) {
+        delta = 360.0 - delta;
+    }
+    if (delta <= 45.0 + hysteresis_deg) {
+        return current_;
+    }
+
+    if (angle >= -45.0 && angle < 45.0) {
+        current_ = JpegTransform::None;
+    } else if (angle >= 45.0 && angle < 135.0) {
+        current_ = JpegTransform::Rotate90;
+    } else if (angle >= -135.0 && angle < -45.0) {
+        current_ = JpegTransform::Rotate270;
+    } else {
+        current_ = JpegTransform::Rotate180;
+    }
+    return current_;
+}
+
+} // namespace supercamera
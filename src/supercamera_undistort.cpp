@@ -0,0 +1,224 @@
+#include "supercamera_undistort.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace supercamera {
+namespace {
+
+constexpr int WEIGHT_BITS = 7;
+constexpr int WEIGHT_ONE = 1 << WEIGHT_BITS;
+
+// Packs the weights of a left/right sample pair into one 32-bit word, left
+// in the low half, matching the lane order _mm_madd_epi16 expects.
+constexpr uint32_t weight_pair(int wx, int row_weight) {
+    return static_cast<uint32_t>((wx * row_weight) << 16) | static_cast<uint32_t>((WEIGHT_ONE - wx) * row_weight);
+}
+
+inline void lerp_pixel_scalar(const uint8_t *s, size_t stride, uint32_t top_weights, uint32_t bottom_weights,
+                              uint8_t *d) {
+    const uint32_t w00 = top_weights & 0xFFFF;
+    const uint32_t w01 = top_weights >> 16;
+    const uint32_t w10 = bottom_weights & 0xFFFF;
+    const uint32_t w11 = bottom_weights >> 16;
+    for (int c = 0; c < 3; ++c) {
+        const uint32_t sum = s[c] * w00 + s[c + 3] * w01 + s[stride + c] * w10 + s[stride + c + 3] * w11;
+        d[c] = static_cast<uint8_t>((sum + (1u << (2 * WEIGHT_BITS - 1))) >> (2 * WEIGHT_BITS));
+    }
+}
+
+#if defined(__SSE2__)
+// Reads 8 bytes from each source row (two BGR pixels plus two spare bytes),
+// interleaves left/right samples per channel and applies all four bilinear
+// weights with two multiply-adds. Returns the pixel in the low 3 bytes.
+inline uint32_t lerp_pixel_sse2(const uint8_t *s, size_t stride, uint32_t top_weights, uint32_t bottom_weights) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i top = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(s)), zero);
+    const __m128i bottom = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(s + stride)), zero);
+    const __m128i top_pairs = _mm_unpacklo_epi16(top, _mm_srli_si128(top, 6));
+    const __m128i bottom_pairs = _mm_unpacklo_epi16(bottom, _mm_srli_si128(bottom, 6));
+
+    __m128i sum = _mm_add_epi32(
+        _mm_madd_epi16(top_pairs, _mm_set1_epi32(static_cast<int>(top_weights))),
+        _mm_madd_epi16(bottom_pairs, _mm_set1_epi32(static_cast<int>(bottom_weights))));
+    sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (2 * WEIGHT_BITS - 1))), 2 * WEIGHT_BITS);
+    const __m128i packed = _mm_packs_epi32(sum, sum);
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(packed, packed)));
+}
+#endif
+
+} // namespace
+
+bool LensCalibration::parse(const std::string &text, LensCalibration *out) {
+    std::vector<double> values;
+    std::istringstream input(text);
+    std::string item;
+    while (std::getline(input, item, ',')) {
+        try {
+            values.push_back(std::stod(item));
+        } catch (...) {
+            return false;
+        }
+    }
+    if (values.size() < 6 || values.size() > 9 || values.size() == 7) {
+        return false;
+    }
+
+    LensCalibration calibration;
+    calibration.fx = values[0];
+    calibration.fy = values[1];
+    calibration.cx = values[2];
+    calibration.cy = values[3];
+    calibration.k1 = values[4];
+    calibration.k2 = values[5];
+    if (values.size() >= 8) {
+        calibration.p1 = values[6];
+        calibration.p2 = values[7];
+    }
+    if (values.size() == 9) {
+        calibration.k3 = values[8];
+    }
+    if (calibration.fx <= 0.0 || calibration.fy <= 0.0) {
+        return false;
+    }
+    *out = calibration;
+    return true;
+}
+
+LensUndistorter::LensUndistorter(const LensCalibration &calibration, int width, int height, WorkerPool *pool)
+    : width_(width),
+      height_(height),
+      tiles_x_((width + TILE_WIDTH - 1) / TILE_WIDTH),
+      tiles_y_((height + TILE_HEIGHT - 1) / TILE_HEIGHT),
+      pool_(pool) {
+    // Rescale the camera matrix when frames are decoded at a reduced size.
+    const double sx = static_cast<double>(width) / calibration.width;
+    const double sy = static_cast<double>(height) / calibration.height;
+    const double fx = calibration.fx * sx;
+    const double fy = calibration.fy * sy;
+    const double cx = calibration.cx * sx;
+    const double cy = calibration.cy * sy;
+    const size_t stride = static_cast<size_t>(width) * 3;
+
+    const size_t count = static_cast<size_t>(width) * static_cast<size_t>(height);
+    lut_.resize(count);
+
+    for (int v = 0; v < height; ++v) {
+        for (int u = 0; u < width; ++u) {
+            const size_t i = static_cast<size_t>(v) * static_cast<size_t>(width) + static_cast<size_t>(u);
+            const double x = (u - cx) / fx;
+            const double y = (v - cy) / fy;
+            const double r2 = x * x + y * y;
+            const double radial = 1.0 + r2 * (calibration.k1 + r2 * (calibration.k2 + r2 * calibration.k3));
+            const double xd = x * radial + 2.0 * calibration.p1 * x * y + calibration.p2 * (r2 + 2.0 * x * x);
+            const double yd = y * radial + calibration.p1 * (r2 + 2.0 * y * y) + 2.0 * calibration.p2 * x * y;
+            const double src_x = fx * xd + cx;
+            const double src_y = fy * yd + cy;
+
+            if (!(src_x >= 0.0 && src_y >= 0.0 && src_x <= width - 1 && src_y <= height - 1)) {
+                lut_[i] = {OUTSIDE, 0, 0};
+                continue;
+            }
+
+            // Keep the 2x2 neighbourhood inside the frame; a weight of
+            // WEIGHT_ONE then selects the last row or column exactly.
+            int x0 = static_cast<int>(src_x);
+            int y0 = static_cast<int>(src_y);
+            int wx = static_cast<int>(std::lround((src_x - x0) * WEIGHT_ONE));
+            int wy = static_cast<int>(std::lround((src_y - y0) * WEIGHT_ONE));
+            if (x0 >= width - 1) {
+                x0 = width - 2;
+                wx = WEIGHT_ONE;
+            }
+            if (y0 >= height - 1) {
+                y0 = height - 2;
+                wy = WEIGHT_ONE;
+            }
+            lut_[i] = {
+                static_cast<uint32_t>(static_cast<size_t>(y0) * stride + static_cast<size_t>(x0) * 3),
+                weight_pair(wx, WEIGHT_ONE - wy),
+                weight_pair(wx, wy),
+            };
+        }
+    }
+}
+
+void LensUndistorter::apply_tile(const BgrImage &src, BgrImage *dst, size_t tile) const {
+    const int tile_x = static_cast<int>(tile % static_cast<size_t>(tiles_x_)) * TILE_WIDTH;
+    const int tile_y = static_cast<int>(tile / static_cast<size_t>(tiles_x_)) * TILE_HEIGHT;
+    const int x_end = std::min(tile_x + TILE_WIDTH, width_);
+    const int y_end = std::min(tile_y + TILE_HEIGHT, height_);
+
+    const size_t src_stride = static_cast<size_t>(src.stride);
+    const uint8_t *src_pixels = src.pixels.data();
+    // 8-byte row loads may run two bytes past the last pixel they use; those
+    // near the end of the buffer take the scalar path.
+    const size_t vector_limit = static_cast<size_t>(src.height - 1) * src_stride - 8;
+
+    for (int v = tile_y; v < y_end; ++v) {
+        uint8_t *d = dst->pixels.data() + static_cast<size_t>(v) * static_cast<size_t>(dst->stride)
+                     + static_cast<size_t>(tile_x) * 3;
+        size_t i = static_cast<size_t>(v) * static_cast<size_t>(width_) + static_cast<size_t>(tile_x);
+        for (int u = tile_x; u < x_end; ++u, ++i, d += 3) {
+            const LutEntry &entry = lut_[i];
+            const uint32_t offset = entry.offset;
+            if (offset == OUTSIDE) {
+                d[0] = 0;
+                d[1] = 0;
+                d[2] = 0;
+                continue;
+            }
+#if defined(__SSE2__)
+            if (offset <= vector_limit) {
+                const uint32_t bgr = lerp_pixel_sse2(src_pixels + offset, src_stride, entry.top_weights, entry.bottom_weights);
+                // A 4-byte store is cheaper than 3 byte stores; its last byte
+                // is overwritten by the next pixel of the row.
+                if (u + 1 < x_end) {
+                    std::memcpy(d, &bgr, 4);
+                } else {
+                    std::memcpy(d, &bgr, 3);
+                }
+                continue;
+            }
+#endif
+            lerp_pixel_scalar(src_pixels + offset, src_stride, entry.top_weights, entry.bottom_weights, d);
+        }
+    }
+}
+
+bool LensUndistorter::apply(const BgrImage &src, BgrImage *dst) const {
+    if (src.width != width_ || src.height != height_ || src.stride != width_ * 3 || width_ < 2 || height_ < 2) {
+        return false;
+    }
+
+    const int stride = width_ * 3;
+    const size_t size = static_cast<size_t>(stride) * static_cast<size_t>(height_);
+    if (dst->pixels.size() < size) {
+        dst->pixels.resize(size);
+    }
+    dst->width = width_;
+    dst->height = height_;
+    dst->stride = stride;
+
+    const size_t tile_count = static_cast<size_t>(tiles_x_) * static_cast<size_t>(tiles_y_);
+    if (pool_ == nullptr) {
+        for (size_t tile = 0; tile < tile_count; ++tile) {
+            apply_tile(src, dst, tile);
+        }
+    } else {
+        pool_->parallel_for(tile_count, [&](size_t tile) { apply_tile(src, dst, tile); });
+    }
+    return true;
+}
+
+} // namespace supercamera
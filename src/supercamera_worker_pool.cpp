@@ -0,0 +1,155 @@
+#include "supercamera_worker_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace supercamera {
+
+namespace {
+
+// The pool and queue index of the current thread when it is a worker.
+thread_local const WorkerPool *current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+} // namespace
+
+WorkerPool::WorkerPool(size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    queues_.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<TaskQueue>());
+    }
+    threads_.reserve(thread_count);
+    try {
+        for (size_t i = 0; i < thread_count; ++i) {
+            threads_.emplace_back([this, i] { worker_loop(i); });
+        }
+    } catch (...) {
+        // The destructor does not run for a constructor that throws, and the
+        // workers already started must not be destroyed while joinable.
+        stop();
+        throw;
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard lock(sleep_mtx_);
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> task) {
+    const size_t index = current_pool == this ? current_queue : next_queue_.fetch_add(1) % queues_.size();
+    {
+        TaskQueue &queue = *queues_[index];
+        std::lock_guard lock(queue.mtx);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard lock(sleep_mtx_);
+        ++pending_;
+    }
+    cv_.notify_one();
+}
+
+bool WorkerPool::take_task(size_t index, std::function<void()> *task) {
+    // Own queue first, then the others starting with the next one, so
+    // thieves spread over the victims.
+    for (size_t i = 0; i < queues_.size(); ++i) {
+        TaskQueue &queue = *queues_[(index + i) % queues_.size()];
+        std::lock_guard lock(queue.mtx);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        *task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        --pending_;
+        if (i > 0) {
+            steals_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+    return false;
+}
+
+void WorkerPool::worker_loop(size_t index) {
+    current_pool = this;
+    current_queue = index;
+    while (true) {
+        std::function<void()> task;
+        if (take_task(index, &task)) {
+            task();
+            continue;
+        }
+
+        // Tasks still queued at shutdown run first.
+        std::unique_lock lock(sleep_mtx_);
+        cv_.wait(lock, [&] { return stopped_ || pending_.load() > 0; });
+        if (stopped_ && pending_.load() == 0) {
+            return;
+        }
+    }
+}
+
+void WorkerPool::parallel_for(size_t count, const std::function<void(size_t)> &fn) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1 || threads_.empty()) {
+        for (size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    struct Batch {
+        std::atomic_size_t next = 0;
+        std::atomic_size_t done = 0;
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+    auto batch = std::make_shared<Batch>();
+    const size_t total = count;
+
+    // Helpers and the caller pull indices from the same counter, so a helper
+    // that starts late simply finds nothing left to do.
+    const auto drain = [batch, total, &fn] {
+        size_t finished = 0;
+        for (size_t i = batch->next.fetch_add(1); i < total; i = batch->next.fetch_add(1)) {
+            fn(i);
+            ++finished;
+        }
+        if (finished > 0 && batch->done.fetch_add(finished) + finished == total) {
+            std::lock_guard lock(batch->mtx);
+            batch->cv.notify_all();
+        }
+    };
+
+    const size_t helpers = std::min(threads_.size(), count - 1);
+    for (size_t i = 0; i < helpers; ++i) {
+        submit(drain);
+    }
+    drain();
+
+    std::unique_lock lock(batch->mtx);
+    batch->cv.wait(lock, [&] { return batch->done.load() == total; });
+}
+
+} // namespace supercamera